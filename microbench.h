@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <math.h>
+#include <string.h>
 #include <chrono>
 
 #ifndef FORCE_INLINE
@@ -16,12 +17,125 @@
 
 namespace microbench
 {
+    enum Freq_Source
+    {
+        FREQ_SOURCE_NONE = 0,
+        FREQ_SOURCE_PERF = 1,    //cycles and task clock perf counters of the benchmark thread
+        FREQ_SOURCE_MSR = 2,     //APERF/MPERF read from /dev/cpu/*/msr
+        FREQ_SOURCE_CPUFREQ = 3, //cpufreq scaling_cur_freq - only the frequency requested by the governor
+    };
+
+    //Effective cpu frequency observed during the measured window. 
+    // Filled by Freq_Probe (see microbench_probes.h) and zero otherwise
+    struct Freq_Stats
+    {
+        double mean_mhz = 0.0;
+        double min_mhz = 0.0;
+        double max_mhz = 0.0;
+        double nominal_mhz = 0.0; //base (non turbo) frequency or 0 if unknown
+
+        //Cycles spent per single run of the measured function. Unlike time this 
+        // does not depend on the turbo/governor state so is comparable across runs and hosts
+        double cycles_per_iter = 0.0;
+
+        int64_t samples = 0;
+        int64_t throttle_events = 0; //thermal throttle events reported by the kernel during the run
+        int32_t source = FREQ_SOURCE_NONE;
+        bool throttled = false;
+        bool governor_performance = false;
+        char governor[16] = {0};
+    };
+
+    //System noise seen on the benchmark cpu during the measured window.
+    // Filled by Noise_Probe (see microbench_probes.h) and zero otherwise
+    struct Noise_Stats
+    {
+        //fraction of accepted batches that overlapped a noise event.
+        // 0 means quiet machine, 1 means every single batch was disturbed
+        double score = 0.0;
+        int64_t noisy_batches = 0;
+        int64_t batches = 0;
+
+        int64_t events = 0; //sampling intervals flagged as noisy
+        int64_t samples = 0;
+
+        //totals over the measured window
+        int64_t interrupts = 0; //device interrupts on the benchmark cpu (not counting timer ticks)
+        int64_t softirqs = 0;   //network, block and tasklet softirqs on the benchmark cpu
+        int64_t voluntary_switches = 0;   //of the benchmark thread
+        int64_t involuntary_switches = 0; //of the benchmark thread - preemptions
+        double max_load = 0.0; //max 1 minute load average seen
+    };
+
+    //Page faults, context switches and memory growth during the measured window.
+    // Filled by Rusage_Probe (see microbench_probes.h) and zero otherwise
+    struct Rusage_Stats
+    {
+        //per single run of the measured function
+        double minor_faults_per_iter = 0.0;
+        double major_faults_per_iter = 0.0;
+        double voluntary_switches_per_iter = 0.0;
+        double involuntary_switches_per_iter = 0.0;
+
+        //totals over the measured window
+        int64_t minor_faults = 0; //faults served without io - mostly the first touch of fresh memory
+        int64_t major_faults = 0; //faults which had to read from disk
+        int64_t voluntary_switches = 0;   //blocking
+        int64_t involuntary_switches = 0; //preemptions
+
+        int64_t rss_begin_kb = 0; //resident memory of the process when the window started
+        int64_t rss_end_kb = 0;
+        int64_t peak_rss_delta_kb = 0; //how much the peak resident memory of the process grew
+        bool thread_only = false; //faults and switches are of the benchmark thread only (else of the whole process)
+    };
+
+    //Throughput of the measured function. Filled by with_throughput() and zero otherwise
+    struct Throughput_Stats
+    {
+        //per single run (ie. already divided by runs_mult)
+        double bytes_per_iter = 0.0;
+        double items_per_iter = 0.0;
+
+        //mean throughput and its 95% confidence interval
+        double bytes_per_second = 0.0;
+        double bytes_per_second_low = 0.0;
+        double bytes_per_second_high = 0.0;
+        double items_per_second = 0.0;
+        double items_per_second_low = 0.0;
+        double items_per_second_high = 0.0;
+    };
+
+    static constexpr int64_t MAX_BENCH_COUNTERS = 8;
+
+    //Statistics of a single user counter (see Bench_Counters). All per single run 
+    // of the measured function (ie. already divided by runs_mult)
+    struct Counter_Stats
+    {
+        char name[32] = {0};
+        double mean = 0.0;      //average increment per run
+        double deviation = 0.0; //deviation of the increment per run
+        double per_second = 0.0;
+        double total = 0.0;     //sum of all increments in the measured window
+    };
+
+    //Signs that the compiler deleted or folded the measured work (see Bench_Result::suspicious)
+    enum Bench_Suspicious
+    {
+        BENCH_SUSPICIOUS_NOOP = 1,            //a call was not measurably slower than an empty loop iteration (see overhead_stats)
+        BENCH_SUSPICIOUS_NO_INSTRUCTIONS = 2, //not clearly more instructions per call than an empty loop iteration (only with the "instructions" counter of Perf_Probe)
+        BENCH_SUSPICIOUS_NO_SCALING = 4,      //the time per call did not grow with the runs per call (see benchmark_scaling)
+    };
+
     struct Bench_Result
     {
         double mean_ms = 0.0;
         double deviation_ms = 0.0;
         double max_ms = 0.0;
         double min_ms = 0.0;
+
+        //half width of the 95% confidence interval of mean_ms
+        // ie. the true mean is with 95% probability within mean_ms +- mean_ci_ms
+        double mean_ci_ms = 0.0;
         
         //the number of runs coallesced into a single measurement
         // usually 1 but can be more for very small functions
@@ -30,11 +144,210 @@ namespace microbench
         int64_t batch_size = 0;
         //the number of times the measured function was run in total
         int64_t iters = 0; 
+        //the runs_mult the benchmark was called with. batch_size and iters already include it
+        int64_t runs_mult = 1;
+
+        Throughput_Stats throughput;
+        Counter_Stats counters[MAX_BENCH_COUNTERS];
+        int64_t counter_count = 0;
+        Freq_Stats freq;
+        Noise_Stats noise;
+        Rusage_Stats rusage;
+
+        //Bench_Suspicious flags. Anything but 0 means the measured work was most likely optimized away.
+        // Only checked when asked for through Bench_Config::suspicious_checks() or by benchmark_scaling
+        uint32_t suspicious = 0;
+    };
+
+    //Probes observe the measured window of a benchmark without being part of the measured function.
+    // begin() is called each time the measured window (re)starts - at the start and once more after warm up, 
+    // batch() after every batch, end() when measuring is finished and report() lets the probe 
+    // write its findings into the result. No_Probe is the default and compiles to nothing.
+    struct No_Probe
+    {
+        FORCE_INLINE void begin() noexcept {}
+        FORCE_INLINE void batch(int64_t batch_time_ns, bool accepted) noexcept { (void) batch_time_ns; (void) accepted; }
+        FORCE_INLINE void end() noexcept {}
+        FORCE_INLINE void report(Bench_Result* result) noexcept { (void) result; }
+    };
+
+    //Combines two probes into one. Use probes(a, b) to construct. 
+    // More can be combined by nesting: auto ab = probes(a, b); auto abc = probes(ab, c);
+    template <typename A, typename B> 
+    struct Probe_Pair
+    {
+        A* a;
+        B* b;
+
+        FORCE_INLINE void begin() noexcept { a->begin(); b->begin(); }
+        FORCE_INLINE void batch(int64_t batch_time_ns, bool accepted) noexcept { a->batch(batch_time_ns, accepted); b->batch(batch_time_ns, accepted); }
+        FORCE_INLINE void end() noexcept { b->end(); a->end(); }
+        FORCE_INLINE void report(Bench_Result* result) noexcept { a->report(result); b->report(result); }
+    };
+
+    template <typename A, typename B> 
+    static Probe_Pair<A, B> probes(A& a, B& b) noexcept { return Probe_Pair<A, B>{&a, &b}; }
+
+    //User defined counters incremented from within the measured function. For example the probe
+    // lengths of a hash table or the number of retries. They are accumulated per batch and reported
+    // in Bench_Result::counters the same way as time is. Pass to benchmark as a probe:
+    //
+    //  Bench_Counters counters;
+    //  int64_t probes = counters.define("probes");
+    //  benchmark(counters, 1000, 50, [&]{ counters.add(probes, table.find_probes(key)); return true; });
+    struct Bench_Counters
+    {
+        double values[MAX_BENCH_COUNTERS] = {0};
+        int64_t count = 0;
+
+        //returns the index of the new counter to be used with add
+        int64_t define(const char* name) noexcept;
+        FORCE_INLINE void add(int64_t index, double value = 1.0) noexcept 
+        { 
+            assert(0 <= index && index < count);
+            values[index] += value; 
+        }
+
+        void begin() noexcept;
+        void batch(int64_t batch_time_ns, bool accepted) noexcept;
+        void end() noexcept {}
+        void report(Bench_Result* result) noexcept;
+
+        //Internals
+        char names[MAX_BENCH_COUNTERS][32] = {{0}};
+        double last[MAX_BENCH_COUNTERS] = {0};
+        double sum[MAX_BENCH_COUNTERS] = {0};
+        double squared_sum[MAX_BENCH_COUNTERS] = {0};
+        int64_t batch_count = 0;
     };
 
     template <class Fn> static Bench_Result benchmark(int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, int64_t runs_mult = 1, int64_t batch_of_clock_accuarcy_multiple = 5) noexcept;
     template <class Fn> static Bench_Result benchmark(int64_t max_time_ms, Fn measured_fn, int64_t runs_mult = 1, int64_t batch_of_clock_accuarcy_multiple = 5) noexcept;
+    //Same as above but lets the probe observe the measured window
+    template <class Probe, class Fn> static Bench_Result benchmark(Probe& probe, int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, int64_t runs_mult = 1, int64_t batch_of_clock_accuarcy_multiple = 5) noexcept;
+
+    //When the benchmark has measured enough
+    enum Bench_Stop
+    {
+        BENCH_STOP_TIME = 0,       //after max_time
+        BENCH_STOP_CONFIDENCE = 1, //as soon as the 95% confidence interval of the mean is within target_ci of the mean or after max_time
+    };
+
+    enum Bench_Stats_Level
+    {
+        BENCH_STATS_FULL = 0, //mean, deviation, min, max and the confidence interval
+        BENCH_STATS_MEAN = 1, //only the mean. deviation_ms and mean_ci_ms are 0, min_ms and max_ms equal to mean_ms
+    };
+
+    enum Bench_Clock
+    {
+        BENCH_CLOCK_DEFAULT = 0, //clock_ns()
+        BENCH_CLOCK_STEADY = 1,  //std::chrono::steady_clock - never jumps when the system time gets adjusted
+    };
+
+    //Options of benchmark() as an alternative to the positional arguments above. The template parameters select
+    // the code of the measurement loop at compile time so what is not asked for is not there at all.
+    // The rest is set through the chainable setters which take any std::chrono duration (sub ms too):
+    //
+    //  constexpr auto config = Bench_Config<BENCH_STATS_MEAN>().max_time(std::chrono::microseconds(500));
+    //  Bench_Result result = benchmark(config, fn);
+    //
+    //Counters and other probes are passed next to the config: benchmark(counters, config, fn)
+    template <Bench_Stats_Level stats_level = BENCH_STATS_FULL, Bench_Stop stop_rule = BENCH_STOP_TIME, Bench_Clock clock = BENCH_CLOCK_DEFAULT>
+    struct Bench_Config
+    {
+        static_assert(stop_rule != BENCH_STOP_CONFIDENCE || stats_level == BENCH_STATS_FULL, "stopping on confidence needs the full statistics");
+
+        int64_t max_time_ns = 1'000'000'000;
+        int64_t warm_up_ns = -1; //negative means max_time_ns / 20
+        int64_t runs_mult = 1;
+        int64_t batch_of_clock_accuarcy_multiple = 5;
+        double target_ci = 0.01; //half width of the confidence interval relative to the mean for BENCH_STOP_CONFIDENCE
+        bool check_suspicious = false; //fill Bench_Result::suspicious. Calibrates overhead_stats() on first use
+        //processed by a single call of the measured function. When not 0 result.throughput is filled (see with_throughput)
+        double bytes_per_call = 0.0;
+        double items_per_call = 0.0;
+
+        template <class Rep, class Period> 
+        constexpr Bench_Config max_time(std::chrono::duration<Rep, Period> time) const noexcept 
+            { Bench_Config out = *this; out.max_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(); return out; }
+        template <class Rep, class Period> 
+        constexpr Bench_Config warm_up(std::chrono::duration<Rep, Period> time) const noexcept 
+            { Bench_Config out = *this; out.warm_up_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(); return out; }
+        constexpr Bench_Config runs(int64_t mult) const noexcept 
+            { Bench_Config out = *this; out.runs_mult = mult; return out; }
+        constexpr Bench_Config batch_multiple(int64_t multiple) const noexcept 
+            { Bench_Config out = *this; out.batch_of_clock_accuarcy_multiple = multiple; return out; }
+        constexpr Bench_Config confidence(double relative_half_width) const noexcept 
+            { Bench_Config out = *this; out.target_ci = relative_half_width; return out; }
+        constexpr Bench_Config suspicious_checks(bool enable = true) const noexcept 
+            { Bench_Config out = *this; out.check_suspicious = enable; return out; }
+        constexpr Bench_Config throughput(double bytes, double items = 0.0) const noexcept 
+            { Bench_Config out = *this; out.bytes_per_call = bytes; out.items_per_call = items; return out; }
+    };
+
+    template <Bench_Stats_Level stats_level, Bench_Stop stop_rule, Bench_Clock clock, class Fn> 
+    static Bench_Result benchmark(Bench_Config<stats_level, stop_rule, clock> const& config, Fn measured_fn) noexcept;
+    template <class Probe, Bench_Stats_Level stats_level, Bench_Stop stop_rule, Bench_Clock clock, class Fn> 
+    static Bench_Result benchmark(Probe& probe, Bench_Config<stats_level, stop_rule, clock> const& config, Fn measured_fn) noexcept;
     
+    //Fills result.throughput given how many bytes and items a single call of the measured function processes
+    // (not a single run - the runs_mult the benchmark was called with is accounted for). 
+    // Returns the modified result so it can be used as: with_throughput(benchmark(1000, fn), 4096)
+    // Benchmarks with a Bench_Config can instead declare the amounts with Bench_Config::throughput()
+    static Bench_Result with_throughput(Bench_Result result, double bytes_per_call, double items_per_call = 0.0) noexcept;
+
+    //Accumulates results of multiple runs of the same benchmark (repetitions, threads...). The mean is weighted by iterations,
+    // deviation and the confidence interval include the spread between the runs. 
+    // Probe results (freq, noise, counters...) are taken from the first run.
+    struct Result_Accumulator
+    {
+        Bench_Result first;
+        int64_t count = 0;
+        double iters = 0;
+        double weighted_mean_sum = 0;
+        double weighted_squares_sum = 0;
+        double means_sum = 0;
+        double means_squared_sum = 0;
+        double max_ci = 0;
+        double min = 0;
+        double max = 0;
+        uint32_t suspicious = 0;
+
+        void add(Bench_Result const& result) noexcept;
+        Bench_Result result() const noexcept;
+    };
+
+    //Runs measured_fn(runs) once with runs and once with 4*runs repetitions per call (runs_mult is set accordingly)
+    // and returns the second result with BENCH_SUSPICIOUS_NO_SCALING when the time per call did not at least double.
+    // Catches work the compiler folded into a closed form or hoisted out of the users loop.
+    template <class Fn> static Bench_Result benchmark_scaling(int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, int64_t runs = 16) noexcept;
+
+    //What benchmark() costs on its own. Each batch pays for one clock_ns() call and each call of the measured
+    // function for one iteration of the loop around it. A function which does nothing thus measures
+    // loop_ms + clock_ms / (batch_size / runs_mult) per call. Measured on first use.
+    struct Overhead_Stats
+    {
+        double clock_ms = 0.0;
+        double loop_ms = 0.0;
+        //as counted by the "instructions" counter of the probe given to overhead_stats(probe). -1 without one
+        double clock_instructions = -1.0;
+        double loop_instructions = -1.0;
+    };
+    static Overhead_Stats const& overhead_stats() noexcept;
+    //Same as above and also counts the instructions through the probe (Perf_Probe with the instructions event).
+    // Measured on every call and overrides what the probe counted so far.
+    template <class Probe> static Overhead_Stats overhead_stats(Probe& probe) noexcept;
+
+    //Returns what is wrong with the result in words or null if the result does not look optimized away
+    static const char* suspicious_reason(Bench_Result const& result) noexcept;
+
+    //Combines results of multiple runs of the same benchmark (see Result_Accumulator)
+    static Bench_Result aggregate_results(Bench_Result const* results, int64_t count) noexcept;
+
+    //Returns the counter with the given name from the result or null if there is no such
+    static Counter_Stats const* find_counter(Bench_Result const& result, const char* name) noexcept;
+
     //Marks a pointer as used for the compiler
     FORCE_INLINE static void use_pointer(char const volatile*) {}
     
@@ -81,14 +394,28 @@ namespace microbench
             int64_t mean_time_estimate = 0;
         };
 
-        template <typename Fn> 
+        template <Bench_Clock clock>
+        FORCE_INLINE static int64_t bench_clock_ns() noexcept
+        {
+            if(clock == BENCH_CLOCK_STEADY)
+            {
+                auto duration = std::chrono::steady_clock::now().time_since_epoch();
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(); 
+            }
+            return clock_ns();
+        }
+
+        //The template parameters are constants so the branches on them below get compiled out
+        template <typename Fn, typename Probe, Bench_Stats_Level stats_level = BENCH_STATS_FULL, Bench_Stop stop_rule = BENCH_STOP_TIME, Bench_Clock clock = BENCH_CLOCK_DEFAULT> 
         Bench_Stats gather_bench_stats(
             Fn measured_fn,
+            Probe& probe,
             int64_t max_time_ns, 
             int64_t warm_up_ns, 
             int64_t batch_time_ns, 
             int64_t min_batch_size = 1, 
-            int64_t min_end_checks = 5) noexcept
+            int64_t min_end_checks = 5,
+            double target_ci = 0.0) noexcept
         {
             assert(min_end_checks > 0);
             assert(min_batch_size > 0);
@@ -111,7 +438,8 @@ namespace microbench
             stats.max_batch_time = 0;
             stats.mean_time_estimate = 0;
 
-            int64_t start = clock_ns();
+            probe.begin();
+            int64_t start = bench_clock_ns<clock>();
             int64_t from = start;
             while(true)
             {
@@ -119,11 +447,11 @@ namespace microbench
                 for(int64_t i = 0; i < stats.batch_size; i++)
                     reject |= (int64_t) !measured_fn(); //we use binary ops to disable short circtuing
 
-                int64_t now = clock_ns();
+                int64_t now = bench_clock_ns<clock>();
                 int64_t batch_time = now - from;
                 int64_t total_time = now - start;
-                from = now;
 
+                probe.batch(batch_time, reject == false);
                 if(reject == false)
                 {
                     //Instead of tracking the times themselves we track
@@ -135,14 +463,31 @@ namespace microbench
                     // largely doesnt matter
                     int64_t delta = batch_time - stats.mean_time_estimate;
                     stats.time_sum         += delta;
-                    stats.squared_time_sum += delta * delta;
                     stats.batch_count      += 1;
+
+                    if(stats_level == BENCH_STATS_FULL)
+                    {
+                        stats.squared_time_sum += delta * delta;
             
-                    if(stats.min_batch_time > delta)
-                       stats.min_batch_time = delta;
+                        if(stats.min_batch_time > delta)
+                           stats.min_batch_time = delta;
                
-                    if(stats.max_batch_time < delta)
-                       stats.max_batch_time = delta;
+                        if(stats.max_batch_time < delta)
+                           stats.max_batch_time = delta;
+                    }
+
+                    //Only once warmed up and with enough batches for the deviation to mean something.
+                    // Compares the squares of both sides to avoid the sqrt (see process_stats)
+                    if(stop_rule == BENCH_STOP_CONFIDENCE && to_time == max_time_ns && stats.batch_count >= 30)
+                    {
+                        double n = (double) stats.batch_count;
+                        double sum = (double) stats.time_sum;
+                        double varience_ns = ((double) stats.squared_time_sum - (sum * sum) / n) / (n - 1.0);
+                        double mean_batch_ns = sum / n + (double) stats.mean_time_estimate;
+                        double max_ci_ns = target_ci * mean_batch_ns;
+                        if(1.96 * 1.96 * varience_ns / n <= max_ci_ns * max_ci_ns)
+                            break;
+                    }
                 }
 
                 if(total_time > to_time)
@@ -183,19 +528,26 @@ namespace microbench
                     stats.min_batch_time = (int64_t) 1 << 62;
                     stats.max_batch_time = 0;
                     to_time = max_time_ns;
+                    probe.begin();
                 }
+
+                //the next batch starts only now so that neither the probe (begin() can join threads
+                // and read sysfs) nor the bookkeeping above is a part of it
+                from = bench_clock_ns<clock>();
             }
      
+            probe.end();
             return stats;
         }
 
         //converts the raw measured stats to meaningful statistics
-        static Bench_Result process_stats(Bench_Stats stats, int64_t runs_mult)
+        //full_stats = false for BENCH_STATS_MEAN where only time_sum was gathered
+        static Bench_Result process_stats(Bench_Stats stats, int64_t runs_mult, bool full_stats = true)
         {
             using namespace microbench::time_consts;
 
-            assert(stats.min_batch_time * stats.batch_count <= stats.time_sum && "min must be smaller than sum");
-            assert(stats.max_batch_time * stats.batch_count >= stats.time_sum && "max must be bigger than sum");
+            assert((full_stats == false || stats.min_batch_time * stats.batch_count <= stats.time_sum) && "min must be smaller than sum");
+            assert((full_stats == false || stats.max_batch_time * stats.batch_count >= stats.time_sum) && "max must be bigger than sum");
         
             //runs_mult is in case we 'batch' our tested function: 
             // ie instead of running the tested function once we run it 100 times
@@ -204,7 +556,8 @@ namespace microbench
             int64_t iters = batch_size * (stats.batch_count);
         
             double batch_deviation_ms = 0;
-            if(stats.batch_count > 1)
+            double mean_ci_ms = 0;
+            if(stats.batch_count > 1 && full_stats)
             {
                 double n = (double) stats.batch_count;
                 double sum = (double) stats.time_sum;
@@ -215,6 +568,11 @@ namespace microbench
 
                 //deviation = sqrt(varience) and deviation is unit dependent just like mean is
                 batch_deviation_ms = sqrt(abs(varience_ns)) / (double) MILISECOND_NANOSECONDS;
+
+                //the mean of a single run is the mean of batches divided by the batch size
+                // so its standard error is: batch_deviation / sqrt(batch_count) / batch_size
+                // 1.96 is the 97.5% quantile of normal distribution => 95% two sided interval
+                mean_ci_ms = 1.96 * batch_deviation_ms / sqrt(n) / (double) batch_size;
             }
 
             double mean_ms = 0.0;
@@ -225,8 +583,8 @@ namespace microbench
             int64_t adjutsted_min = stats.min_batch_time + stats.mean_time_estimate;
             int64_t adjutsted_max = stats.max_batch_time + stats.mean_time_estimate;
 
-            assert(adjutsted_min * stats.batch_count <= adjusted_time_sum);
-            assert(adjutsted_max * stats.batch_count >= adjusted_time_sum);
+            assert(full_stats == false || adjutsted_min * stats.batch_count <= adjusted_time_sum);
+            assert(full_stats == false || adjutsted_max * stats.batch_count >= adjusted_time_sum);
             if(iters != 0)
             {
                 mean_ms = (double) adjusted_time_sum / (double) (iters * MILISECOND_NANOSECONDS);
@@ -268,10 +626,19 @@ namespace microbench
             // happens mostly with noop and generally is not a problem
             if(result.min_ms < 0.0)
                 result.min_ms = 0.0;
+
+            //min and max were not gathered
+            if(full_stats == false)
+            {
+                result.min_ms = mean_ms;
+                result.max_ms = mean_ms;
+            }
             
             result.mean_ms = mean_ms; 
+            result.mean_ci_ms = mean_ci_ms;
             result.batch_size = batch_size;
             result.iters = iters;
+            result.runs_mult = runs_mult;
 
             //results must be plausible
             assert(result.iters >= 0);
@@ -280,6 +647,7 @@ namespace microbench
             assert(result.max_ms >= 0.0);
             assert(result.mean_ms >= 0.0);
             assert(result.deviation_ms >= 0.0);
+            assert(result.mean_ci_ms >= 0.0);
             assert(result.min_ms <= result.mean_ms && result.mean_ms <= result.max_ms);
 
             return result;
@@ -321,20 +689,118 @@ namespace microbench
 
             return stats;
         };
+
+        //the batch loop of gather_bench_stats without the measured function
+        static void empty_loop(int64_t iters) noexcept
+        {
+            int64_t reject = 0;
+            for(int64_t i = 0; i < iters; i++)
+            {
+                read_write_barrier();
+                reject |= (int64_t) !true;
+            }
+            do_no_optimize(reject);
+        }
+
+        static void clock_reads(int64_t count) noexcept
+        {
+            for(int64_t i = 0; i < count; i++)
+                do_no_optimize(clock_ns());
+        }
+
+        //instructions per call of fn(calls) counted by the probe or -1 if it does not count them
+        template <typename Probe, typename Fn>
+        static double count_instructions(Probe& probe, int64_t calls, Fn fn) noexcept
+        {
+            probe.begin();
+            fn(calls);
+            probe.end();
+
+            Bench_Result counted;
+            counted.iters = calls;
+            probe.report(&counted);
+            Counter_Stats const* instructions = find_counter(counted, "instructions");
+            return instructions ? instructions->mean : -1.0;
+        }
+
+        template <typename Probe>
+        static uint32_t find_suspicious(Probe& probe, Bench_Result const& result) noexcept
+        {
+            uint32_t flags = 0;
+            if(result.iters <= 0 || result.runs_mult <= 0)
+                return flags;
+
+            //the loop and the clock are there for every call no matter the runs_mult. A call which
+            // is not clearly slower than them alone did nothing (or at most a few instructions)
+            double calls_per_batch = (double) result.batch_size / (double) result.runs_mult;
+            Overhead_Stats const& overhead = overhead_stats();
+            double empty_call_ms = overhead.loop_ms + overhead.clock_ms / calls_per_batch;
+            double call_ms = result.mean_ms * (double) result.runs_mult;
+            if(call_ms < empty_call_ms * 1.25)
+                flags |= BENCH_SUSPICIOUS_NOOP;
+
+            //The counted window includes the loop and both clock reads of every batch. 
+            // Same margin as above to cover the bookkeeping between batches which is not calibrated
+            if(Counter_Stats const* instructions = find_counter(result, "instructions"))
+            {
+                Overhead_Stats counted = overhead_stats(probe);
+                if(counted.loop_instructions >= 0)
+                {
+                    double empty_call_instructions = counted.loop_instructions + 2 * counted.clock_instructions / calls_per_batch;
+                    if(instructions->mean * (double) result.runs_mult < empty_call_instructions * 1.25 + 1)
+                        flags |= BENCH_SUSPICIOUS_NO_INSTRUCTIONS;
+                }
+            }
+
+            return flags;
+        }
     }
     
-    template <typename Fn> 
-    Bench_Result benchmark(int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, int64_t runs_mult, int64_t batch_of_clock_accuarcy_multiple) noexcept
+    template <typename Probe, Bench_Stats_Level stats_level, Bench_Stop stop_rule, Bench_Clock clock, typename Fn> 
+    Bench_Result benchmark(Probe& probe, Bench_Config<stats_level, stop_rule, clock> const& config, Fn measured_fn) noexcept
     {
         using namespace benchmark_internal;
         (void) calculate_clock_stats(100); //warm up
         Clock_Stats clock_stats = calculate_clock_stats(1000);
-        Bench_Stats stats = gather_bench_stats(measured_fn,
-            max_time_ms * time_consts::MILISECOND_NANOSECONDS, 
-            warm_up_ms * time_consts::MILISECOND_NANOSECONDS,
-            batch_of_clock_accuarcy_multiple * clock_stats.average);
+        int64_t warm_up_ns = config.warm_up_ns >= 0 ? config.warm_up_ns : config.max_time_ns / 20;
+        Bench_Stats stats = gather_bench_stats<Fn, Probe, stats_level, stop_rule, clock>(measured_fn, probe,
+            config.max_time_ns, 
+            warm_up_ns,
+            config.batch_of_clock_accuarcy_multiple * clock_stats.average,
+            1, 5, config.target_ci);
 
-        return process_stats(stats, runs_mult);
+        Bench_Result result = process_stats(stats, config.runs_mult, stats_level == BENCH_STATS_FULL);
+        if(config.bytes_per_call != 0 || config.items_per_call != 0)
+            result = with_throughput(result, config.bytes_per_call, config.items_per_call);
+        probe.report(&result);
+        if(config.check_suspicious)
+            result.suspicious = find_suspicious(probe, result);
+        return result;
+    }
+
+    template <Bench_Stats_Level stats_level, Bench_Stop stop_rule, Bench_Clock clock, typename Fn> 
+    Bench_Result benchmark(Bench_Config<stats_level, stop_rule, clock> const& config, Fn measured_fn) noexcept
+    {
+        No_Probe probe;
+        return benchmark(probe, config, measured_fn);
+    }
+
+    template <typename Probe, typename Fn> 
+    Bench_Result benchmark(Probe& probe, int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, int64_t runs_mult, int64_t batch_of_clock_accuarcy_multiple) noexcept
+    {
+        Bench_Config<> config = Bench_Config<>()
+            .max_time(std::chrono::milliseconds(max_time_ms))
+            .warm_up(std::chrono::milliseconds(warm_up_ms > 0 ? warm_up_ms : 0))
+            .runs(runs_mult)
+            .batch_multiple(batch_of_clock_accuarcy_multiple);
+        return benchmark(probe, config, measured_fn);
+    }
+
+    template <typename Fn> 
+    Bench_Result benchmark(int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, int64_t runs_mult, int64_t batch_of_clock_accuarcy_multiple) noexcept
+    {
+        No_Probe probe;
+        return benchmark(probe, max_time_ms, warm_up_ms, measured_fn, runs_mult, batch_of_clock_accuarcy_multiple);
     }
     
     template <typename Fn> 
@@ -343,6 +809,242 @@ namespace microbench
         return benchmark(max_time_ms, max_time_ms / 20 + 1, measured_fn, runs_mult, batch_of_clock_accuarcy_multiple);
     }
     
+    template <typename Fn> 
+    Bench_Result benchmark_scaling(int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, int64_t runs) noexcept
+    {
+        assert(runs > 0);
+        using namespace std::chrono;
+        auto config = Bench_Config<>()
+            .max_time(milliseconds(max_time_ms / 2))
+            .warm_up(milliseconds(warm_up_ms > 0 ? warm_up_ms : 0))
+            .suspicious_checks();
+        Bench_Result fewer = benchmark(config.runs(runs), [&]{ return measured_fn(runs); });
+        Bench_Result more = benchmark(config.runs(runs * 4), [&]{ return measured_fn(runs * 4); });
+
+        double fewer_call_ms = fewer.mean_ms * (double) runs;
+        double more_call_ms = more.mean_ms * (double) (runs * 4);
+        if(more_call_ms < fewer_call_ms * 2)
+            more.suspicious |= BENCH_SUSPICIOUS_NO_SCALING;
+        return more;
+    }
+
+    static Overhead_Stats const& overhead_stats() noexcept
+    {
+        using namespace microbench::time_consts;
+        //minimum of a few repetitions since we are after the cost without any interference
+        static Overhead_Stats stats = []{
+            const int64_t clock_calls = 1000;
+            const int64_t loop_iters = 100000;
+            int64_t clock_min = (int64_t) 1 << 62;
+            int64_t loop_min = (int64_t) 1 << 62;
+            for(int64_t repeat = 0; repeat < 10; repeat++)
+            {
+                int64_t before = clock_ns();
+                benchmark_internal::clock_reads(clock_calls);
+                int64_t middle = clock_ns();
+                benchmark_internal::empty_loop(loop_iters);
+                int64_t after = clock_ns();
+
+                if(clock_min > middle - before)
+                    clock_min = middle - before;
+                if(loop_min > after - middle)
+                    loop_min = after - middle;
+            }
+
+            Overhead_Stats out;
+            out.clock_ms = (double) clock_min / (double) (clock_calls * MILISECOND_NANOSECONDS);
+            out.loop_ms = (double) loop_min / (double) (loop_iters * MILISECOND_NANOSECONDS);
+            return out;
+        }();
+        return stats;
+    }
+
+    template <typename Probe>
+    Overhead_Stats overhead_stats(Probe& probe) noexcept
+    {
+        using namespace benchmark_internal;
+        Overhead_Stats out = overhead_stats();
+        out.clock_instructions = count_instructions(probe, 1000, clock_reads);
+        out.loop_instructions = count_instructions(probe, 100000, empty_loop);
+        return out;
+    }
+
+    static const char* suspicious_reason(Bench_Result const& result) noexcept
+    {
+        if(result.suspicious & BENCH_SUSPICIOUS_NOOP)
+            return "not slower than an empty loop - the measured work was most likely optimized away";
+        if(result.suspicious & BENCH_SUSPICIOUS_NO_INSTRUCTIONS)
+            return "not more instructions per call than an empty loop - the measured work was most likely optimized away";
+        if(result.suspicious & BENCH_SUSPICIOUS_NO_SCALING)
+            return "time does not grow with the runs per call - the work was most likely folded or hoisted out of the loop";
+        return nullptr;
+    }
+
+    static Bench_Result with_throughput(Bench_Result result, double bytes_per_call, double items_per_call) noexcept
+    {
+        using namespace microbench::time_consts;
+        assert(result.runs_mult > 0);
+
+        Throughput_Stats throughput;
+        throughput.bytes_per_iter = bytes_per_call / (double) result.runs_mult;
+        throughput.items_per_iter = items_per_call / (double) result.runs_mult;
+
+        //throughput = amount / time so the slower end of the time interval gives the lower throughput
+        // and vice versa. When the interval reaches 0 the upper bound is unbounded
+        double mean_s = result.mean_ms / (double) SECOND_MILISECONDS;
+        double slow_s = (result.mean_ms + result.mean_ci_ms) / (double) SECOND_MILISECONDS;
+        double fast_s = (result.mean_ms - result.mean_ci_ms) / (double) SECOND_MILISECONDS;
+        if(mean_s > 0)
+        {
+            throughput.bytes_per_second = throughput.bytes_per_iter / mean_s;
+            throughput.items_per_second = throughput.items_per_iter / mean_s;
+            throughput.bytes_per_second_low = throughput.bytes_per_iter / slow_s;
+            throughput.items_per_second_low = throughput.items_per_iter / slow_s;
+            throughput.bytes_per_second_high = fast_s > 0 ? throughput.bytes_per_iter / fast_s : HUGE_VAL;
+            throughput.items_per_second_high = fast_s > 0 ? throughput.items_per_iter / fast_s : HUGE_VAL;
+        }
+
+        result.throughput = throughput;
+        return result;
+    }
+
+    inline int64_t Bench_Counters::define(const char* name) noexcept
+    {
+        assert(count < MAX_BENCH_COUNTERS && "too many counters");
+        int64_t index = count++;
+        int64_t i = 0;
+        for(; name != nullptr && name[i] != '\0' && i < (int64_t) sizeof names[index] - 1; i++)
+            names[index][i] = name[i];
+        names[index][i] = '\0';
+        return index;
+    }
+
+    inline void Bench_Counters::begin() noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            last[i] = values[i];
+            sum[i] = 0;
+            squared_sum[i] = 0;
+        }
+        batch_count = 0;
+    }
+
+    inline void Bench_Counters::batch(int64_t batch_time_ns, bool accepted) noexcept
+    {
+        (void) batch_time_ns;
+        for(int64_t i = 0; i < count; i++)
+        {
+            //increments from rejected batches are thrown away just like their time
+            double delta = values[i] - last[i];
+            last[i] = values[i];
+            if(accepted)
+            {
+                sum[i] += delta;
+                squared_sum[i] += delta * delta;
+            }
+        }
+        batch_count += (int64_t) accepted;
+    }
+
+    inline void Bench_Counters::report(Bench_Result* result) noexcept
+    {
+        using namespace microbench::time_consts;
+        //appended after counters of other probes reported before us
+        for(int64_t i = 0; i < count && result->counter_count < MAX_BENCH_COUNTERS; i++)
+        {
+            Counter_Stats stats;
+            memcpy(stats.name, names[i], sizeof stats.name);
+            stats.total = sum[i];
+            if(result->iters > 0)
+                stats.mean = sum[i] / (double) result->iters;
+
+            //exactly the same as with time in process_stats: 
+            // deviation of batch sums corrected for the batch size
+            if(batch_count > 1 && result->batch_size > 0)
+            {
+                double n = (double) batch_count;
+                double varience = (squared_sum[i] - (sum[i] * sum[i]) / n) / (n - 1.0);
+                stats.deviation = sqrt(fabs(varience)) / sqrt((double) result->batch_size);
+            }
+
+            if(result->mean_ms > 0)
+                stats.per_second = stats.mean * (double) SECOND_MILISECONDS / result->mean_ms;
+
+            result->counters[result->counter_count++] = stats;
+        }
+    }
+
+    inline void Result_Accumulator::add(Bench_Result const& result) noexcept
+    {
+        if(count == 0)
+        {
+            first = result;
+            min = result.min_ms;
+            max = result.max_ms;
+        }
+
+        double n = (double) result.iters;
+        count += 1;
+        iters += n;
+        weighted_mean_sum += result.mean_ms * n;
+        //E[x^2] = varience + mean^2
+        weighted_squares_sum += (result.deviation_ms * result.deviation_ms + result.mean_ms * result.mean_ms) * n;
+        means_sum += result.mean_ms;
+        means_squared_sum += result.mean_ms * result.mean_ms;
+
+        if(max_ci < result.mean_ci_ms)
+            max_ci = result.mean_ci_ms;
+        if(min > result.min_ms)
+            min = result.min_ms;
+        if(max < result.max_ms)
+            max = result.max_ms;
+        suspicious |= result.suspicious;
+    }
+
+    inline Bench_Result Result_Accumulator::result() const noexcept
+    {
+        if(count <= 1)
+            return first;
+
+        Bench_Result out = first;
+        double mean = iters > 0 ? weighted_mean_sum / iters : 0.0;
+        double varience = iters > 0 ? weighted_squares_sum / iters - mean * mean : 0.0;
+
+        //each run is a single sample of the mean. If they disagree more than
+        // they themselves claim we take the spread between them instead
+        double k = (double) count;
+        double means_varience = (means_squared_sum - means_sum * means_sum / k) / (k - 1.0);
+        double between_ci = 1.96 * sqrt(fabs(means_varience)) / sqrt(k);
+
+        out.mean_ms = mean;
+        out.deviation_ms = sqrt(fabs(varience));
+        out.mean_ci_ms = between_ci > max_ci ? between_ci : max_ci;
+        out.min_ms = min;
+        out.max_ms = max;
+        out.iters = (int64_t) iters;
+        out.suspicious = suspicious;
+        return out;
+    }
+
+    static Bench_Result aggregate_results(Bench_Result const* results, int64_t count) noexcept
+    {
+        Result_Accumulator accumulator;
+        for(int64_t i = 0; i < count; i++)
+            accumulator.add(results[i]);
+
+        return accumulator.result();
+    }
+
+    static Counter_Stats const* find_counter(Bench_Result const& result, const char* name) noexcept
+    {
+        for(int64_t i = 0; i < result.counter_count; i++)
+            if(strcmp(result.counters[i].name, name) == 0)
+                return &result.counters[i];
+
+        return nullptr;
+    }
+
     static int64_t clock_ns() noexcept {
         auto duration = std::chrono::high_resolution_clock::now().time_since_epoch();
         return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(); 
@@ -0,0 +1,384 @@
+#pragma once
+#include "microbench_threads.h"
+#include "microbench_latency.h"
+
+//Allocator benchmarks. Replays allocation patterns against any allocator given as a pair of functions
+// on any number of threads (see benchmark_threads) and reports time per operation, scaling and memory overhead.
+namespace microbench
+{
+    //Allocator under test. Must be thread safe when used with more than one thread.
+    // For malloc replacements which are linked in (jemalloc, mimalloc through LD_PRELOAD...) malloc_allocator() is enough.
+    struct Allocator
+    {
+        const char* name = "";
+        void* context = nullptr;
+        void* (*allocate)(void* context, size_t size) = nullptr;
+        void (*deallocate)(void* context, void* ptr, size_t size) = nullptr;
+    };
+
+    static Allocator malloc_allocator() noexcept;
+
+    enum Alloc_Pattern
+    {
+        ALLOC_LIFO = 0,        //allocate block_count blocks then free them in reverse order
+        ALLOC_FIFO = 1,        //allocate block_count blocks then free them in the same order
+        ALLOC_RANDOM_FREE = 2, //allocate block_count blocks then free them in random order
+        //keeps block_count blocks of random sizes alive and keeps replacing random ones of them.
+        // Over time this fragments the heap.
+        ALLOC_FRAGMENTATION = 3,
+        //threads are paired - even threads allocate and pass the blocks to the next (odd) thread which frees them.
+        // An odd thread_count is rounded down (see Alloc_Result::threads.thread_count). Needs at least 2.
+        ALLOC_CROSS_THREAD = 4,
+    };
+
+    struct Alloc_Options
+    {
+        int32_t pattern = ALLOC_LIFO; //Alloc_Pattern
+        int64_t thread_count = 1;
+        int32_t const* cpus = nullptr; //pin thread i to cpus[i] when not null
+
+        //sizes are uniformly random between min_size and max_size. Set both to the same for a single size class
+        int64_t min_size = 16;
+        int64_t max_size = 256;
+        int64_t block_count = 1024; //blocks allocated per call / kept alive
+        bool touch = true; //write to every page of each allocated block like a real user would (else rss means nothing)
+
+        int64_t max_time_ms = 300;
+        int64_t warm_up_ms = 30;
+        uint64_t seed = 0;
+    };
+
+    struct Alloc_Result
+    {
+        Threads_Result threads; //time of a single call of the pattern (see Alloc_Pattern)
+        double ns_per_op = 0.0;        //average time of a single allocation or free
+        double ops_per_second = 0.0;   //of all threads together
+        int64_t ops = 0;               //allocations and frees done in the measured window
+
+        //Resident memory growth from before the run (with all threads and bookkeeping in place) to its end
+        // before freeing the blocks still alive. rss_overhead is the growth against the bytes in those blocks
+        // (1 means no waste) so it is only meaningful for ALLOC_FRAGMENTATION - the other patterns free
+        // everything they allocate and have no live blocks (0).
+        int64_t rss_delta_kb = 0;
+        int64_t live_bytes = 0;
+        double rss_overhead = 0.0;
+
+        bool ok = false; //false when the options could not be run (ALLOC_CROSS_THREAD with a single thread)
+    };
+
+    //Runs the pattern against the allocator.
+    static Alloc_Result benchmark_allocator(Allocator const& allocator, Alloc_Options const& options) noexcept;
+
+    //Runs benchmark_allocator once for each of the thread counts
+    static void benchmark_allocator_scaling(Allocator const& allocator, Alloc_Options const& options, int64_t const* thread_counts, int64_t count, Alloc_Result* results) noexcept;
+
+    //Runs benchmark_allocator once for each size (as both min_size and max_size)
+    static void benchmark_allocator_sizes(Allocator const& allocator, Alloc_Options const& options, int64_t const* sizes, int64_t count, Alloc_Result* results) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    namespace alloc_internal
+    {
+        static void* malloc_allocate(void*, size_t size) noexcept { return malloc(size); }
+        static void malloc_deallocate(void*, void* ptr, size_t) noexcept { free(ptr); }
+
+        //single producer single consumer ring of blocks for the cross thread pattern.
+        // Padded by hand since new does not respect alignas before c++17
+        struct Block_Ring
+        {
+            static constexpr int64_t CAPACITY = 4096;
+
+            std::atomic<int64_t> head = {0}; //written by consumer
+            char head_padding[threads_internal::PADDING] = {0};
+            std::atomic<int64_t> tail = {0}; //written by producer
+            char tail_padding[threads_internal::PADDING] = {0};
+            void* blocks[CAPACITY] = {0};
+            int64_t sizes[CAPACITY] = {0};
+        };
+
+        struct Alloc_Thread
+        {
+            void** blocks = nullptr;
+            int64_t* sizes = nullptr;   //sizes of the blocks
+            int64_t* order = nullptr;   //order in which to free for ALLOC_RANDOM_FREE
+            int64_t live = 0;
+            uint64_t random_state = 0;
+        };
+
+        //Counts the operations and on the first begin() (on the worker thread before anything is measured)
+        // takes the starting rss once all threads exist and fills the blocks of ALLOC_FRAGMENTATION
+        // so that they are local to the thread which later frees them.
+        struct Alloc_Probe
+        {
+            Bench_Counters counters;
+            Alloc_Thread* thread = nullptr;
+            int64_t index = 0;
+            bool set_up = false;
+
+            //shared
+            Spin_Barrier* barrier = nullptr;
+            int64_t* rss_before = nullptr;
+            Allocator const* allocator = nullptr;
+            Alloc_Options const* options = nullptr;
+            int64_t block_count = 0;
+
+            void begin() noexcept;
+            void batch(int64_t batch_time_ns, bool accepted) noexcept { counters.batch(batch_time_ns, accepted); }
+            void end() noexcept { counters.end(); }
+            void report(Bench_Result* result) noexcept { counters.report(result); }
+        };
+
+        static int64_t random_size(Alloc_Options const& options, uint64_t* random_state) noexcept
+        {
+            int64_t min = options.min_size > 0 ? options.min_size : 1;
+            int64_t max = options.max_size > min ? options.max_size : min;
+            return min + (int64_t) (random_u64(random_state) % (uint64_t) (max - min + 1));
+        }
+
+        FORCE_INLINE static void* allocate(Allocator const& allocator, Alloc_Options const& options, int64_t size) noexcept
+        {
+            void* ptr = allocator.allocate(allocator.context, (size_t) size);
+            if(options.touch && ptr != nullptr)
+                for(int64_t i = 0; i < size; i += 4096)
+                    ((char volatile*) ptr)[i] = 1;
+            return ptr;
+        }
+
+        inline void Alloc_Probe::begin() noexcept
+        {
+            if(set_up == false)
+            {
+                set_up = true;
+                //everyone has its stack by now
+                barrier->wait();
+                if(index == 0)
+                    *rss_before = current_rss_kb();
+                barrier->wait();
+
+                if(options->pattern == ALLOC_FRAGMENTATION)
+                {
+                    for(int64_t i = 0; i < block_count; i++)
+                    {
+                        thread->sizes[i] = random_size(*options, &thread->random_state);
+                        thread->blocks[i] = allocate(*allocator, *options, thread->sizes[i]);
+                    }
+                    thread->live = block_count;
+                }
+                barrier->wait();
+            }
+
+            counters.begin();
+        }
+    }
+
+    static Allocator malloc_allocator() noexcept
+    {
+        Allocator allocator;
+        allocator.name = "malloc";
+        allocator.allocate = alloc_internal::malloc_allocate;
+        allocator.deallocate = alloc_internal::malloc_deallocate;
+        return allocator;
+    }
+
+    static Alloc_Result benchmark_allocator(Allocator const& allocator, Alloc_Options const& options) noexcept
+    {
+        using namespace alloc_internal;
+        Alloc_Result out;
+        int64_t thread_count = options.thread_count > 0 ? options.thread_count : 1;
+        int64_t block_count = options.block_count > 0 ? options.block_count : 1;
+        if(thread_count > MAX_BENCH_THREADS)
+            thread_count = MAX_BENCH_THREADS;
+        //never more threads than asked for - cpus has only thread_count entries
+        if(options.pattern == ALLOC_CROSS_THREAD)
+        {
+            thread_count -= thread_count % 2;
+            if(thread_count < 2)
+                return out;
+        }
+
+        //all bookkeeping is allocated upfront so that the measured window contains only the pattern
+        std::unique_ptr<Alloc_Thread[]> threads(new Alloc_Thread[(size_t) thread_count]);
+        std::unique_ptr<Block_Ring[]> rings;
+        if(options.pattern == ALLOC_CROSS_THREAD)
+            rings.reset(new Block_Ring[(size_t) (thread_count / 2)]);
+
+        for(int64_t t = 0; t < thread_count; t++)
+        {
+            Alloc_Thread* thread = &threads[(size_t) t];
+            thread->blocks = (void**) calloc((size_t) block_count, sizeof(void*));
+            thread->sizes = (int64_t*) calloc((size_t) block_count, sizeof(int64_t));
+            thread->order = (int64_t*) calloc((size_t) block_count, sizeof(int64_t));
+            assert(thread->blocks != nullptr && thread->sizes != nullptr && thread->order != nullptr);
+            thread->random_state = options.seed + (uint64_t) t * 0x9E3779B97F4A7C15ULL;
+
+            //random free order. Shuffled once so that the shuffle isnt measured
+            for(int64_t i = 0; i < block_count; i++)
+                thread->order[i] = i;
+            for(int64_t i = block_count - 1; i > 0; i--)
+            {
+                int64_t j = (int64_t) (random_u64(&thread->random_state) % (uint64_t) (i + 1));
+                int64_t temp = thread->order[i];
+                thread->order[i] = thread->order[j];
+                thread->order[j] = temp;
+            }
+        }
+
+        //each thread counts the allocations and frees it did since the cross thread pattern
+        // does not do the same amount each call
+        int64_t rss_before = -1;
+        Spin_Barrier barrier(thread_count);
+        std::unique_ptr<Alloc_Probe[]> probes(new Alloc_Probe[(size_t) thread_count]);
+        for(int64_t t = 0; t < thread_count; t++)
+        {
+            Alloc_Probe* probe = &probes[(size_t) t];
+            probe->counters.define("ops");
+            probe->thread = &threads[(size_t) t];
+            probe->index = t;
+            probe->barrier = &barrier;
+            probe->rss_before = &rss_before;
+            probe->allocator = &allocator;
+            probe->options = &options;
+            probe->block_count = block_count;
+        }
+
+        std::unique_ptr<Bench_Result[]> per_thread(new Bench_Result[(size_t) thread_count]);
+        out.threads = benchmark_threads(probes.get(), thread_count, options.cpus, options.max_time_ms, options.warm_up_ms, [&](int64_t t){
+            Alloc_Thread* thread = &threads[(size_t) t];
+            switch(options.pattern)
+            {
+                case ALLOC_LIFO:
+                case ALLOC_FIFO:
+                case ALLOC_RANDOM_FREE: {
+                    for(int64_t i = 0; i < block_count; i++)
+                    {
+                        thread->sizes[i] = random_size(options, &thread->random_state);
+                        thread->blocks[i] = allocate(allocator, options, thread->sizes[i]);
+                    }
+
+                    for(int64_t i = 0; i < block_count; i++)
+                    {
+                        int64_t index = options.pattern == ALLOC_LIFO ? block_count - 1 - i
+                            : options.pattern == ALLOC_FIFO ? i
+                            : thread->order[i];
+                        allocator.deallocate(allocator.context, thread->blocks[index], (size_t) thread->sizes[index]);
+                    }
+                    probes[(size_t) t].counters.add(0, (double) (2*block_count));
+                    break;
+                }
+
+                case ALLOC_FRAGMENTATION: {
+                    for(int64_t i = 0; i < block_count; i++)
+                    {
+                        int64_t index = (int64_t) (random_u64(&thread->random_state) % (uint64_t) block_count);
+                        allocator.deallocate(allocator.context, thread->blocks[index], (size_t) thread->sizes[index]);
+                        thread->sizes[index] = random_size(options, &thread->random_state);
+                        thread->blocks[index] = allocate(allocator, options, thread->sizes[index]);
+                    }
+                    probes[(size_t) t].counters.add(0, (double) (2*block_count));
+                    break;
+                }
+
+                case ALLOC_CROSS_THREAD: {
+                    //neither side ever waits for the other since the other might have already finished
+                    Block_Ring* ring = &rings[(size_t) (t / 2)];
+                    int64_t done = 0;
+                    if(t % 2 == 0)
+                    {
+                        int64_t tail = ring->tail.load(std::memory_order_relaxed);
+                        int64_t head = ring->head.load(std::memory_order_acquire);
+                        for(; done < block_count && tail - head < Block_Ring::CAPACITY; done++, tail++)
+                        {
+                            int64_t size = random_size(options, &thread->random_state);
+                            ring->sizes[tail % Block_Ring::CAPACITY] = size;
+                            ring->blocks[tail % Block_Ring::CAPACITY] = allocate(allocator, options, size);
+                        }
+                        ring->tail.store(tail, std::memory_order_release);
+                    }
+                    else
+                    {
+                        int64_t head = ring->head.load(std::memory_order_relaxed);
+                        int64_t tail = ring->tail.load(std::memory_order_acquire);
+                        for(; done < block_count && head < tail; done++, head++)
+                            allocator.deallocate(allocator.context, ring->blocks[head % Block_Ring::CAPACITY], (size_t) ring->sizes[head % Block_Ring::CAPACITY]);
+                        ring->head.store(head, std::memory_order_release);
+                    }
+                    probes[(size_t) t].counters.add(0, (double) done);
+                    break;
+                }
+
+                default: assert(false && "unknown pattern");
+            }
+            return true;
+        }, per_thread.get());
+
+        for(int64_t t = 0; t < thread_count; t++)
+        {
+            Counter_Stats const* ops = find_counter(per_thread[(size_t) t], "ops");
+            if(ops != nullptr)
+            {
+                out.ops += (int64_t) ops->total;
+                out.ops_per_second += ops->per_second;
+            }
+        }
+
+        if(out.ops_per_second > 0)
+            out.ns_per_op = 1e9 * (double) thread_count / out.ops_per_second;
+
+        //whats still alive is what the allocator has to hold on to
+        int64_t rss_after = current_rss_kb();
+        for(int64_t t = 0; t < thread_count; t++)
+            for(int64_t i = 0; i < threads[(size_t) t].live; i++)
+                out.live_bytes += threads[(size_t) t].sizes[i];
+
+        if(rss_before >= 0 && rss_after >= 0)
+            out.rss_delta_kb = rss_after - rss_before;
+        if(out.live_bytes > 0)
+            out.rss_overhead = (double) out.rss_delta_kb * 1024.0 / (double) out.live_bytes;
+
+        out.ok = true;
+
+        //cleanup
+        for(int64_t t = 0; t < thread_count; t++)
+        {
+            Alloc_Thread* thread = &threads[(size_t) t];
+            for(int64_t i = 0; i < thread->live; i++)
+                allocator.deallocate(allocator.context, thread->blocks[i], (size_t) thread->sizes[i]);
+
+            free(thread->blocks);
+            free(thread->sizes);
+            free(thread->order);
+        }
+
+        for(int64_t r = 0; rings != nullptr && r < thread_count / 2; r++)
+        {
+            Block_Ring* ring = &rings[(size_t) r];
+            for(int64_t i = ring->head.load(); i < ring->tail.load(); i++)
+                allocator.deallocate(allocator.context, ring->blocks[i % Block_Ring::CAPACITY], (size_t) ring->sizes[i % Block_Ring::CAPACITY]);
+        }
+
+        return out;
+    }
+
+    static void benchmark_allocator_scaling(Allocator const& allocator, Alloc_Options const& options, int64_t const* thread_counts, int64_t count, Alloc_Result* results) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Alloc_Options with_threads = options;
+            with_threads.thread_count = thread_counts[i];
+            results[i] = benchmark_allocator(allocator, with_threads);
+        }
+    }
+
+    static void benchmark_allocator_sizes(Allocator const& allocator, Alloc_Options const& options, int64_t const* sizes, int64_t count, Alloc_Result* results) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Alloc_Options with_size = options;
+            with_size.min_size = sizes[i];
+            with_size.max_size = sizes[i];
+            results[i] = benchmark_allocator(allocator, with_size);
+        }
+    }
+}
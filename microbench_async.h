@@ -0,0 +1,226 @@
+#pragma once
+#include "microbench_latency.h"
+#include <atomic>
+#include <memory>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+    #if __has_include(<coroutine>)
+        #include <coroutine>
+        #include <exception>
+        #define MICROBENCH_COROUTINES
+    #endif
+#endif
+
+//Driver for asynchronous operations. benchmark() needs the call to be done when the measured function
+// returns - here an operation is started, completes whenever (inline, from the event loop or from another thread)
+// and a new one is started in its place so that there are always concurrency operations in flight.
+// Each operation is timed from its start until its completion fires.
+namespace microbench
+{
+    struct Async_Options
+    {
+        int64_t concurrency = 1; //operations in flight at once
+        int64_t max_time_ms = 500; //warm up included. Operations in flight at the end are waited for
+        int64_t warm_up_ms = 50;
+    };
+
+    struct Async_Result
+    {
+        Latency_Result latency; //from start to completion of the single operations started after warm up
+        double ops_per_second = 0.0; //completions per second after warm up
+        int64_t ops = 0;    //operations started after warm up which completed successfully
+        int64_t failed = 0; //operations started after warm up which completed with ok = false
+        int64_t concurrency = 0;
+    };
+
+    namespace async_internal { struct Async_Slot; }
+
+    //Given to every started operation. Has to be called exactly once when the operation is done
+    // (from any thread). ok = false marks the operation as failed and it is not counted into latency.
+    struct Async_Completion
+    {
+        async_internal::Async_Slot* slot = nullptr;
+        void operator()(bool ok = true) const noexcept;
+    };
+
+    //Keeps options.concurrency operations in flight for max_time_ms. start_fn(Async_Completion done) starts
+    // a single operation. poll_fn() is called in a loop while waiting for completions - run your event loop there
+    // (io_context.poll(), epoll_wait...). If given the histogram is cleared and filled with the latencies.
+    template <typename Start_Fn, typename Poll_Fn>
+    static Async_Result benchmark_async(Async_Options const& options, Start_Fn start_fn, Poll_Fn poll_fn, Latency_Histogram* latency = nullptr) noexcept;
+
+    //Same as above for operations that complete on their own (from other threads). Spins while waiting.
+    template <typename Start_Fn>
+    static Async_Result benchmark_async(Async_Options const& options, Start_Fn start_fn) noexcept;
+
+    //Runs benchmark_async once for each of the concurrency levels
+    template <typename Start_Fn, typename Poll_Fn>
+    static void benchmark_async_concurrency(Async_Options const& options, int64_t const* concurrencies, int64_t count, Start_Fn start_fn, Poll_Fn poll_fn, Async_Result* results) noexcept;
+
+    #ifdef MICROBENCH_COROUTINES
+    //C++20 coroutines. make_task() returns anything that can be co_awaited (the task type of your library).
+    // Each operation is a co_await of a fresh task and completes when the await resumes. The awaited value is ignored.
+    // The task has to be resumed from poll_fn or from other threads - an eagerly completing task is fine too.
+    template <typename Make_Task, typename Poll_Fn>
+    static Async_Result benchmark_coroutine(Async_Options const& options, Make_Task make_task, Poll_Fn poll_fn, Latency_Histogram* latency = nullptr) noexcept;
+    #endif
+}
+
+//Implementation
+namespace microbench
+{
+    namespace async_internal
+    {
+        struct Async_Slot
+        {
+            int64_t started = 0;
+            std::atomic<int64_t> finished = {0}; //0 while in flight
+            std::atomic<bool> ok = {true};
+        };
+
+        #ifdef MICROBENCH_COROUTINES
+        //Coroutine which starts right away and cleans after itself. Only used to co_await the users task.
+        struct Detached_Task
+        {
+            struct promise_type
+            {
+                Detached_Task get_return_object() noexcept { return Detached_Task(); }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() noexcept {}
+                void unhandled_exception() noexcept { std::terminate(); }
+            };
+        };
+
+        template <typename Make_Task>
+        static Detached_Task await_task(Make_Task* make_task, Async_Completion done)
+        {
+            co_await (*make_task)();
+            done();
+        }
+        #endif
+    }
+
+    inline void Async_Completion::operator()(bool ok) const noexcept
+    {
+        int64_t now = clock_ns();
+        slot->ok.store(ok, std::memory_order_relaxed);
+        //0 is reserved for in flight
+        slot->finished.store(now != 0 ? now : 1, std::memory_order_release);
+    }
+
+    template <typename Start_Fn, typename Poll_Fn>
+    static Async_Result benchmark_async(Async_Options const& options, Start_Fn start_fn, Poll_Fn poll_fn, Latency_Histogram* latency) noexcept
+    {
+        using namespace microbench::time_consts;
+        using namespace async_internal;
+
+        std::unique_ptr<Latency_Histogram> own_latency;
+        if(latency == nullptr)
+        {
+            own_latency.reset(new Latency_Histogram());
+            latency = own_latency.get();
+        }
+        latency->clear();
+
+        Async_Result result;
+        int64_t concurrency = options.concurrency > 0 ? options.concurrency : 1;
+        result.concurrency = concurrency;
+
+        const int64_t max_time_ns = options.max_time_ms * MILISECOND_NANOSECONDS;
+        int64_t warm_up_ns = options.warm_up_ms * MILISECOND_NANOSECONDS;
+        if(warm_up_ns > max_time_ns || warm_up_ns < 0)
+            warm_up_ns = 0;
+
+        std::unique_ptr<Async_Slot[]> slots(new Async_Slot[(size_t) concurrency]);
+        const int64_t start = clock_ns();
+        const int64_t measured_from = start + warm_up_ns;
+        const int64_t deadline = start + max_time_ns;
+
+        auto launch = [&](Async_Slot* slot){
+            slot->finished.store(0, std::memory_order_relaxed);
+            slot->started = clock_ns();
+            Async_Completion done;
+            done.slot = slot;
+            start_fn(done);
+        };
+
+        //the completion may fire inline which is fine since we only look at the slots after
+        int64_t in_flight = concurrency;
+        for(int64_t i = 0; i < concurrency; i++)
+            launch(&slots[(size_t) i]);
+
+        int64_t completed_in_window = 0;
+        while(in_flight > 0)
+        {
+            poll_fn();
+
+            int64_t now = clock_ns();
+            for(int64_t i = 0; i < concurrency; i++)
+            {
+                Async_Slot* slot = &slots[(size_t) i];
+                if(slot->started == 0)
+                    continue;
+
+                int64_t finished = slot->finished.load(std::memory_order_acquire);
+                if(finished == 0)
+                    continue;
+
+                if(measured_from <= finished && finished < deadline)
+                    completed_in_window += 1;
+
+                if(slot->started >= measured_from)
+                {
+                    if(slot->ok.load(std::memory_order_relaxed))
+                    {
+                        latency->record(finished - slot->started);
+                        result.ops += 1;
+                    }
+                    else
+                        result.failed += 1;
+                }
+
+                if(now < deadline)
+                    launch(slot);
+                else
+                {
+                    slot->started = 0;
+                    in_flight -= 1;
+                }
+            }
+        }
+
+        result.latency = latency_result(*latency);
+        int64_t window = deadline - measured_from;
+        if(window > 0)
+            result.ops_per_second = (double) completed_in_window * (double) SECOND_NANOSECONDS / (double) window;
+        return result;
+    }
+
+    template <typename Start_Fn>
+    static Async_Result benchmark_async(Async_Options const& options, Start_Fn start_fn) noexcept
+    {
+        return benchmark_async(options, start_fn, []{});
+    }
+
+    template <typename Start_Fn, typename Poll_Fn>
+    static void benchmark_async_concurrency(Async_Options const& options, int64_t const* concurrencies, int64_t count, Start_Fn start_fn, Poll_Fn poll_fn, Async_Result* results) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Async_Options level = options;
+            level.concurrency = concurrencies[i];
+            results[i] = benchmark_async(level, start_fn, poll_fn);
+        }
+    }
+
+    #ifdef MICROBENCH_COROUTINES
+    template <typename Make_Task, typename Poll_Fn>
+    static Async_Result benchmark_coroutine(Async_Options const& options, Make_Task make_task, Poll_Fn poll_fn, Latency_Histogram* latency) noexcept
+    {
+        return benchmark_async(options, [&](Async_Completion done){
+            async_internal::await_task(&make_task, done);
+        }, poll_fn, latency);
+    }
+    #endif
+}
@@ -0,0 +1,436 @@
+#pragma once
+#include "microbench_profile.h"
+#include <typeinfo>
+
+#if defined(__has_include)
+    #if __has_include(<cxxabi.h>)
+        #include <cxxabi.h>
+        #define MICROBENCH_CXXABI
+    #endif
+#endif
+
+//Shows what the compiler did with the measured function. Finds the machine code of the measurement loop
+// (benchmark_internal::gather_bench_stats) instantiated for the given function, disassembles it with objdump
+// (binutils) and checks the code between the two clock reads: whether the function was inlined, whether there
+// is still a loop and whether it was vectorized. The checks are heuristics - read the disassembly when in doubt.
+namespace microbench
+{
+    struct Disassembly
+    {
+        std::string symbol; //demangled name of the instantiation
+        std::string text;   //objdump output of the whole function
+        uint64_t address = 0;
+        int64_t instructions = 0;
+        //instructions which can run between the two clock reads (the batch loop). -1 when they could not be found
+        int64_t measured_instructions = -1;
+
+        bool found = false;        //objdump ran and found the function
+        bool not_inlined = false;  //the measured function is called (directly or through a pointer) instead of inlined
+        bool loop_removed = false; //there is no loop between the clock reads - the calls were hoisted out or folded away
+        bool vectorized = false;   //SIMD arithmetic between the clock reads. Either the measured code itself or the
+                                   // compiler merged several calls into one
+    };
+
+    //Disassembles the measurement loop of benchmark(max_time_ms, warm_up_ms, measured_fn) (or of benchmark(probe, ...)
+    // when given the probe). The function is only used for its type. Has to be called from the same binary
+    // that ran the benchmark - compile with symbols (dont strip).
+    template <typename Fn>
+    static Disassembly disassemble_benchmark(Fn const& measured_fn) noexcept;
+    template <typename Probe, typename Fn>
+    static Disassembly disassemble_benchmark(Probe const& probe, Fn const& measured_fn) noexcept;
+
+    //Same for benchmark(config, measured_fn) and benchmark(probe, config, measured_fn). The config picks a different 
+    // measurement loop so it has to be the same type as the one given to benchmark(). Only its type is used.
+    template <Bench_Stats_Level stats_level, Bench_Stop stop_rule, Bench_Clock clock, typename Fn>
+    static Disassembly disassemble_benchmark(Bench_Config<stats_level, stop_rule, clock> const& config, Fn const& measured_fn) noexcept;
+    template <typename Probe, Bench_Stats_Level stats_level, Bench_Stop stop_rule, Bench_Clock clock, typename Fn>
+    static Disassembly disassemble_benchmark(Probe const& probe, Bench_Config<stats_level, stop_rule, clock> const& config, Fn const& measured_fn) noexcept;
+
+    //Disassembles the function containing address. measured_name is a (part of a) demangled name of the
+    // measured function - calls to it mean it was not inlined. Can be null.
+    static Disassembly disassemble_function(void const* address, const char* measured_name) noexcept;
+
+    //Prints the flags and the disassembly
+    static void print_disassembly(FILE* file, Disassembly const& disassembly) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    namespace disasm_internal
+    {
+        struct Instruction
+        {
+            uint64_t address = 0;
+            std::string mnemonic;
+            std::string operands;
+            uint64_t target = 0; //of direct jumps and calls
+            bool has_target = false;
+        };
+
+        static bool starts_with(std::string const& text, const char* prefix) noexcept
+        {
+            return text.compare(0, strlen(prefix), prefix) == 0;
+        }
+
+        static bool ends_with(std::string const& text, const char* suffix) noexcept
+        {
+            size_t length = strlen(suffix);
+            return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+        }
+
+        //parses "    16cf:\tcall   1040 <foo@plt>". Returns false for anything else (headers, empty lines...)
+        static bool parse_instruction(const char* line, Instruction* instruction) noexcept
+        {
+            char* end = nullptr;
+            unsigned long long address = strtoull(line, &end, 16);
+            if(end == line || end[0] != ':' || end[1] != '\t')
+                return false;
+
+            const char* at = end + 2;
+            //skip prefixes so that "bnd jmp" is a jmp
+            static const char* const prefixes[] = {"bnd ", "notrack ", "lock ", "rep ", "repz ", "repnz ", "repe ", "repne ", "data16 ", "cs ", "ds "};
+            for(bool skipped = true; skipped; )
+            {
+                skipped = false;
+                for(const char* prefix : prefixes)
+                    if(strncmp(at, prefix, strlen(prefix)) == 0)
+                    {
+                        at += strlen(prefix);
+                        skipped = true;
+                    }
+            }
+
+            const char* mnemonic_end = at;
+            while(*mnemonic_end != 0 && *mnemonic_end != ' ' && *mnemonic_end != '\t' && *mnemonic_end != '\n')
+                mnemonic_end++;
+            if(mnemonic_end == at)
+                return false;
+
+            const char* operands = mnemonic_end;
+            while(*operands == ' ' || *operands == '\t')
+                operands++;
+
+            *instruction = Instruction();
+            instruction->address = address;
+            instruction->mnemonic.assign(at, mnemonic_end);
+            instruction->operands = operands;
+            while(instruction->operands.empty() == false && instruction->operands.back() == '\n')
+                instruction->operands.pop_back();
+
+            //the target is the hex number right before " <symbol+offset>"
+            size_t symbol = instruction->operands.find(" <");
+            if(symbol != std::string::npos && instruction->operands[0] != '*')
+            {
+                size_t from = symbol;
+                while(from > 0 && isxdigit((unsigned char) instruction->operands[from - 1]))
+                    from--;
+                if(from < symbol)
+                {
+                    instruction->target = strtoull(instruction->operands.c_str() + from, nullptr, 16);
+                    instruction->has_target = true;
+                }
+            }
+            return true;
+        }
+
+        static bool is_call(Instruction const& in) noexcept
+        {
+            return in.mnemonic == "call" || in.mnemonic == "callq" || in.mnemonic == "bl" || in.mnemonic == "blr";
+        }
+
+        static bool is_return(Instruction const& in) noexcept
+        {
+            return starts_with(in.mnemonic, "ret");
+        }
+
+        static bool is_jump(Instruction const& in) noexcept
+        {
+            return in.mnemonic == "jmp" || in.mnemonic == "jmpq" || in.mnemonic == "b" || in.mnemonic == "br";
+        }
+
+        static bool is_branch(Instruction const& in) noexcept
+        {
+            if(is_jump(in))
+                return false;
+            return (in.mnemonic[0] == 'j') || starts_with(in.mnemonic, "b.")
+                || in.mnemonic == "cbz" || in.mnemonic == "cbnz" || in.mnemonic == "tbz" || in.mnemonic == "tbnz";
+        }
+
+        //a call of a clock function or the inlined counter read (rdtsc on x86, the virtual counter on arm)
+        static bool is_clock_read(Instruction const& in) noexcept
+        {
+            if(in.mnemonic == "rdtsc" || in.mnemonic == "rdtscp")
+                return true;
+            if(in.mnemonic == "mrs" && in.operands.find("cntvct_el0") != std::string::npos)
+                return true;
+            return is_call(in) && (in.operands.find("::now()") != std::string::npos
+                || in.operands.find("clock_gettime") != std::string::npos
+                || in.operands.find("clock_ns") != std::string::npos);
+        }
+
+        static bool is_indirect_call(Instruction const& in) noexcept
+        {
+            return is_call(in) && (in.mnemonic == "blr" || (in.operands.empty() == false && in.operands[0] == '*'));
+        }
+
+        static bool is_vector_arithmetic(Instruction const& in) noexcept
+        {
+            bool wide = in.operands.find("%ymm") != std::string::npos || in.operands.find("%zmm") != std::string::npos;
+            bool narrow = in.operands.find("%xmm") != std::string::npos;
+            static const char* const arm_lanes[] = {".2d", ".4s", ".8h", ".16b", ".2s", ".4h", ".8b"};
+            for(const char* lanes : arm_lanes)
+                if(in.operands.find(lanes) != std::string::npos)
+                    return true;
+
+            if(wide == false && narrow == false)
+                return false;
+
+            std::string op = in.mnemonic[0] == 'v' ? in.mnemonic.substr(1) : in.mnemonic;
+            //scalar float math also lives in xmm registers
+            if(ends_with(op, "ss") || ends_with(op, "sd"))
+                return false;
+
+            static const char* const arithmetic[] = {"padd", "psub", "pmul", "pmadd", "pand", "por", "pmin", "pmax", "psll", "psrl", "psra",
+                "addp", "subp", "mulp", "divp", "sqrtp", "minp", "maxp", "fmadd", "fmsub", "fnmadd"};
+            for(const char* prefix : arithmetic)
+                if(starts_with(op, prefix))
+                    return true;
+
+            return wide;
+        }
+
+        static bool contains_name(std::string const& operands, const char* name) noexcept
+        {
+            return name != nullptr && name[0] != 0 && operands.find(name) != std::string::npos;
+        }
+
+        static void analyze(std::vector<Instruction> const& code, const char* measured_name, Disassembly* out) noexcept
+        {
+            int64_t count = (int64_t) code.size();
+            auto index_of = [&](uint64_t address) -> int64_t {
+                auto found = std::lower_bound(code.begin(), code.end(), address, [](Instruction const& in, uint64_t value){ return in.address < value; });
+                if(found == code.end() || found->address != address)
+                    return -1;
+                return (int64_t) (found - code.begin());
+            };
+
+            int64_t first_clock = -1;
+            for(int64_t i = 0; i < count && first_clock == -1; i++)
+                if(is_clock_read(code[(size_t) i]))
+                    first_clock = i;
+            if(first_clock == -1 || first_clock + 1 >= count)
+                return;
+
+            //everything reachable from the first clock read without going through another one
+            // is the batch loop (and the code leading to it)
+            auto successors = [&](int64_t i, int64_t* next) -> int64_t {
+                Instruction const& in = code[(size_t) i];
+                int64_t next_count = 0;
+                if(is_return(in) || is_clock_read(in) || (in.mnemonic == "br"))
+                    return 0;
+                if(is_jump(in) || is_branch(in))
+                {
+                    int64_t target = in.has_target ? index_of(in.target) : -1;
+                    if(target >= 0)
+                        next[next_count++] = target;
+                    if(is_jump(in))
+                        return next_count;
+                }
+                if(i + 1 < count)
+                    next[next_count++] = i + 1;
+                return next_count;
+            };
+
+            std::vector<uint8_t> state((size_t) count, 0); //0 unvisited, 1 on stack, 2 done
+            std::vector<int64_t> stack;
+            std::vector<int64_t> next_index;
+            bool loop = false;
+            bool reached_clock = false;
+            int64_t measured = 0;
+
+            //iterative dfs looking for back edges (cycles)
+            stack.push_back(first_clock + 1);
+            next_index.push_back(0);
+            state[(size_t) (first_clock + 1)] = 1;
+            while(stack.empty() == false)
+            {
+                int64_t i = stack.back();
+                int64_t next[2] = {0};
+                int64_t next_count = successors(i, next);
+                int64_t& at = next_index.back();
+                if(at == 0)
+                {
+                    Instruction const& in = code[(size_t) i];
+                    measured += 1;
+                    if(is_clock_read(in))
+                        reached_clock = true;
+                    else if(is_call(in) && (is_indirect_call(in) || contains_name(in.operands, measured_name) || in.operands.find("operator()") != std::string::npos))
+                        out->not_inlined = true;
+                    if(is_vector_arithmetic(in))
+                        out->vectorized = true;
+                }
+
+                if(at < next_count)
+                {
+                    int64_t successor = next[at++];
+                    if(state[(size_t) successor] == 1)
+                        loop = true;
+                    else if(state[(size_t) successor] == 0)
+                    {
+                        state[(size_t) successor] = 1;
+                        stack.push_back(successor);
+                        next_index.push_back(0);
+                    }
+                }
+                else
+                {
+                    state[(size_t) i] = 2;
+                    stack.pop_back();
+                    next_index.pop_back();
+                }
+            }
+
+            if(reached_clock == false)
+                return;
+
+            out->measured_instructions = measured;
+            out->loop_removed = loop == false;
+        }
+    }
+
+    static Disassembly disassemble_function(void const* address, const char* measured_name) noexcept
+    {
+        Disassembly out;
+        out.address = (uint64_t) (uintptr_t) address;
+
+        #ifdef MICROBENCH_LINUX
+            using namespace profile_internal;
+            using namespace disasm_internal;
+
+            //the path has to come from our maps - /proc/self/exe in the objdump command would be objdump itself
+            std::vector<Module> modules;
+            std::vector<Mapping> mappings;
+            read_mappings(&modules, &mappings);
+
+            Module const* module = nullptr;
+            for(Mapping const& mapping : mappings)
+                if(mapping.from <= out.address && out.address < mapping.to)
+                    module = &modules[(size_t) mapping.module];
+            if(module == nullptr || module->path[0] != '/' || module->path.find('\'') != std::string::npos)
+                return out;
+
+            uint64_t base = is_absolute_elf(module->path.c_str()) ? 0 : module->base;
+            uint64_t file_address = out.address - base;
+
+            //we dont know the size so we disassemble a generous range and stop at the next symbol
+            char command[4096];
+            snprintf(command, sizeof command, "objdump -d -C --no-show-raw-insn --start-address=0x%llx --stop-address=0x%llx '%s' 2>/dev/null",
+                (unsigned long long) file_address, (unsigned long long) (file_address + (1 << 16)), module->path.c_str());
+            FILE* pipe = popen(command, "r");
+            if(pipe == nullptr)
+                return out;
+
+            std::vector<Instruction> code;
+            std::vector<char> line(1 << 16);
+            bool inside = false;
+            while(fgets(line.data(), (int) line.size(), pipe))
+            {
+                const char* text = line.data();
+                size_t length = strlen(text);
+                //symbol header "0000000000001640 <name>:"
+                if(length > 3 && text[0] != ' ' && strncmp(text + length - 3, ">:\n", 3) == 0)
+                {
+                    if(inside)
+                        break;
+                    inside = true;
+                    const char* name = strchr(text, '<');
+                    if(name != nullptr)
+                        out.symbol.assign(name + 1, text + length - 3);
+                }
+
+                if(inside == false)
+                    continue;
+
+                out.text += text;
+                Instruction instruction;
+                if(parse_instruction(text, &instruction))
+                    code.push_back(instruction);
+            }
+            pclose(pipe);
+
+            out.found = code.empty() == false;
+            out.instructions = (int64_t) code.size();
+            analyze(code, measured_name, &out);
+        #else
+            (void) measured_name;
+        #endif
+
+        return out;
+    }
+
+    namespace disasm_internal
+    {
+        //address is of the gather_bench_stats instantiation for Fn. Taking it makes sure an out of line copy exists.
+        // It is compiled from the same code as the one inlined into benchmark() so it shows the same thing
+        template <typename Fn>
+        static Disassembly disassemble_instantiation(void const* address) noexcept
+        {
+            const char* name = nullptr;
+            #if defined(MICROBENCH_CXXABI) && (defined(__GXX_RTTI) || defined(__cpp_rtti))
+                int status = 0;
+                char* demangled = abi::__cxa_demangle(typeid(Fn).name(), nullptr, nullptr, &status);
+                name = status == 0 ? demangled : nullptr;
+                Disassembly out = disassemble_function(address, name);
+                free(demangled);
+                return out;
+            #else
+                return disassemble_function(address, name);
+            #endif
+        }
+    }
+
+    template <typename Probe, typename Fn>
+    static Disassembly disassemble_benchmark(Probe const&, Fn const&) noexcept
+    {
+        using namespace benchmark_internal;
+        return disasm_internal::disassemble_instantiation<Fn>(reinterpret_cast<void const*>(&gather_bench_stats<Fn, Probe>));
+    }
+
+    template <typename Probe, Bench_Stats_Level stats_level, Bench_Stop stop_rule, Bench_Clock clock, typename Fn>
+    static Disassembly disassemble_benchmark(Probe const&, Bench_Config<stats_level, stop_rule, clock> const&, Fn const&) noexcept
+    {
+        using namespace benchmark_internal;
+        return disasm_internal::disassemble_instantiation<Fn>(reinterpret_cast<void const*>(&gather_bench_stats<Fn, Probe, stats_level, stop_rule, clock>));
+    }
+
+    template <Bench_Stats_Level stats_level, Bench_Stop stop_rule, Bench_Clock clock, typename Fn>
+    static Disassembly disassemble_benchmark(Bench_Config<stats_level, stop_rule, clock> const& config, Fn const& measured_fn) noexcept
+    {
+        No_Probe probe;
+        return disassemble_benchmark(probe, config, measured_fn);
+    }
+
+    template <typename Fn>
+    static Disassembly disassemble_benchmark(Fn const& measured_fn) noexcept
+    {
+        No_Probe probe;
+        return disassemble_benchmark(probe, measured_fn);
+    }
+
+    static void print_disassembly(FILE* file, Disassembly const& disassembly) noexcept
+    {
+        if(disassembly.found == false)
+        {
+            fprintf(file, "disassembly of %p not found (is objdump installed and the binary not stripped?)\n", (void*) (uintptr_t) disassembly.address);
+            return;
+        }
+
+        fprintf(file, "%s\n", disassembly.symbol.c_str());
+        fprintf(file, "instructions: %lld measured: %lld%s%s%s\n", (long long) disassembly.instructions, (long long) disassembly.measured_instructions,
+            disassembly.not_inlined ? " NOT-INLINED" : "",
+            disassembly.loop_removed ? " LOOP-REMOVED" : "",
+            disassembly.vectorized ? " VECTORIZED" : "");
+        fputs(disassembly.text.c_str(), file);
+    }
+}
@@ -0,0 +1,364 @@
+#pragma once
+#include "microbench_latency.h"
+#include <string>
+#include <memory>
+#include <type_traits>
+#include <stdlib.h>
+#include <stdio.h>
+
+//Hash function and hash table benchmarks. Tables can be anything with std::unordered_map like interface
+// so internal tables can be compared against the standard ones with exactly the same methodology.
+namespace microbench
+{
+    enum Key_Distribution
+    {
+        KEYS_UNIFORM = 0,    //uniformly random keys / every key is equally likely to be looked up
+        KEYS_SEQUENTIAL = 1, //0, 1, 2... (bad for identity hashes, great for tables relying on it)
+        KEYS_ZIPF = 2,       //only for lookups: few keys are looked up most of the time (see zipf_theta)
+    };
+
+    //Zipfian distribution over 0..n-1 where 0 is the most likely. Uses the method from
+    // "Quickly Generating Billion-Record Synthetic Databases" (Gray et al.) same as YCSB.
+    struct Zipf_Generator
+    {
+        int64_t n = 0;
+        double theta = 0; //skew. 0 is uniform, 0.99 is the YCSB default. Must not be 1
+        double alpha = 0;
+        double zeta_n = 0;
+        double eta = 0;
+        double half_pow_theta = 0;
+
+        Zipf_Generator(int64_t n, double theta) noexcept;
+        int64_t next(uint64_t* random_state) const noexcept;
+    };
+
+    struct Hash_Function_Options
+    {
+        int64_t min_length = 1;
+        int64_t max_length = 1024;
+        double length_step = 2.0; //each length is this many times the previous one (rounded)
+        int64_t key_count = 1024; //distinct random keys of each length the benchmark cycles through
+
+        //When true the next key depends on the previous hash so we measure latency instead of throughput
+        bool chained = false;
+        int64_t max_time_ms = 100; //for each length
+        int64_t warm_up_ms = 10;
+        uint64_t seed = 0;
+    };
+
+    struct Hash_Function_Point
+    {
+        int64_t length = 0;
+        Bench_Result result; //time per hash and throughput in bytes and keys
+    };
+
+    //Benchmarks hash(const char* data, size_t length) for keys of every length of the sweep. Writes at most
+    // capacity points and returns their count.
+    template <typename Hash>
+    static int64_t benchmark_hash_function(Hash hash, Hash_Function_Options const& options, Hash_Function_Point* points, int64_t capacity) noexcept;
+
+    struct Hash_Table_Options
+    {
+        int64_t key_count = 1 << 20; //how many keys the table holds
+        //Target load factor. The table is reserved for key_count / load_factor elements before inserting.
+        // 0 means no reserve - the table grows naturally
+        double load_factor = 0;
+
+        int32_t keys = KEYS_UNIFORM;    //Key_Distribution of the inserted keys (uniform or sequential)
+        int32_t lookups = KEYS_UNIFORM; //Key_Distribution of the looked up keys (uniform or zipf)
+        double zipf_theta = 0.99;
+        int64_t string_length = 16; //length of std::string keys. Keys are unique from 16 up
+
+        int64_t max_time_ms = 200; //for each of the operations
+        int64_t warm_up_ms = 20;
+        uint64_t seed = 0;
+    };
+
+    struct Hash_Table_Result
+    {
+        //all per single operation
+        Bench_Result insert;      //into a table growing from empty up to key_count
+        Bench_Result lookup_hit;
+        Bench_Result lookup_miss;
+        Bench_Result erase;       //from a full table down to empty
+        Bench_Result iterate;     //per element
+
+        //load factor of the full table or -1 if the table does not have load_factor()
+        double load_factor = -1;
+        int64_t key_count = 0;
+        //false when Key is too narrow to hold key_count distinct keys plus as many missing ones.
+        // Then inserts and erases hit duplicates and lookup_miss includes hits
+        bool keys_unique = true;
+    };
+
+    //Benchmarks insert, hit/miss lookup, erase and iteration of Map. Map needs to be default constructible
+    // and have emplace(key, value), find(key), end(), erase(key), clear() and be iterable.
+    // reserve(size) and load_factor() are used when present. All keys and lookup sequences are generated
+    // upfront and the unmeasured work (refilling the table...) is excluded with reject.
+    //Keys are made with make_hash_key() which has overloads for integers and std::string.
+    // Overload it in namespace microbench for your own key types.
+    template <typename Map>
+    static Hash_Table_Result benchmark_hash_table(Hash_Table_Options const& options) noexcept;
+
+    //Runs benchmark_hash_table for each of the load factors.
+    template <typename Map>
+    static void benchmark_hash_table_load_factors(Hash_Table_Options const& options, double const* load_factors, int64_t count, Hash_Table_Result* results) noexcept;
+
+    template <typename Int, typename std::enable_if<std::is_integral<Int>::value, int>::type = 0>
+    static void make_hash_key(uint64_t value, int64_t string_length, Int* key) noexcept;
+    static void make_hash_key(uint64_t value, int64_t string_length, std::string* key) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    inline Zipf_Generator::Zipf_Generator(int64_t n, double theta) noexcept : n(n), theta(theta)
+    {
+        assert(n > 0 && theta >= 0 && theta != 1.0);
+        for(int64_t i = 1; i <= n; i++)
+            zeta_n += 1.0 / pow((double) i, theta);
+
+        double zeta_2 = 1.0 + pow(0.5, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / (double) n, 1.0 - theta)) / (1.0 - zeta_2 / zeta_n);
+        half_pow_theta = pow(0.5, theta);
+    }
+
+    inline int64_t Zipf_Generator::next(uint64_t* random_state) const noexcept
+    {
+        double u = random_f64(random_state);
+        double uz = u * zeta_n;
+        if(uz < 1.0)
+            return 0;
+        if(uz < 1.0 + half_pow_theta || n < 3)
+            return n > 1 ? 1 : 0;
+
+        int64_t value = (int64_t) ((double) n * pow(eta*u - eta + 1.0, alpha));
+        return value < n ? value : n - 1;
+    }
+
+    template <typename Int, typename std::enable_if<std::is_integral<Int>::value, int>::type>
+    static void make_hash_key(uint64_t value, int64_t, Int* key) noexcept
+    {
+        *key = (Int) value;
+    }
+
+    static void make_hash_key(uint64_t value, int64_t string_length, std::string* key) noexcept
+    {
+        //random looking printable prefix followed by the value in hex so that the keys are unique
+        // but dont differ only in the first few characters
+        static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+        char hex[17];
+        snprintf(hex, sizeof hex, "%016llx", (unsigned long long) value);
+
+        int64_t length = string_length > 0 ? string_length : 1;
+        key->resize((size_t) length);
+        uint64_t state = value;
+        for(int64_t i = 0; i < length; i++)
+        {
+            int64_t from_end = length - i;
+            if(from_end <= 16)
+                (*key)[(size_t) i] = hex[16 - from_end];
+            else
+                (*key)[(size_t) i] = alphabet[random_u64(&state) % (sizeof alphabet - 1)];
+        }
+    }
+
+    namespace hash_internal
+    {
+        //we use reserve and load_factor only when the map has them
+        template <typename Map>
+        static auto reserve_if_can(Map* map, size_t size, int) noexcept -> decltype(map->reserve(size), void()) { map->reserve(size); }
+        template <typename Map>
+        static void reserve_if_can(Map*, size_t, long) noexcept {}
+
+        template <typename Map>
+        static auto load_factor_if_can(Map const& map, int) noexcept -> decltype((double) map.load_factor()) { return (double) map.load_factor(); }
+        template <typename Map>
+        static double load_factor_if_can(Map const&, long) noexcept { return -1; }
+
+        static uint64_t make_key_value(int32_t distribution, int64_t index, uint64_t* random_state) noexcept
+        {
+            if(distribution == KEYS_SEQUENTIAL)
+                return (uint64_t) index;
+            return random_u64(random_state);
+        }
+    }
+
+    template <typename Hash>
+    static int64_t benchmark_hash_function(Hash hash, Hash_Function_Options const& options, Hash_Function_Point* points, int64_t capacity) noexcept
+    {
+        int64_t max_length = options.max_length > options.min_length ? options.max_length : options.min_length;
+        int64_t key_count = options.key_count > 0 ? options.key_count : 1;
+        char* keys = (char*) malloc((size_t) (max_length * key_count));
+        assert(keys != nullptr);
+
+        uint64_t random_state = options.seed;
+        for(int64_t i = 0; i < max_length * key_count; i++)
+            keys[i] = (char) random_u64(&random_state);
+
+        int64_t count = 0;
+        for(double length_f = (double) (options.min_length > 0 ? options.min_length : 1); length_f <= (double) max_length && count < capacity; )
+        {
+            int64_t length = (int64_t) length_f;
+            int64_t index = 0;
+            Bench_Result result = benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+                uint64_t hashed = (uint64_t) hash((const char*) keys + index*length, (size_t) length);
+                do_no_optimize(hashed);
+
+                //in chained mode the next key cannot be known before the hash is done
+                index += options.chained ? 1 + (int64_t) (hashed & 1) : 1;
+                if(index >= key_count)
+                    index = 0;
+                return true;
+            });
+
+            Hash_Function_Point* point = &points[count++];
+            point->length = length;
+            point->result = with_throughput(result, (double) length, 1.0);
+
+            double next = length_f * options.length_step;
+            length_f = (int64_t) next > length ? next : (double) (length + 1);
+        }
+
+        free(keys);
+        return count;
+    }
+
+    template <typename Map>
+    static Hash_Table_Result benchmark_hash_table(Hash_Table_Options const& options) noexcept
+    {
+        using namespace hash_internal;
+        typedef typename Map::key_type Key;
+        typedef typename Map::mapped_type Value;
+
+        Hash_Table_Result out;
+        int64_t key_count = options.key_count > 0 ? options.key_count : 1;
+        out.key_count = key_count;
+
+        uint64_t random_state = options.seed;
+        std::unique_ptr<Key[]> keys(new Key[(size_t) key_count]);
+        std::unique_ptr<Key[]> missing(new Key[(size_t) key_count]);
+
+        //the order of lookups. Power of two so we can wrap with a mask
+        int64_t lookup_count = 1;
+        while(lookup_count < key_count && lookup_count < (1 << 22))
+            lookup_count *= 2;
+        int64_t lookup_mask = lookup_count - 1;
+        std::unique_ptr<int64_t[]> lookups(new int64_t[(size_t) lookup_count]);
+        if(options.lookups == KEYS_ZIPF)
+        {
+            Zipf_Generator zipf(key_count, options.zipf_theta);
+            for(int64_t i = 0; i < lookup_count; i++)
+                lookups[(size_t) i] = zipf.next(&random_state);
+        }
+        else
+        {
+            for(int64_t i = 0; i < lookup_count; i++)
+                lookups[(size_t) i] = (int64_t) (random_u64(&random_state) % (uint64_t) key_count);
+        }
+
+        //a new table each time so that the one we measure is not affected by previous rehashes
+        std::unique_ptr<Map> map;
+        size_t reserved = options.load_factor > 0 ? (size_t) ((double) key_count / options.load_factor) : 0;
+        auto make_empty = [&]{
+            map.reset(new Map());
+            if(reserved > 0)
+                reserve_if_can(map.get(), reserved, 0);
+        };
+        auto refill = [&]{
+            make_empty();
+            for(int64_t i = 0; i < key_count; i++)
+                map->emplace(keys[(size_t) i], Value());
+        };
+
+        //Keys to be inserted (all distinct) and keys not in the table. Truncated to a narrow Key they can collide
+        // so we check them against the filled table and regenerate the colliding ones
+        const int64_t max_attempts = 64;
+        auto make_key = [&](Key* key, uint64_t value){
+            make_hash_key(value, options.string_length, key);
+            for(int64_t attempt = 0; map->find(*key) != map->end(); attempt++)
+            {
+                if(attempt >= max_attempts)
+                {
+                    out.keys_unique = false;
+                    return;
+                }
+                make_hash_key(random_u64(&random_state), options.string_length, key);
+            }
+        };
+
+        make_empty();
+        for(int64_t i = 0; i < key_count; i++)
+        {
+            make_key(&keys[(size_t) i], make_key_value(options.keys, i, &random_state));
+            map->emplace(keys[(size_t) i], Value());
+        }
+        for(int64_t i = 0; i < key_count; i++)
+            make_key(&missing[(size_t) i], make_key_value(options.keys, i + key_count, &random_state));
+
+        make_empty();
+        int64_t at = 0;
+        out.insert = benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+            if(at >= key_count)
+            {
+                make_empty();
+                at = 0;
+                return false;
+            }
+
+            map->emplace(keys[(size_t) at++], Value());
+            return true;
+        });
+
+        refill();
+        out.load_factor = load_factor_if_can(*map, 0);
+
+        at = 0;
+        out.lookup_hit = benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+            bool found = map->find(keys[(size_t) lookups[(size_t) (at++ & lookup_mask)]]) != map->end();
+            do_no_optimize(found);
+            return true;
+        });
+
+        at = 0;
+        out.lookup_miss = benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+            bool found = map->find(missing[(size_t) (at++ % key_count)]) != map->end();
+            do_no_optimize(found);
+            return true;
+        });
+
+        out.iterate = with_throughput(benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+            for(auto const& entry : *map)
+                do_no_optimize(entry);
+            return true;
+        }, key_count), 0.0, (double) key_count);
+
+        at = 0;
+        out.erase = benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+            if(at >= key_count)
+            {
+                refill();
+                at = 0;
+                return false;
+            }
+
+            size_t erased = map->erase(keys[(size_t) at++]);
+            do_no_optimize(erased);
+            return true;
+        });
+
+        return out;
+    }
+
+    template <typename Map>
+    static void benchmark_hash_table_load_factors(Hash_Table_Options const& options, double const* load_factors, int64_t count, Hash_Table_Result* results) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Hash_Table_Options at_load_factor = options;
+            at_load_factor.load_factor = load_factors[i];
+            results[i] = benchmark_hash_table<Map>(at_load_factor);
+        }
+    }
+}
@@ -0,0 +1,758 @@
+#pragma once
+#include "microbench_threads.h"
+#include "microbench_latency.h"
+#include "microbench_memory.h"
+
+#ifdef MICROBENCH_LINUX
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/uio.h>
+    #if defined(__has_include)
+        #if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+            #include <linux/io_uring.h>
+            #define MICROBENCH_IO_URING
+        #endif
+    #endif
+#endif
+
+//File I/O benchmarks. Sequential or random reads/writes of a fixed block size on a scratch file
+// through read/write (buffered or O_DIRECT) or a shared mapping. Queue depth is emulated by that many
+// threads each with a single synchronous request in flight. io_uring gets its own mode with real batching.
+// The results go through the same statistics as everything else so they can be put next to the compute numbers.
+namespace microbench
+{
+    enum Io_Access
+    {
+        IO_BUFFERED = 0, //pread/pwrite through the page cache
+        IO_DIRECT = 1,   //pread/pwrite with O_DIRECT. Falls back to IO_BUFFERED when the file system does not support it
+        IO_MMAP = 2,     //memcpy from/to a MAP_SHARED mapping of the file
+    };
+
+    enum Io_Pattern
+    {
+        IO_SEQUENTIAL = 0,
+        IO_RANDOM = 1,
+    };
+
+    struct Io_Options
+    {
+        //Scratch file. Created and filled when it does not exist or is smaller than file_size.
+        // Put it on the file system that is to be measured (tmpfs, ext4...)
+        const char* path = "microbench_io.tmp";
+        int64_t file_size = 64 << 20;
+        int64_t block_size = 4096; //has to be a multiple of the device block size for IO_DIRECT
+        int64_t queue_depth = 1;   //requests in flight at once - each thread keeps one
+        int32_t const* cpus = nullptr; //pin thread i to cpus[i] when not null
+
+        int32_t access = IO_BUFFERED; //Io_Access
+        int32_t pattern = IO_SEQUENTIAL; //Io_Pattern
+        bool write = false;
+        bool sync = false; //writes are only done when on the device (O_DSYNC or msync for IO_MMAP)
+
+        //Drops the file from the page cache (posix_fadvise(DONTNEED)) before the run and each time a thread went over
+        // its part of the file so that reads come from the device and buffered writes dont pile up.
+        // The dropping is not measured. Without it reads of files that fit into memory measure the page cache.
+        bool drop_cache = true;
+        bool remove_file = false; //delete the scratch file when done
+
+        int64_t max_time_ms = 1000;
+        int64_t warm_up_ms = 100;
+        uint64_t seed = 0;
+    };
+
+    struct Io_Result
+    {
+        Threads_Result threads; //time of a single request
+        Latency_Result latency; //of the single requests of all threads
+        double iops = 0.0;
+        double bytes_per_second = 0.0;
+        int32_t access = IO_BUFFERED; //the access that was actually used (see IO_DIRECT)
+        bool ok = false; //false when the file could not be prepared or some request failed
+    };
+
+    //Runs the requests described by options against the scratch file.
+    static Io_Result benchmark_io(Io_Options const& options) noexcept;
+
+    //Runs benchmark_io once for each of the block sizes
+    static void benchmark_io_block_sizes(Io_Options const& options, int64_t const* block_sizes, int64_t count, Io_Result* results) noexcept;
+
+    //Runs benchmark_io once for each of the queue depths
+    static void benchmark_io_queue_depths(Io_Options const& options, int64_t const* queue_depths, int64_t count, Io_Result* results) noexcept;
+
+    //Writes back and drops the given range of the file from the page cache. length of 0 means until the end of the file.
+    // Returns false if not supported.
+    static bool drop_file_cache(int fd, int64_t offset, int64_t length) noexcept;
+
+    enum Uring_Op
+    {
+        URING_NOP = 0,
+        URING_READ = 1,
+        URING_WRITE = 2,
+    };
+
+    struct Uring_Options
+    {
+        int32_t op = URING_NOP; //Uring_Op
+        //Target of the reads/writes. When false the scratch file at path (created like in Io_Options, sequential
+        // offsets through the page cache) else a pipe which is refilled/drained in rejected batches.
+        bool pipe = false;
+        const char* path = "microbench_io.tmp";
+        int64_t file_size = 64 << 20;
+        int64_t block_size = 4096;
+
+        int64_t batch_size = 1;   //requests submitted together. All of them are completed before the next batch
+        bool sqpoll = false;      //kernel thread polls the submission queue so submitting needs no syscall
+        int32_t sqpoll_cpu = -1;  //cpu of the polling thread or -1 for any
+        bool registered_buffers = false; //READ_FIXED/WRITE_FIXED with the buffers registered upfront
+
+        int64_t max_time_ms = 500;
+        int64_t warm_up_ms = 50;
+    };
+
+    struct Uring_Result
+    {
+        Bench_Result result; //time per single request (batch time / batch_size)
+        Latency_Result latency; //from submitting the batch until the completion of each request was seen
+        double ops_per_second = 0.0;
+        double enters_per_op = 0.0; //io_uring_enter syscalls per request
+        bool supported = false; //io_uring could be set up (it is often disabled in containers)
+        bool ok = false;        //supported and no request failed
+    };
+
+    //Runs batches of the given requests through an io_uring. Everything is done through raw syscalls.
+    static Uring_Result benchmark_uring(Uring_Options const& options) noexcept;
+
+    struct Uring_Point
+    {
+        int64_t batch_size = 0;
+        bool sqpoll = false;
+        bool registered_buffers = false;
+        Uring_Result result;
+    };
+
+    //Runs benchmark_uring for every batch size with sqpoll off/on and (for reads and writes) registered buffers off/on.
+    // Writes at most capacity points and returns their count.
+    static int64_t benchmark_uring_matrix(Uring_Options const& options, int64_t const* batch_sizes, int64_t count, Uring_Point* points, int64_t capacity) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    namespace io_internal
+    {
+        //clears the latencies gathered during warm up
+        struct Io_Probe
+        {
+            Latency_Histogram* histogram = nullptr;
+            //benchmark_threads keeps calling the function after the window ends. Only record while this is set
+            bool measuring = false;
+
+            void begin() noexcept { histogram->clear(); measuring = true; }
+            void batch(int64_t, bool) noexcept {}
+            void end() noexcept { measuring = false; }
+            void report(Bench_Result*) noexcept {}
+        };
+
+        struct Io_Thread
+        {
+            Memory_Buffer buffer;
+            int64_t part_offset = 0; //the part of the file this thread works on
+            int64_t part_blocks = 0;
+            int64_t position = 0;    //next block for IO_SEQUENTIAL
+            int64_t done = 0;        //blocks since the last cache drop
+            uint64_t random_state = 0;
+        };
+
+        #ifdef MICROBENCH_LINUX
+        //makes sure the file exists and has at least size bytes of non zero (so not sparse) data
+        static bool prepare_io_file(const char* path, int64_t size) noexcept
+        {
+            int fd = open(path, O_RDWR | O_CREAT, 0644);
+            if(fd < 0)
+                return false;
+
+            bool ok = true;
+            struct stat info = {};
+            if(fstat(fd, &info) != 0)
+                ok = false;
+            else if(info.st_size < size)
+            {
+                const int64_t chunk_size = 1 << 20;
+                char* chunk = (char*) malloc((size_t) chunk_size);
+                uint64_t random_state = 0x10;
+                for(int64_t i = 0; i < chunk_size; i += 8)
+                {
+                    uint64_t value = random_u64(&random_state);
+                    memcpy(chunk + i, &value, 8);
+                }
+
+                for(int64_t offset = 0; ok && offset < size; offset += chunk_size)
+                {
+                    int64_t to_write = size - offset < chunk_size ? size - offset : chunk_size;
+                    ok = pwrite(fd, chunk, (size_t) to_write, (off_t) offset) == (ssize_t) to_write;
+                }
+                free(chunk);
+                ok = ok && fdatasync(fd) == 0;
+            }
+
+            close(fd);
+            return ok;
+        }
+        #endif
+
+        #ifdef MICROBENCH_IO_URING
+        //The mapped rings of an io_uring. Written against the raw kernel interface so that
+        // liburing is not needed.
+        struct Uring
+        {
+            int fd = -1;
+            uint32_t entries = 0;
+
+            uint32_t* sq_head = nullptr;
+            uint32_t* sq_tail = nullptr;
+            uint32_t* sq_mask = nullptr;
+            uint32_t* sq_flags = nullptr;
+            uint32_t* sq_array = nullptr;
+            io_uring_sqe* sqes = nullptr;
+
+            uint32_t* cq_head = nullptr;
+            uint32_t* cq_tail = nullptr;
+            uint32_t* cq_mask = nullptr;
+            io_uring_cqe* cqes = nullptr;
+
+            void* sq_ring = nullptr;
+            size_t sq_ring_size = 0;
+            void* cq_ring = nullptr;
+            size_t cq_ring_size = 0;
+            size_t sqes_size = 0;
+        };
+
+        static int uring_enter(Uring const& uring, uint32_t to_submit, uint32_t min_complete, uint32_t flags) noexcept
+        {
+            return (int) syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, nullptr, 0);
+        }
+
+        static void uring_close(Uring* uring) noexcept
+        {
+            if(uring->sqes != nullptr)
+                munmap(uring->sqes, uring->sqes_size);
+            if(uring->cq_ring != nullptr && uring->cq_ring != uring->sq_ring)
+                munmap(uring->cq_ring, uring->cq_ring_size);
+            if(uring->sq_ring != nullptr)
+                munmap(uring->sq_ring, uring->sq_ring_size);
+            if(uring->fd >= 0)
+                close(uring->fd);
+            *uring = Uring();
+        }
+
+        static bool uring_open(Uring* uring, uint32_t entries, bool sqpoll, int32_t sqpoll_cpu) noexcept
+        {
+            *uring = Uring();
+            io_uring_params params = {};
+            if(sqpoll)
+            {
+                params.flags |= IORING_SETUP_SQPOLL;
+                params.sq_thread_idle = 1000;
+                if(sqpoll_cpu >= 0)
+                {
+                    params.flags |= IORING_SETUP_SQ_AFF;
+                    params.sq_thread_cpu = (uint32_t) sqpoll_cpu;
+                }
+            }
+
+            uring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+            if(uring->fd < 0)
+                return false;
+
+            uring->entries = params.sq_entries;
+            uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+            uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if(params.features & IORING_FEAT_SINGLE_MMAP)
+            {
+                if(uring->cq_ring_size > uring->sq_ring_size)
+                    uring->sq_ring_size = uring->cq_ring_size;
+                uring->cq_ring_size = uring->sq_ring_size;
+            }
+
+            void* sq_ring = mmap(nullptr, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, (off_t) IORING_OFF_SQ_RING);
+            if(sq_ring == MAP_FAILED)
+            {
+                uring_close(uring);
+                return false;
+            }
+            uring->sq_ring = sq_ring;
+
+            void* cq_ring = sq_ring;
+            if((params.features & IORING_FEAT_SINGLE_MMAP) == 0)
+            {
+                cq_ring = mmap(nullptr, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, (off_t) IORING_OFF_CQ_RING);
+                if(cq_ring == MAP_FAILED)
+                {
+                    uring_close(uring);
+                    return false;
+                }
+            }
+            uring->cq_ring = cq_ring;
+
+            uring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            void* sqes = mmap(nullptr, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, (off_t) IORING_OFF_SQES);
+            if(sqes == MAP_FAILED)
+            {
+                uring_close(uring);
+                return false;
+            }
+            uring->sqes = (io_uring_sqe*) sqes;
+
+            char* sq = (char*) sq_ring;
+            char* cq = (char*) cq_ring;
+            uring->sq_head = (uint32_t*) (sq + params.sq_off.head);
+            uring->sq_tail = (uint32_t*) (sq + params.sq_off.tail);
+            uring->sq_mask = (uint32_t*) (sq + params.sq_off.ring_mask);
+            uring->sq_flags = (uint32_t*) (sq + params.sq_off.flags);
+            uring->sq_array = (uint32_t*) (sq + params.sq_off.array);
+            uring->cq_head = (uint32_t*) (cq + params.cq_off.head);
+            uring->cq_tail = (uint32_t*) (cq + params.cq_off.tail);
+            uring->cq_mask = (uint32_t*) (cq + params.cq_off.ring_mask);
+            uring->cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+            //the sqe slots are used in order so the indirection array can be filled once
+            for(uint32_t i = 0; i < params.sq_entries; i++)
+                uring->sq_array[i] = i;
+            return true;
+        }
+
+        //clears the latencies and syscall counts gathered during warm up
+        struct Uring_Probe
+        {
+            Latency_Histogram* histogram = nullptr;
+            int64_t* enters = nullptr;
+
+            void begin() noexcept { histogram->clear(); *enters = 0; }
+            void batch(int64_t, bool) noexcept {}
+            void end() noexcept {}
+            void report(Bench_Result*) noexcept {}
+        };
+        #endif
+    }
+
+    static bool drop_file_cache(int fd, int64_t offset, int64_t length) noexcept
+    {
+        #ifdef MICROBENCH_LINUX
+            //dirty pages are not dropped so write them first
+            fdatasync(fd);
+            return posix_fadvise(fd, (off_t) offset, (off_t) length, POSIX_FADV_DONTNEED) == 0;
+        #else
+            (void) fd; (void) offset; (void) length;
+            return false;
+        #endif
+    }
+
+    static Io_Result benchmark_io(Io_Options const& options) noexcept
+    {
+        using namespace io_internal;
+        Io_Result out;
+        out.access = options.access;
+
+        #ifdef MICROBENCH_LINUX
+            int64_t block_size = options.block_size > 0 ? options.block_size : 4096;
+            int64_t thread_count = options.queue_depth > 0 ? options.queue_depth : 1;
+            if(thread_count > MAX_BENCH_THREADS)
+                thread_count = MAX_BENCH_THREADS;
+
+            int64_t file_blocks = options.file_size / block_size;
+            if(file_blocks < thread_count)
+                file_blocks = thread_count;
+            int64_t file_size = file_blocks * block_size;
+
+            if(prepare_io_file(options.path, file_size) == false)
+                return out;
+
+            int flags = O_RDWR;
+            if(options.sync && options.access != IO_MMAP)
+                flags |= O_DSYNC;
+
+            int fd = -1;
+            #ifdef O_DIRECT
+            if(options.access == IO_DIRECT)
+                fd = open(options.path, flags | O_DIRECT);
+            #endif
+            if(fd < 0)
+            {
+                if(options.access == IO_DIRECT)
+                    out.access = IO_BUFFERED;
+                fd = open(options.path, flags);
+            }
+            if(fd < 0)
+                return out;
+
+            char* mapping = nullptr;
+            if(options.access == IO_MMAP)
+            {
+                void* mapped = mmap(nullptr, (size_t) file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if(mapped == MAP_FAILED)
+                {
+                    close(fd);
+                    return out;
+                }
+                mapping = (char*) mapped;
+            }
+
+            //mapped pages stay in the page cache while mapped so unmap them from us first
+            auto drop = [&](int64_t offset, int64_t length){
+                if(mapping != nullptr)
+                {
+                    msync(mapping + offset, (size_t) length, MS_SYNC);
+                    madvise(mapping + offset, (size_t) length, MADV_DONTNEED);
+                }
+                drop_file_cache(fd, offset, length);
+            };
+
+            int64_t part_blocks = file_blocks / thread_count;
+            std::unique_ptr<Io_Thread[]> threads(new Io_Thread[(size_t) thread_count]);
+            std::unique_ptr<Latency_Histogram[]> histograms(new Latency_Histogram[(size_t) thread_count]);
+            std::unique_ptr<Io_Probe[]> probes(new Io_Probe[(size_t) thread_count]);
+            for(int64_t t = 0; t < thread_count; t++)
+            {
+                Io_Thread* thread = &threads[(size_t) t];
+                //page aligned which is enough for O_DIRECT
+                thread->buffer = alloc_buffer(block_size);
+                memset(thread->buffer.data, (int) (t + 1), (size_t) block_size);
+                thread->part_offset = t * part_blocks * block_size;
+                thread->part_blocks = part_blocks;
+                thread->random_state = options.seed + (uint64_t) t * 0x9E3779B97F4A7C15ull;
+                probes[(size_t) t].histogram = &histograms[(size_t) t];
+            }
+
+            if(options.drop_cache)
+                drop(0, file_size);
+
+            std::atomic<bool> failed = {false};
+            out.threads = benchmark_threads(probes.get(), thread_count, options.cpus, options.max_time_ms, options.warm_up_ms, [&](int64_t t){
+                Io_Thread* thread = &threads[(size_t) t];
+                if(thread->done >= thread->part_blocks)
+                {
+                    thread->done = 0;
+                    if(options.drop_cache)
+                    {
+                        drop(thread->part_offset, thread->part_blocks * block_size);
+                        return false;
+                    }
+                }
+
+                int64_t block = 0;
+                if(options.pattern == IO_RANDOM)
+                    block = (int64_t) (random_u64(&thread->random_state) % (uint64_t) thread->part_blocks);
+                else
+                {
+                    block = thread->position;
+                    thread->position = (thread->position + 1) % thread->part_blocks;
+                }
+                int64_t offset = thread->part_offset + block*block_size;
+                char* buffer = thread->buffer.data;
+                thread->done += 1;
+
+                int64_t before = clock_ns();
+                bool ok = true;
+                if(mapping != nullptr)
+                {
+                    if(options.write)
+                    {
+                        memcpy(mapping + offset, buffer, (size_t) block_size);
+                        if(options.sync)
+                            ok = msync(mapping + offset, (size_t) block_size, MS_SYNC) == 0;
+                    }
+                    else
+                        memcpy(buffer, mapping + offset, (size_t) block_size);
+                    read_write_barrier();
+                }
+                else if(options.write)
+                    ok = pwrite(fd, buffer, (size_t) block_size, (off_t) offset) == (ssize_t) block_size;
+                else
+                    ok = pread(fd, buffer, (size_t) block_size, (off_t) offset) == (ssize_t) block_size;
+                int64_t after = clock_ns();
+
+                if(ok == false)
+                {
+                    failed.store(true, std::memory_order_relaxed);
+                    return false;
+                }
+
+                if(probes[(size_t) t].measuring)
+                    histograms[(size_t) t].record(after - before);
+                return true;
+            });
+
+            for(int64_t t = 1; t < thread_count; t++)
+                histograms[0].merge(histograms[(size_t) t]);
+
+            out.latency = latency_result(histograms[0]);
+            out.iops = out.threads.calls_per_second;
+            out.bytes_per_second = out.iops * (double) block_size;
+            out.ok = failed.load() == false && out.latency.count > 0;
+
+            for(int64_t t = 0; t < thread_count; t++)
+                free_buffer(&threads[(size_t) t].buffer);
+            if(mapping != nullptr)
+                munmap(mapping, (size_t) file_size);
+            close(fd);
+            if(options.remove_file)
+                unlink(options.path);
+        #else
+            (void) options;
+        #endif
+
+        return out;
+    }
+
+    static void benchmark_io_block_sizes(Io_Options const& options, int64_t const* block_sizes, int64_t count, Io_Result* results) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Io_Options sized = options;
+            sized.block_size = block_sizes[i];
+            results[i] = benchmark_io(sized);
+        }
+    }
+
+    static void benchmark_io_queue_depths(Io_Options const& options, int64_t const* queue_depths, int64_t count, Io_Result* results) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Io_Options deep = options;
+            deep.queue_depth = queue_depths[i];
+            results[i] = benchmark_io(deep);
+        }
+    }
+
+    static Uring_Result benchmark_uring(Uring_Options const& options) noexcept
+    {
+        using namespace io_internal;
+        Uring_Result out;
+
+        #ifdef MICROBENCH_IO_URING
+            int64_t batch_size = options.batch_size > 0 ? options.batch_size : 1;
+            int64_t block_size = options.block_size > 0 ? options.block_size : 4096;
+            int64_t batch_bytes = batch_size * block_size;
+            bool has_target = options.op != URING_NOP;
+
+            Uring uring;
+            if(uring_open(&uring, (uint32_t) batch_size, options.sqpoll, options.sqpoll_cpu) == false)
+                return out;
+            out.supported = true;
+
+            bool ready = true;
+            int fd = -1;
+            int pipe_fds[2] = {-1, -1};
+            int64_t file_blocks = 1;
+            int64_t pipe_capacity = 0;
+            Memory_Buffer buffers;
+            if(has_target)
+            {
+                buffers = alloc_buffer(batch_bytes);
+                memset(buffers.data, 0x55, (size_t) batch_bytes);
+                if(options.pipe)
+                {
+                    ready = pipe(pipe_fds) == 0;
+                    if(ready)
+                    {
+                        fcntl(pipe_fds[1], F_SETPIPE_SZ, 1 << 20);
+                        pipe_capacity = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+                        fd = options.op == URING_READ ? pipe_fds[0] : pipe_fds[1];
+                        //the whole batch has to fit with room to spare so that no request ever blocks
+                        ready = batch_bytes * 2 <= pipe_capacity;
+                    }
+                }
+                else
+                {
+                    file_blocks = options.file_size / block_size;
+                    if(file_blocks < batch_size)
+                        file_blocks = batch_size;
+                    ready = prepare_io_file(options.path, file_blocks * block_size);
+                    if(ready)
+                        fd = open(options.path, O_RDWR);
+                    ready = fd >= 0;
+                }
+
+                if(ready && options.registered_buffers)
+                {
+                    std::unique_ptr<iovec[]> iovecs(new iovec[(size_t) batch_size]);
+                    for(int64_t i = 0; i < batch_size; i++)
+                    {
+                        iovecs[(size_t) i].iov_base = buffers.data + i*block_size;
+                        iovecs[(size_t) i].iov_len = (size_t) block_size;
+                    }
+                    ready = syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, iovecs.get(), (unsigned) batch_size) == 0;
+                }
+            }
+
+            if(ready)
+            {
+                std::unique_ptr<Latency_Histogram> histogram(new Latency_Histogram());
+                int64_t enters = 0;
+                int64_t position = 0;
+                int64_t pending = 0; //bytes in the pipe
+                bool failed = false;
+
+                //once anything fails (pending included) we reject the rest of the run
+                auto transfer = [&](ssize_t done, int64_t sign){
+                    if(done <= 0)
+                        failed = true;
+                    else
+                        pending += sign * (int64_t) done;
+                    return failed == false;
+                };
+
+                Uring_Probe probe;
+                probe.histogram = histogram.get();
+                probe.enters = &enters;
+                out.result = benchmark(probe, options.max_time_ms, options.warm_up_ms, [&]{
+                    if(failed)
+                        return false;
+
+                    //keep the pipe ready without measuring it
+                    if(options.pipe && options.op == URING_READ && pending < batch_bytes)
+                    {
+                        while(pending < pipe_capacity / 2 && transfer(write(pipe_fds[1], buffers.data, (size_t) block_size), 1));
+                        return false;
+                    }
+                    if(options.pipe && options.op == URING_WRITE && pending + batch_bytes > pipe_capacity / 2)
+                    {
+                        while(pending > 0 && transfer(read(pipe_fds[0], buffers.data, (size_t) block_size), -1));
+                        return false;
+                    }
+
+                    //we are the only ones producing sqes and consuming cqes
+                    uint32_t sq_tail = *uring.sq_tail;
+                    uint32_t sq_mask = *uring.sq_mask;
+                    for(int64_t i = 0; i < batch_size; i++)
+                    {
+                        io_uring_sqe* sqe = &uring.sqes[(sq_tail + (uint32_t) i) & sq_mask];
+                        memset(sqe, 0, sizeof *sqe);
+                        sqe->user_data = (uint64_t) i;
+                        if(has_target == false)
+                        {
+                            sqe->opcode = IORING_OP_NOP;
+                            continue;
+                        }
+
+                        bool reading = options.op == URING_READ;
+                        if(options.registered_buffers)
+                        {
+                            sqe->opcode = reading ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                            sqe->buf_index = (uint16_t) i;
+                        }
+                        else
+                            sqe->opcode = reading ? IORING_OP_READ : IORING_OP_WRITE;
+
+                        sqe->fd = fd;
+                        sqe->addr = (uint64_t) (uintptr_t) (buffers.data + i*block_size);
+                        sqe->len = (uint32_t) block_size;
+                        if(options.pipe == false)
+                        {
+                            sqe->off = (uint64_t) (position * block_size);
+                            position = (position + 1) % file_blocks;
+                        }
+                    }
+
+                    int64_t submitted = clock_ns();
+                    __atomic_store_n(uring.sq_tail, sq_tail + (uint32_t) batch_size, __ATOMIC_RELEASE);
+                    bool ok = true;
+                    if(options.sqpoll)
+                    {
+                        //the polling thread goes to sleep after being idle for a while
+                        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                        if(__atomic_load_n(uring.sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+                        {
+                            uring_enter(uring, (uint32_t) batch_size, 0, IORING_ENTER_SQ_WAKEUP);
+                            enters += 1;
+                        }
+                    }
+                    else
+                    {
+                        ok = uring_enter(uring, (uint32_t) batch_size, 0, 0) == batch_size;
+                        enters += 1;
+                    }
+
+                    for(int64_t completed = 0; ok && completed < batch_size; )
+                    {
+                        uint32_t cq_head = *uring.cq_head;
+                        uint32_t cq_tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+                        if(cq_head == cq_tail)
+                        {
+                            ok = uring_enter(uring, 0, 1, IORING_ENTER_GETEVENTS) >= 0;
+                            enters += 1;
+                            continue;
+                        }
+
+                        int64_t now = clock_ns();
+                        for(; cq_head != cq_tail; cq_head++, completed++)
+                        {
+                            io_uring_cqe const* cqe = &uring.cqes[cq_head & *uring.cq_mask];
+                            if(cqe->res < 0 || (has_target && cqe->res != block_size))
+                                ok = false;
+                            histogram->record(now - submitted);
+                        }
+                        __atomic_store_n(uring.cq_head, cq_head, __ATOMIC_RELEASE);
+                    }
+
+                    if(ok == false)
+                    {
+                        failed = true;
+                        return false;
+                    }
+
+                    if(options.pipe)
+                        pending += options.op == URING_READ ? -batch_bytes : batch_bytes;
+                    return true;
+                }, batch_size);
+
+                out.latency = latency_result(*histogram);
+                if(out.result.mean_ms > 0)
+                    out.ops_per_second = 1000.0 / out.result.mean_ms;
+                if(out.latency.count > 0)
+                    out.enters_per_op = (double) enters / (double) out.latency.count;
+                out.ok = failed == false && out.latency.count > 0;
+            }
+
+            if(pipe_fds[0] >= 0)
+            {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+            }
+            else if(fd >= 0)
+                close(fd);
+            free_buffer(&buffers);
+            uring_close(&uring);
+        #else
+            (void) options;
+        #endif
+
+        return out;
+    }
+
+    static int64_t benchmark_uring_matrix(Uring_Options const& options, int64_t const* batch_sizes, int64_t count, Uring_Point* points, int64_t capacity) noexcept
+    {
+        int64_t point_count = 0;
+        int registered_variants = options.op == URING_NOP ? 1 : 2;
+        for(int64_t i = 0; i < count; i++)
+            for(int sqpoll = 0; sqpoll < 2; sqpoll++)
+                for(int registered = 0; registered < registered_variants; registered++)
+                {
+                    if(point_count >= capacity)
+                        return point_count;
+
+                    Uring_Options variant = options;
+                    variant.batch_size = batch_sizes[i];
+                    variant.sqpoll = sqpoll != 0;
+                    variant.registered_buffers = registered != 0;
+
+                    Uring_Point* point = &points[point_count++];
+                    point->batch_size = variant.batch_size;
+                    point->sqpoll = variant.sqpoll;
+                    point->registered_buffers = variant.registered_buffers;
+                    point->result = benchmark_uring(variant);
+                }
+
+        return point_count;
+    }
+}
@@ -0,0 +1,364 @@
+#pragma once
+#include "microbench.h"
+
+//Latency distributions and an open loop benchmark driver.
+//
+//benchmark() is closed loop: it calls the function back to back. Thats what we want for throughput
+// but it understates tail latency of anything that handles requests because a slow call delays
+// all the calls after it and those are then never measured as slow (coordinated omission).
+//benchmark_open_loop() instead schedules the calls at a fixed rate and measures each call
+// from the time it *should* have started so that any queueing delay is included.
+namespace microbench
+{
+    //HdrHistogram like log-linear histogram of ns values. Values are kept with relative precision of
+    // 1/64 (< 1.6%) for values from 0 up to 2^46 ns (~19 hours). Fixed size, no allocations.
+    struct Latency_Histogram
+    {
+        static constexpr int64_t SUB_BUCKET_BITS = 7;
+        static constexpr int64_t SUB_BUCKETS = (int64_t) 1 << SUB_BUCKET_BITS;
+        static constexpr int64_t HALF_SUB_BUCKETS = SUB_BUCKETS / 2;
+        static constexpr int64_t MAGNITUDES = 40;
+        static constexpr int64_t BUCKETS = SUB_BUCKETS + MAGNITUDES * HALF_SUB_BUCKETS;
+
+        int64_t counts[BUCKETS] = {0};
+        int64_t count = 0;
+        int64_t min = 0;
+        int64_t max = 0;
+        double sum = 0.0;
+        double squared_sum = 0.0;
+
+        void clear() noexcept;
+        void record(int64_t value_ns, int64_t times = 1) noexcept;
+
+        //Records the value and if it is bigger than the expected interval between samples also
+        // the values of the samples that would have been taken while we were waiting on this one
+        // (value - interval, value - 2*interval, ...). Use this to correct coordinated omission
+        // for latencies gathered in a closed loop. Same as HdrHistogram's recordValueWithExpectedInterval.
+        void record_corrected(int64_t value_ns, int64_t expected_interval_ns) noexcept;
+        void merge(Latency_Histogram const& other) noexcept;
+
+        //returns the value in ns below which are percentile (0 to 100) percent of all recorded values
+        int64_t percentile(double percentile) const noexcept;
+        double mean() const noexcept;
+        double deviation() const noexcept;
+
+        static int64_t index_of(int64_t value_ns) noexcept;
+        static int64_t lowest_value_at(int64_t index) noexcept;
+        static int64_t highest_value_at(int64_t index) noexcept;
+    };
+
+    //Latency summary of a histogram in the same units as Bench_Result
+    struct Latency_Result
+    {
+        double mean_ms = 0.0;
+        double deviation_ms = 0.0;
+        double min_ms = 0.0;
+        double p50_ms = 0.0;
+        double p90_ms = 0.0;
+        double p99_ms = 0.0;
+        double p999_ms = 0.0;
+        double p9999_ms = 0.0;
+        double max_ms = 0.0;
+        int64_t count = 0;
+    };
+
+    static Latency_Result latency_result(Latency_Histogram const& histogram) noexcept;
+
+    enum Arrival
+    {
+        ARRIVAL_CONSTANT, //calls evenly spaced
+        ARRIVAL_POISSON,  //exponentially distributed gaps with the given mean rate - like independent clients
+    };
+
+    struct Open_Loop_Result
+    {
+        Latency_Result latency; //measured from the intended start of each call
+        Latency_Result service; //measured from the actual start of each call (what closed loop sees)
+
+        double target_calls_per_second = 0.0;
+        double achieved_calls_per_second = 0.0;
+        //the highest lag behind schedule when starting a call. When this keeps growing the
+        // target rate is above what the function can sustain
+        double max_lag_ms = 0.0;
+        bool saturated = false; //couldnt keep up with the target rate
+
+        int64_t calls = 0;
+        int64_t rejected = 0;
+    };
+
+    //Calls measured_fn at calls_per_second with the given arrival distribution for max_time_ms (warm up included)
+    // and records the latency of each call from the time it was scheduled to start. When the function returns false
+    // the call is not recorded (but the schedule goes on). If given the histograms are cleared and filled
+    // with the latencies of this run.
+    //To find the saturation throughput use the closed loop benchmark: 1000.0 / benchmark(...).mean_ms
+    template <typename Fn>
+    static Open_Loop_Result benchmark_open_loop(
+        double calls_per_second, int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn,
+        Arrival arrival = ARRIVAL_CONSTANT, Latency_Histogram* latency = nullptr, Latency_Histogram* service = nullptr, uint64_t seed = 0) noexcept;
+
+    //Small fast deterministic random generator (splitmix64)
+    static uint64_t random_u64(uint64_t* state) noexcept;
+    //Returns uniformly distributed double in [0, 1)
+    static double random_f64(uint64_t* state) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    inline void Latency_Histogram::clear() noexcept
+    {
+        *this = Latency_Histogram();
+    }
+
+    inline int64_t Latency_Histogram::index_of(int64_t value_ns) noexcept
+    {
+        if(value_ns < SUB_BUCKETS)
+            return value_ns < 0 ? 0 : value_ns;
+
+        #if defined(__GNUC__) || defined(__clang__)
+            int64_t highest_bit = 63 - __builtin_clzll((unsigned long long) value_ns);
+        #else
+            int64_t highest_bit = 0;
+            for(uint64_t v = (uint64_t) value_ns; v > 1; v >>= 1)
+                highest_bit++;
+        #endif
+
+        //shift so that the value lands into the upper half of sub buckets
+        int64_t shift = highest_bit - (SUB_BUCKET_BITS - 1);
+        int64_t index = SUB_BUCKETS + (shift - 1) * HALF_SUB_BUCKETS + ((value_ns >> shift) - HALF_SUB_BUCKETS);
+        if(index >= BUCKETS)
+            index = BUCKETS - 1;
+
+        return index;
+    }
+
+    inline int64_t Latency_Histogram::lowest_value_at(int64_t index) noexcept
+    {
+        if(index < SUB_BUCKETS)
+            return index;
+
+        int64_t shift = (index - SUB_BUCKETS) / HALF_SUB_BUCKETS + 1;
+        int64_t sub = (index - SUB_BUCKETS) % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+        return sub << shift;
+    }
+
+    inline int64_t Latency_Histogram::highest_value_at(int64_t index) noexcept
+    {
+        if(index < SUB_BUCKETS)
+            return index;
+
+        int64_t shift = (index - SUB_BUCKETS) / HALF_SUB_BUCKETS + 1;
+        return lowest_value_at(index) + ((int64_t) 1 << shift) - 1;
+    }
+
+    inline void Latency_Histogram::record(int64_t value_ns, int64_t times) noexcept
+    {
+        if(value_ns < 0)
+            value_ns = 0;
+
+        if(count == 0 || min > value_ns)
+            min = value_ns;
+        if(count == 0 || max < value_ns)
+            max = value_ns;
+
+        counts[index_of(value_ns)] += times;
+        count += times;
+        sum += (double) value_ns * (double) times;
+        squared_sum += (double) value_ns * (double) value_ns * (double) times;
+    }
+
+    inline void Latency_Histogram::record_corrected(int64_t value_ns, int64_t expected_interval_ns) noexcept
+    {
+        record(value_ns);
+        if(expected_interval_ns <= 0)
+            return;
+
+        for(int64_t missed = value_ns - expected_interval_ns; missed >= expected_interval_ns; missed -= expected_interval_ns)
+            record(missed);
+    }
+
+    inline void Latency_Histogram::merge(Latency_Histogram const& other) noexcept
+    {
+        if(other.count == 0)
+            return;
+
+        if(count == 0 || min > other.min)
+            min = other.min;
+        if(count == 0 || max < other.max)
+            max = other.max;
+
+        for(int64_t i = 0; i < BUCKETS; i++)
+            counts[i] += other.counts[i];
+
+        count += other.count;
+        sum += other.sum;
+        squared_sum += other.squared_sum;
+    }
+
+    inline int64_t Latency_Histogram::percentile(double percentile) const noexcept
+    {
+        if(count == 0)
+            return 0;
+
+        if(percentile >= 100.0)
+            return max;
+
+        //the number of values that must be at or below the returned one
+        int64_t needed = (int64_t) ceil(percentile / 100.0 * (double) count);
+        if(needed < 1)
+            needed = 1;
+
+        int64_t seen = 0;
+        for(int64_t i = 0; i < BUCKETS; i++)
+        {
+            seen += counts[i];
+            if(seen >= needed)
+            {
+                int64_t value = highest_value_at(i);
+                if(value > max)
+                    value = max;
+                if(value < min)
+                    value = min;
+                return value;
+            }
+        }
+
+        return max;
+    }
+
+    inline double Latency_Histogram::mean() const noexcept
+    {
+        return count > 0 ? sum / (double) count : 0.0;
+    }
+
+    inline double Latency_Histogram::deviation() const noexcept
+    {
+        if(count <= 1)
+            return 0.0;
+
+        double n = (double) count;
+        double varience = (squared_sum - (sum * sum) / n) / (n - 1.0);
+        return sqrt(fabs(varience));
+    }
+
+    static Latency_Result latency_result(Latency_Histogram const& histogram) noexcept
+    {
+        using namespace microbench::time_consts;
+        const double to_ms = 1.0 / (double) MILISECOND_NANOSECONDS;
+
+        Latency_Result result;
+        result.count = histogram.count;
+        result.mean_ms = histogram.mean() * to_ms;
+        result.deviation_ms = histogram.deviation() * to_ms;
+        result.min_ms = (double) histogram.min * to_ms;
+        result.p50_ms = (double) histogram.percentile(50.0) * to_ms;
+        result.p90_ms = (double) histogram.percentile(90.0) * to_ms;
+        result.p99_ms = (double) histogram.percentile(99.0) * to_ms;
+        result.p999_ms = (double) histogram.percentile(99.9) * to_ms;
+        result.p9999_ms = (double) histogram.percentile(99.99) * to_ms;
+        result.max_ms = (double) histogram.max * to_ms;
+        return result;
+    }
+
+    static uint64_t random_u64(uint64_t* state) noexcept
+    {
+        uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    static double random_f64(uint64_t* state) noexcept
+    {
+        return (double) (random_u64(state) >> 11) * (1.0 / (double) ((uint64_t) 1 << 53));
+    }
+
+    template <typename Fn>
+    static Open_Loop_Result benchmark_open_loop(
+        double calls_per_second, int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn,
+        Arrival arrival, Latency_Histogram* latency, Latency_Histogram* service, uint64_t seed) noexcept
+    {
+        using namespace microbench::time_consts;
+        assert(calls_per_second > 0);
+        assert(max_time_ms >= 0);
+
+        //the histograms are big so we only keep our own ones if the user didnt give us any
+        Latency_Histogram own_latency;
+        Latency_Histogram own_service;
+        if(latency == nullptr)
+            latency = &own_latency;
+        if(service == nullptr)
+            service = &own_service;
+
+        latency->clear();
+        service->clear();
+
+        Open_Loop_Result result;
+        result.target_calls_per_second = calls_per_second;
+
+        const double interval_ns = (double) SECOND_NANOSECONDS / calls_per_second;
+        const int64_t max_time_ns = max_time_ms * MILISECOND_NANOSECONDS;
+        int64_t warm_up_ns = warm_up_ms * MILISECOND_NANOSECONDS;
+        if(warm_up_ns > max_time_ns || warm_up_ns < 0)
+            warm_up_ns = 0;
+
+        uint64_t random_state = seed;
+        int64_t lag_max = 0;
+        int64_t measured_calls = 0;
+        int64_t measured_from = 0;
+
+        const int64_t start = clock_ns();
+        double intended_offset = 0.0;
+        while(true)
+        {
+            //when we cant keep up we would be running long past the deadline
+            int64_t intended = start + (int64_t) intended_offset;
+            if(intended - start > max_time_ns || clock_ns() - start > max_time_ns)
+                break;
+
+            //wait for our time. We spin because sleeping is far too coarse for this
+            int64_t now = clock_ns();
+            while(now < intended)
+                now = clock_ns();
+
+            bool accepted = measured_fn();
+            int64_t end = clock_ns();
+
+            bool measuring = intended - start >= warm_up_ns;
+            if(measuring)
+            {
+                if(measured_calls == 0)
+                    measured_from = intended;
+
+                measured_calls += 1;
+                if(accepted)
+                {
+                    latency->record(end - intended);
+                    service->record(end - now);
+                }
+                else
+                    result.rejected += 1;
+
+                if(lag_max < now - intended)
+                    lag_max = now - intended;
+            }
+
+            if(arrival == ARRIVAL_POISSON)
+                intended_offset += -log(1.0 - random_f64(&random_state)) * interval_ns;
+            else
+                intended_offset += interval_ns;
+        }
+
+        int64_t measured_time = clock_ns() - measured_from;
+
+        result.calls = measured_calls;
+        result.latency = latency_result(*latency);
+        result.service = latency_result(*service);
+        result.max_lag_ms = (double) lag_max / (double) MILISECOND_NANOSECONDS;
+        if(measured_time > 0)
+            result.achieved_calls_per_second = (double) measured_calls * (double) SECOND_NANOSECONDS / (double) measured_time;
+
+        result.saturated = result.achieved_calls_per_second < calls_per_second * 0.95;
+        return result;
+    }
+}
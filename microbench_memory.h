@@ -0,0 +1,712 @@
+#pragma once
+#include "microbench_os.h"
+#include <thread>
+#include <memory>
+
+#ifdef MICROBENCH_LINUX
+    #include <sys/mman.h>
+#endif
+
+//Memory bandwidth and latency benchmarks with numa aware placement of both the memory and the thread.
+namespace microbench
+{
+    enum Page_Kind
+    {
+        PAGES_DEFAULT = 0,          //whatever the system does (transparent huge pages depend on /sys/kernel/mm/transparent_hugepage)
+        PAGES_SMALL = 1,            //4K pages. Transparent huge pages are disabled for the buffer (MADV_NOHUGEPAGE)
+        PAGES_TRANSPARENT_HUGE = 2, //asks for transparent huge pages (MADV_HUGEPAGE). The kernel might still not give them
+        PAGES_HUGETLB = 3,          //2M pages from the reserved pool (MAP_HUGETLB). Needs vm.nr_hugepages set up
+    };
+
+    struct Buffer_Options
+    {
+        int64_t alignment = 64;    //of the returned data. Any power of two
+        int32_t numa_node = -1;    //node to bind the memory to (mbind). -1 means dont care
+        int32_t pages = PAGES_DEFAULT; //Page_Kind
+        //Fault in all pages upfront (MAP_POPULATE or touching) so that the measurements dont include 
+        // the first touch page faults.
+        bool prefault = true;
+        //When the requested pages cannot be obtained fall back to PAGES_DEFAULT instead of failing
+        bool fallback = true;
+    };
+
+    //Memory for benchmark inputs. 
+    struct Memory_Buffer
+    {
+        char* data = nullptr;
+        int64_t size = 0;
+
+        //Numa node the memory was verified to be on or -1 if unknown
+        int32_t numa_node = -1;
+        //True if the memory was bound to the requested node. False if no node was requested or
+        // binding is not supported (single node machines, other platforms...)
+        bool bound = false;
+        //Page_Kind the memory was actually obtained with
+        int32_t pages = PAGES_DEFAULT;
+
+        //Internals
+        void* mapping = nullptr;
+        int64_t mapping_size = 0;
+    };
+
+    //Allocates size bytes according to options. Fails when out of memory (or when the requested 
+    // pages cannot be obtained and fallback is false) in which case data is null.
+    static Memory_Buffer alloc_buffer(int64_t size, Buffer_Options const& options) noexcept;
+    //Allocates prefaulted size bytes. When numa_node is not negative tries to bind the memory to that node.
+    static Memory_Buffer alloc_buffer(int64_t size, int32_t numa_node = -1) noexcept;
+    static void free_buffer(Memory_Buffer* buffer) noexcept;
+
+    //Returns how many bytes of the buffer are backed by huge pages (both hugetlb and transparent) 
+    // according to /proc/self/smaps or -1 if unknown.
+    static int64_t huge_page_bytes(Memory_Buffer const& buffer) noexcept;
+
+    struct Page_Size_Result
+    {
+        Bench_Result small; //4K pages
+        Bench_Result huge;  //2M pages
+        double speedup = 0.0; //small mean / huge mean. Above 1 means huge pages help
+        int32_t huge_pages = PAGES_DEFAULT; //Page_Kind that was used for the huge run
+        int64_t huge_page_bytes = -1; //how much of the buffer was verified to be on huge pages (see huge_page_bytes)
+    };
+
+    //Runs the same benchmark twice - once with the input buffer on 4K pages and once on 2M pages (hugetlb if 
+    // reserved else transparent huge pages) and reports the difference. For each run a buffer of size bytes
+    // is allocated according to options (except for pages), init(Memory_Buffer&) prepares the input 
+    // (unmeasured) and measured_fn(Memory_Buffer&) is benchmarked.
+    template <typename Init, typename Fn>
+    static Page_Size_Result benchmark_page_sizes(int64_t size, Buffer_Options const& options, int64_t max_time_ms, int64_t warm_up_ms, Init init, Fn measured_fn, int64_t runs_mult = 1) noexcept;
+
+    //Returns the numa node of the page containing address or -1 if unknown
+    static int32_t numa_node_of(void const* address) noexcept;
+
+    struct Memory_Bench_Options
+    {
+        int64_t bytes = 64 << 20; //size of each buffer. Should be well over the llc size
+        int32_t cpu_node = -1;    //numa node to run on. -1 means dont care
+        int32_t memory_node = -1; //numa node to place the buffers on. -1 means dont care (first touch)
+        int64_t max_time_ms = 500; //for each of the kernels
+        int64_t warm_up_ms = 50;
+        int64_t latency_hops = 1024; //dependent loads per call of the latency kernel
+        int32_t pages = PAGES_DEFAULT; //Page_Kind of the buffers. Huge pages take the tlb misses out of the latency
+    };
+
+    struct Memory_Bench_Result
+    {
+        //Bandwidths are in result.throughput. Following STREAM copy counts the bytes
+        // read and written (2x bytes) and triad all three arrays (3x bytes).
+        Bench_Result read;
+        Bench_Result write;
+        Bench_Result copy;  //b = a
+        Bench_Result triad; //a = b + s*c
+
+        //Pointer chasing through a random cycle of cache lines. The result is per single load.
+        // The cycle goes through the whole buffer so this includes tlb misses (unless on huge pages).
+        Bench_Result latency;
+        double latency_ns = 0.0;
+
+        int32_t cpu_node = -1;    //node the benchmark ran on or -1 if it could not be pinned
+        int32_t memory_node = -1; //node the memory was on or -1 if unknown
+    };
+
+    //Runs all kernels on a new thread placed according to options. The calling thread is not affected.
+    static Memory_Bench_Result benchmark_memory(Memory_Bench_Options const& options = Memory_Bench_Options()) noexcept;
+
+    //Runs benchmark_memory for every pair of (cpu node, memory node). results must hold node_count^2
+    // values and receives results[cpu_node*node_count + memory_node]. The remote penalty is then simply
+    // the ratio against the diagonal. On single node machines this only measures the local case.
+    // Returns node_count or 0 when capacity is not enough.
+    static int64_t benchmark_memory_numa(Memory_Bench_Options const& options, Memory_Bench_Result* results, int64_t capacity) noexcept;
+    enum Mem_Kernel_Kind
+    {
+        MEM_KERNEL_COPY = 0,    //reads source writes destination
+        MEM_KERNEL_SET = 1,     //writes destination only. Source offsets are not swept
+        MEM_KERNEL_COMPARE = 2, //reads both. Source and destination are always equal so the whole size is compared
+    };
+
+    //memcpy like signature shared by all kernels. For set the source is null.
+    typedef void (*Mem_Kernel_Fn)(void* destination, void const* source, size_t size);
+
+    struct Mem_Kernel
+    {
+        const char* name;
+        int32_t kind; //Mem_Kernel_Kind
+        Mem_Kernel_Fn fn;
+    };
+
+    //Returns memcpy, memmove, memset and memcmp (in that order) as kernels. 
+    // User kernels (such as custom simd copies) can simply be added next to them.
+    static Mem_Kernel const* builtin_mem_kernels(int64_t* count) noexcept;
+
+    static constexpr int64_t MAX_MEM_OFFSETS = 8;
+
+    struct Mem_Sweep_Options
+    {
+        int64_t min_size = 1;
+        int64_t max_size = 64 << 20;
+        double size_step = 2.0; //each size is this many times the previous one (rounded)
+
+        //offsets from 64 byte alignment to sweep. Every source offset is combined with every destination offset
+        int32_t source_offsets[MAX_MEM_OFFSETS] = {0, 1};
+        int64_t source_offset_count = 2;
+        int32_t destination_offsets[MAX_MEM_OFFSETS] = {0, 1};
+        int64_t destination_offset_count = 2;
+
+        bool warm = true; //the same buffers for every call - small sizes stay in cache
+        bool cold = true; //each call uses the next buffers from a pool of cold_bytes so the data comes from memory
+        int64_t cold_bytes = 128 << 20; //of each of the source and destination pools. Should be well over the llc size
+
+        int64_t max_time_ms = 50; //for each point
+        int64_t warm_up_ms = 5;
+    };
+
+    struct Mem_Sweep_Point
+    {
+        const char* kernel = nullptr; //name of the kernel
+        int64_t size = 0;
+        int32_t source_offset = 0;
+        int32_t destination_offset = 0;
+        bool cold = false;
+        Bench_Result result; //time per call and throughput in bytes of size
+    };
+
+    //Benchmarks every kernel for every size, offset combination and warm/cold mode. Writes at most capacity
+    // points and returns their count (0 if the buffers could not be allocated).
+    static int64_t benchmark_mem_kernels(Mem_Kernel const* kernels, int64_t kernel_count, Mem_Sweep_Options const& options, Mem_Sweep_Point* points, int64_t capacity) noexcept;
+
+    //Writes the points as csv with one row per point. Returns false if the file cannot be written.
+    static bool write_mem_sweep_csv(const char* path, Mem_Sweep_Point const* points, int64_t count) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    namespace memory_internal
+    {
+        #ifdef MICROBENCH_LINUX
+            //from linux/mempolicy.h which is not always installed.
+            // We dont want to depend on libnuma just for these two calls.
+            static constexpr int MBIND_MPOL_BIND = 2;
+            static constexpr unsigned MBIND_MPOL_MF_MOVE = 1 << 1;
+            static constexpr unsigned long MPOL_FLAG_NODE = 1 << 0;
+            static constexpr unsigned long MPOL_FLAG_ADDR = 1 << 1;
+            static constexpr int64_t MAX_NODES = 1024;
+            static constexpr int64_t HUGE_PAGE_SIZE = 2 << 20;
+        #endif
+
+        static constexpr int64_t CACHE_LINE = 64;
+        static constexpr int64_t PAGE_SIZE = 4096;
+
+        static void prefault(char* data, int64_t size) noexcept
+        {
+            for(int64_t i = 0; i < size; i += PAGE_SIZE)
+                data[i] = 0;
+            if(size > 0)
+                data[size - 1] = 0;
+        }
+
+        static int64_t read_kernel(int64_t const* data, int64_t count) noexcept
+        {
+            //independent accumulators so that we are not bound by the add latency
+            int64_t a = 0, b = 0, c = 0, d = 0;
+            int64_t i = 0;
+            for(; i + 3 < count; i += 4)
+            {
+                a += data[i];
+                b += data[i + 1];
+                c += data[i + 2];
+                d += data[i + 3];
+            }
+            for(; i < count; i++)
+                a += data[i];
+            return a + b + c + d;
+        }
+
+        static void write_kernel(int64_t* data, int64_t count, int64_t value) noexcept
+        {
+            for(int64_t i = 0; i < count; i++)
+                data[i] = value;
+            read_write_barrier(); //the stores have to happen in every call
+        }
+
+        static void triad_kernel(double* a, double const* b, double const* c, double scalar, int64_t count) noexcept
+        {
+            for(int64_t i = 0; i < count; i++)
+                a[i] = b[i] + scalar*c[i];
+            read_write_barrier();
+        }
+
+        //Links all cache lines of data into a single random cycle (Sattolo's algorithm)
+        // and returns its start. Each line starts with the pointer to the next one.
+        static void** build_chase(char* data, int64_t size, uint64_t seed) noexcept
+        {
+            int64_t lines = size / CACHE_LINE;
+            if(lines <= 0)
+                return nullptr;
+
+            //random permutation of the lines. Consecutive entries are linked
+            int64_t* order = (int64_t*) malloc((size_t) lines * sizeof(int64_t));
+            assert(order != nullptr);
+            for(int64_t i = 0; i < lines; i++)
+                order[i] = i;
+
+            uint64_t state = seed | 1;
+            for(int64_t i = lines - 1; i > 0; i--)
+            {
+                //xorshift64
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                int64_t j = (int64_t) (state % (uint64_t) i);
+                int64_t temp = order[i];
+                order[i] = order[j];
+                order[j] = temp;
+            }
+
+            for(int64_t i = 0; i < lines; i++)
+            {
+                void** line = (void**) (void*) (data + order[i]*CACHE_LINE);
+                *line = data + order[(i + 1) % lines]*CACHE_LINE;
+            }
+
+            void** start = (void**) (void*) (data + order[0]*CACHE_LINE);
+            free(order);
+            return start;
+        }
+
+        static Memory_Bench_Result run_kernels(Memory_Bench_Options const& options, int32_t memory_node) noexcept
+        {
+            Memory_Bench_Result out;
+            int64_t count = options.bytes / (int64_t) sizeof(int64_t);
+            int64_t bytes = count * (int64_t) sizeof(int64_t);
+
+            Buffer_Options buffer_options;
+            buffer_options.numa_node = memory_node;
+            buffer_options.pages = options.pages;
+            Memory_Buffer a = alloc_buffer(bytes, buffer_options);
+            Memory_Buffer b = alloc_buffer(bytes, buffer_options);
+            Memory_Buffer c = alloc_buffer(bytes, buffer_options);
+            if(a.data == nullptr || b.data == nullptr || c.data == nullptr)
+            {
+                free_buffer(&a);
+                free_buffer(&b);
+                free_buffer(&c);
+                return out;
+            }
+
+            out.memory_node = a.numa_node;
+            for(int64_t i = 0; i < count; i++)
+            {
+                ((double*) (void*) b.data)[i] = 1.0;
+                ((double*) (void*) c.data)[i] = 2.0;
+            }
+
+            int64_t value = 0;
+            out.read = with_throughput(benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+                do_no_optimize(read_kernel((int64_t const*) (void*) a.data, count));
+                return true;
+            }), (double) bytes);
+
+            out.write = with_throughput(benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+                write_kernel((int64_t*) (void*) a.data, count, value++);
+                return true;
+            }), (double) bytes);
+
+            out.copy = with_throughput(benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+                memcpy(b.data, a.data, (size_t) bytes);
+                read_write_barrier();
+                return true;
+            }), 2.0 * (double) bytes);
+
+            out.triad = with_throughput(benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+                triad_kernel((double*) (void*) a.data, (double const*) (void*) b.data, (double const*) (void*) c.data, 3.0, count);
+                return true;
+            }), 3.0 * (double) bytes);
+
+            void** at = build_chase(a.data, bytes, (uint64_t) clock_ns());
+            int64_t hops = options.latency_hops > 0 ? options.latency_hops : 1;
+            if(at != nullptr)
+            {
+                out.latency = benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+                    void** p = at;
+                    for(int64_t i = 0; i < hops; i++)
+                        p = (void**) *p;
+                    at = p;
+                    return true;
+                }, hops);
+                do_no_optimize(at);
+                out.latency_ns = out.latency.mean_ms * 1e6;
+            }
+
+            free_buffer(&a);
+            free_buffer(&b);
+            free_buffer(&c);
+            return out;
+        }
+    }
+
+    #ifdef MICROBENCH_LINUX
+        static int32_t numa_node_of(void const* address) noexcept
+        {
+            int node = -1;
+            long state = syscall(SYS_get_mempolicy, &node, nullptr, 0UL, address,
+                memory_internal::MPOL_FLAG_NODE | memory_internal::MPOL_FLAG_ADDR);
+            return state == 0 ? (int32_t) node : -1;
+        }
+
+        static Memory_Buffer alloc_buffer(int64_t size, Buffer_Options const& options) noexcept
+        {
+            using namespace memory_internal;
+            Memory_Buffer buffer;
+            if(size <= 0)
+                size = 1;
+
+            int64_t alignment = options.alignment > 0 ? options.alignment : 1;
+            assert((alignment & (alignment - 1)) == 0 && "alignment must be power of two");
+
+            //mmap gives us page aligned memory so we only need extra space for bigger alignments.
+            // Transparent huge pages are only used for 2M aligned parts of the mapping so we align those too
+            int32_t pages = options.pages;
+            int64_t page_size = pages == PAGES_HUGETLB ? HUGE_PAGE_SIZE : PAGE_SIZE;
+            int64_t mapping_align = pages == PAGES_TRANSPARENT_HUGE && alignment < HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : alignment;
+            int64_t extra = mapping_align > page_size ? mapping_align : 0;
+            int64_t mapping_size = (size + extra + page_size - 1) / page_size * page_size;
+
+            //MAP_POPULATE faults in everything right away so it can only be used when nothing
+            // has to be set before the first touch
+            bool needs_advice = options.numa_node >= 0 || pages == PAGES_SMALL || pages == PAGES_TRANSPARENT_HUGE;
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+            if(options.prefault && needs_advice == false)
+                flags |= MAP_POPULATE;
+            if(pages == PAGES_HUGETLB)
+                flags |= MAP_HUGETLB;
+
+            void* mapping = mmap(nullptr, (size_t) mapping_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if(mapping == MAP_FAILED)
+            {
+                //most often there are no reserved huge pages
+                if(pages == PAGES_DEFAULT || options.fallback == false)
+                    return buffer;
+
+                Buffer_Options fallback = options;
+                fallback.pages = PAGES_DEFAULT;
+                return alloc_buffer(size, fallback);
+            }
+
+            buffer.mapping = mapping;
+            buffer.mapping_size = mapping_size;
+            buffer.data = (char*) (((uintptr_t) mapping + (uintptr_t) mapping_align - 1) / (uintptr_t) mapping_align * (uintptr_t) mapping_align);
+            buffer.size = size;
+            buffer.pages = pages;
+
+            #ifdef MADV_HUGEPAGE
+                if(pages == PAGES_SMALL)
+                    madvise(mapping, (size_t) mapping_size, MADV_NOHUGEPAGE);
+                if(pages == PAGES_TRANSPARENT_HUGE && madvise(mapping, (size_t) mapping_size, MADV_HUGEPAGE) != 0)
+                    buffer.pages = PAGES_DEFAULT;
+            #endif
+
+            //must be bound before the first touch for the pages to be allocated on the node
+            if(options.numa_node >= 0 && options.numa_node < MAX_NODES)
+            {
+                unsigned long mask[MAX_NODES / 64] = {0};
+                mask[options.numa_node / 64] |= 1UL << (options.numa_node % 64);
+                buffer.bound = syscall(SYS_mbind, mapping, (unsigned long) mapping_size, MBIND_MPOL_BIND,
+                    mask, (unsigned long) MAX_NODES, MBIND_MPOL_MF_MOVE) == 0;
+            }
+
+            if(options.prefault && needs_advice)
+                prefault(buffer.data, buffer.size);
+
+            //we can only ask where the memory is once it exists
+            if(options.prefault)
+                buffer.numa_node = numa_node_of(buffer.data);
+            return buffer;
+        }
+
+        static void free_buffer(Memory_Buffer* buffer) noexcept
+        {
+            if(buffer->mapping != nullptr)
+                munmap(buffer->mapping, (size_t) buffer->mapping_size);
+            *buffer = Memory_Buffer();
+        }
+
+        static int64_t huge_page_bytes(Memory_Buffer const& buffer) noexcept
+        {
+            if(buffer.mapping == nullptr)
+                return -1;
+
+            FILE* file = fopen("/proc/self/smaps", "rb");
+            if(file == nullptr)
+                return -1;
+
+            //smaps is a list of mappings each starting with "from-to perms ..." line followed by "Field: value kB" lines.
+            // The kernel might have merged or split our mapping so we sum all mappings overlapping it
+            uintptr_t from = (uintptr_t) buffer.mapping;
+            uintptr_t to = from + (uintptr_t) buffer.mapping_size;
+            bool inside = false;
+            bool hugetlb = buffer.pages == PAGES_HUGETLB;
+            int64_t total_kb = 0;
+            char line[512];
+            while(fgets(line, sizeof line, file) != nullptr)
+            {
+                unsigned long long map_from = 0, map_to = 0;
+                long long kb = 0;
+                if(sscanf(line, "%llx-%llx ", &map_from, &map_to) == 2)
+                    inside = (uintptr_t) map_from < to && (uintptr_t) map_to > from;
+                else if(inside && hugetlb == false && sscanf(line, "AnonHugePages: %lld kB", &kb) == 1)
+                    total_kb += kb;
+                else if(inside && hugetlb && sscanf(line, "Private_Hugetlb: %lld kB", &kb) == 1)
+                    total_kb += kb;
+            }
+
+            fclose(file);
+            return total_kb * 1024;
+        }
+    #else
+        static int32_t numa_node_of(void const*) noexcept { return -1; }
+
+        static Memory_Buffer alloc_buffer(int64_t size, Buffer_Options const& options) noexcept
+        {
+            Memory_Buffer buffer;
+            if(size <= 0)
+                size = 1;
+
+            int64_t alignment = options.alignment > 0 ? options.alignment : 1;
+            if(options.pages != PAGES_DEFAULT && options.fallback == false)
+                return buffer;
+
+            buffer.mapping = malloc((size_t) (size + alignment));
+            if(buffer.mapping == nullptr)
+                return buffer;
+
+            buffer.mapping_size = size + alignment;
+            buffer.data = (char*) (((uintptr_t) buffer.mapping + (uintptr_t) alignment - 1) / (uintptr_t) alignment * (uintptr_t) alignment);
+            buffer.size = size;
+            if(options.prefault)
+                memory_internal::prefault(buffer.data, buffer.size);
+            return buffer;
+        }
+
+        static void free_buffer(Memory_Buffer* buffer) noexcept
+        {
+            free(buffer->mapping);
+            *buffer = Memory_Buffer();
+        }
+
+        static int64_t huge_page_bytes(Memory_Buffer const&) noexcept { return -1; }
+    #endif
+
+    static Memory_Buffer alloc_buffer(int64_t size, int32_t numa_node) noexcept
+    {
+        Buffer_Options options;
+        options.numa_node = numa_node;
+        return alloc_buffer(size, options);
+    }
+
+    template <typename Init, typename Fn>
+    static Page_Size_Result benchmark_page_sizes(int64_t size, Buffer_Options const& options, int64_t max_time_ms, int64_t warm_up_ms, Init init, Fn measured_fn, int64_t runs_mult) noexcept
+    {
+        Page_Size_Result out;
+        auto run = [&](Buffer_Options const& buffer_options, Bench_Result* result) -> Memory_Buffer {
+            Memory_Buffer buffer = alloc_buffer(size, buffer_options);
+            if(buffer.data != nullptr)
+            {
+                init(buffer);
+                *result = benchmark(max_time_ms, warm_up_ms, [&]{ return measured_fn(buffer); }, runs_mult);
+            }
+            return buffer;
+        };
+
+        Buffer_Options small_options = options;
+        small_options.pages = PAGES_SMALL;
+        small_options.fallback = true;
+        Memory_Buffer small = run(small_options, &out.small);
+        free_buffer(&small);
+
+        //prefer the reserved pool since transparent huge pages are not guaranteed
+        Buffer_Options huge_options = options;
+        huge_options.pages = PAGES_HUGETLB;
+        huge_options.fallback = false;
+        huge_options.prefault = false; //hugetlb pages are reserved by mmap so this is enough to know
+        Memory_Buffer huge = alloc_buffer(size, huge_options);
+        if(huge.data == nullptr)
+            huge_options.pages = PAGES_TRANSPARENT_HUGE;
+        free_buffer(&huge);
+
+        huge_options.prefault = options.prefault;
+        huge_options.fallback = true;
+        huge = run(huge_options, &out.huge);
+        out.huge_pages = huge.pages;
+        out.huge_page_bytes = huge_page_bytes(huge);
+        free_buffer(&huge);
+
+        if(out.huge.mean_ms > 0)
+            out.speedup = out.small.mean_ms / out.huge.mean_ms;
+        return out;
+    }
+
+    static Memory_Bench_Result benchmark_memory(Memory_Bench_Options const& options) noexcept
+    {
+        //The thread is placed first so that without a memory node the first touch
+        // puts the memory on the same node
+        Memory_Bench_Result result;
+        std::thread thread([&]{
+            bool pinned = options.cpu_node >= 0 && pin_thread_to_numa_node(options.cpu_node);
+            result = memory_internal::run_kernels(options, options.memory_node);
+            result.cpu_node = pinned ? options.cpu_node : -1;
+        });
+        thread.join();
+        return result;
+    }
+
+    static int64_t benchmark_memory_numa(Memory_Bench_Options const& options, Memory_Bench_Result* results, int64_t capacity) noexcept
+    {
+        std::unique_ptr<Cpu_Topology> topology(new Cpu_Topology());
+        query_cpu_topology(topology.get());
+        int64_t nodes = topology->numa_nodes > 0 ? topology->numa_nodes : 1;
+
+        if(capacity < nodes*nodes)
+            return 0;
+
+        for(int64_t cpu_node = 0; cpu_node < nodes; cpu_node++)
+            for(int64_t memory_node = 0; memory_node < nodes; memory_node++)
+            {
+                Memory_Bench_Options placed = options;
+                placed.cpu_node = (int32_t) cpu_node;
+                placed.memory_node = (int32_t) memory_node;
+                results[cpu_node*nodes + memory_node] = benchmark_memory(placed);
+            }
+
+        return nodes;
+    }
+
+    namespace memory_internal
+    {
+        //the same fill byte is used by memset so source and destination stay equal for memcmp
+        static constexpr unsigned char MEM_FILL = 0x5A;
+
+        static void copy_kernel(void* destination, void const* source, size_t size) noexcept { memcpy(destination, source, size); }
+        static void move_kernel(void* destination, void const* source, size_t size) noexcept { memmove(destination, source, size); }
+        static void set_kernel(void* destination, void const*, size_t size) noexcept { memset(destination, MEM_FILL, size); }
+        static void compare_kernel(void* destination, void const* source, size_t size) noexcept 
+        { 
+            int result = memcmp(destination, source, size);
+            do_no_optimize(result);
+        }
+    }
+
+    static Mem_Kernel const* builtin_mem_kernels(int64_t* count) noexcept
+    {
+        using namespace memory_internal;
+        static const Mem_Kernel kernels[] = {
+            {"memcpy", MEM_KERNEL_COPY, copy_kernel},
+            {"memmove", MEM_KERNEL_COPY, move_kernel},
+            {"memset", MEM_KERNEL_SET, set_kernel},
+            {"memcmp", MEM_KERNEL_COMPARE, compare_kernel},
+        };
+
+        *count = (int64_t) (sizeof kernels / sizeof kernels[0]);
+        return kernels;
+    }
+
+    static int64_t benchmark_mem_kernels(Mem_Kernel const* kernels, int64_t kernel_count, Mem_Sweep_Options const& options, Mem_Sweep_Point* points, int64_t capacity) noexcept
+    {
+        using namespace memory_internal;
+        int64_t max_offset = 0;
+        for(int64_t i = 0; i < options.source_offset_count; i++)
+            max_offset = options.source_offsets[i] > max_offset ? options.source_offsets[i] : max_offset;
+        for(int64_t i = 0; i < options.destination_offset_count; i++)
+            max_offset = options.destination_offsets[i] > max_offset ? options.destination_offsets[i] : max_offset;
+
+        //Each slot is page aligned plus a few cache lines of skew so that consecutive slots
+        // dont all map to the same cache sets
+        int64_t max_size = options.max_size > options.min_size ? options.max_size : options.min_size;
+        int64_t max_stride = (max_size + max_offset + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE + 3*CACHE_LINE;
+        int64_t pool_bytes = options.cold ? options.cold_bytes : 0;
+        if(pool_bytes < 2*max_stride)
+            pool_bytes = 2*max_stride;
+
+        Memory_Buffer source = alloc_buffer(pool_bytes);
+        Memory_Buffer destination = alloc_buffer(pool_bytes);
+        if(source.data == nullptr || destination.data == nullptr)
+        {
+            free_buffer(&source);
+            free_buffer(&destination);
+            return 0;
+        }
+
+        memset(source.data, MEM_FILL, (size_t) pool_bytes);
+        memset(destination.data, MEM_FILL, (size_t) pool_bytes);
+
+        int64_t count = 0;
+        for(double size_f = (double) (options.min_size > 0 ? options.min_size : 1); size_f <= (double) max_size; )
+        {
+            int64_t size = (int64_t) size_f;
+            int64_t stride = (size + max_offset + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE + 3*CACHE_LINE;
+            int64_t slots = pool_bytes / stride;
+
+            for(int64_t k = 0; k < kernel_count; k++)
+            {
+                Mem_Kernel const& kernel = kernels[k];
+                int64_t source_offset_count = kernel.kind == MEM_KERNEL_SET ? 1 : options.source_offset_count;
+                for(int64_t s = 0; s < source_offset_count; s++)
+                    for(int64_t d = 0; d < options.destination_offset_count; d++)
+                        for(int cold = 0; cold < 2; cold++)
+                        {
+                            //when full we just skip the rest
+                            if((cold ? options.cold : options.warm) == false || count >= capacity)
+                                continue;
+
+                            Mem_Sweep_Point* point = &points[count++];
+                            *point = Mem_Sweep_Point();
+                            point->kernel = kernel.name;
+                            point->size = size;
+                            point->source_offset = kernel.kind == MEM_KERNEL_SET ? 0 : options.source_offsets[s];
+                            point->destination_offset = options.destination_offsets[d];
+                            point->cold = cold != 0;
+
+                            char* from = source.data + point->source_offset;
+                            char* to = destination.data + point->destination_offset;
+                            void const* kernel_source = kernel.kind == MEM_KERNEL_SET ? nullptr : from;
+                            int64_t slot = 0;
+                            int64_t slot_count = cold ? slots : 1;
+                            Mem_Kernel_Fn fn = kernel.fn;
+
+                            point->result = with_throughput(benchmark(options.max_time_ms, options.warm_up_ms, [&]{
+                                int64_t at = slot*stride;
+                                fn(to + at, kernel_source != nullptr ? from + at : nullptr, (size_t) size);
+                                slot = slot + 1 < slot_count ? slot + 1 : 0;
+                                return true;
+                            }), (double) size);
+                        }
+            }
+
+            //we want every size exactly once even if the step is small
+            double next = size_f * options.size_step;
+            size_f = (int64_t) next > size ? next : (double) (size + 1);
+        }
+
+        free_buffer(&source);
+        free_buffer(&destination);
+        return count;
+    }
+
+    static bool write_mem_sweep_csv(const char* path, Mem_Sweep_Point const* points, int64_t count) noexcept
+    {
+        FILE* file = fopen(path, "wb");
+        if(file == nullptr)
+            return false;
+
+        fprintf(file, "kernel,size,source_offset,destination_offset,cold,mean_ns,deviation_ns,mean_ci_ns,bytes_per_second\n");
+        for(int64_t i = 0; i < count; i++)
+        {
+            Mem_Sweep_Point const& point = points[i];
+            fprintf(file, "%s,%lld,%d,%d,%d,%.3f,%.3f,%.3f,%.0f\n", point.kernel, (long long) point.size, 
+                (int) point.source_offset, (int) point.destination_offset, (int) point.cold, 
+                point.result.mean_ms*1e6, point.result.deviation_ms*1e6, point.result.mean_ci_ms*1e6, 
+                point.result.throughput.bytes_per_second);
+        }
+
+        return fclose(file) == 0;
+    }
+}
@@ -0,0 +1,468 @@
+#pragma once
+#include "microbench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Small os specific helpers used by the optional parts of microbench (probes, suites...).
+//Everything here is implemented for linux. On other platforms the functions report failure
+// and the users fall back to doing less.
+#if defined(__linux__)
+    #define MICROBENCH_LINUX
+    #include <unistd.h>
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <sched.h>
+    #include <time.h>
+    #include <sys/syscall.h>
+    #include <sys/ioctl.h>
+    #include <linux/perf_event.h>
+    #include <linux/futex.h>
+#endif
+#include <thread>
+#include <atomic>
+
+namespace microbench
+{
+    //Reads the whole (small) file at path into buffer and null terminates it.
+    // Returns the number of bytes read or -1 on failure. Meant for /proc and /sys files.
+    static int64_t read_small_file(const char* path, char* buffer, int64_t buffer_size) noexcept;
+
+    //Reads a single integer from the start of a file. Returns if_fails when it cannot.
+    static int64_t read_file_int(const char* path, int64_t if_fails) noexcept;
+
+    //Returns the resident memory of the process in kB or -1 if unknown
+    static int64_t current_rss_kb() noexcept;
+
+    //Returns the cpu the calling thread is currently running on or -1 if unknown
+    static int32_t current_cpu() noexcept;
+
+    //Returns the os id of the calling thread (tid on linux) or -1 if unknown
+    static int64_t current_thread_id() noexcept;
+
+    static void sleep_ms(int64_t ms) noexcept;
+
+    //Restricts the calling thread to run only on the given cpu. Returns false on failure.
+    static bool pin_thread_to_cpu(int32_t cpu) noexcept;
+
+    //Restricts the calling thread to the cpus of the given numa node. Returns false on failure.
+    static bool pin_thread_to_numa_node(int32_t node) noexcept;
+
+    //Lets the calling thread run anywhere except the given cpu. Used to keep helper threads away 
+    // from the benchmark. Returns false on failure or if there is no other cpu.
+    static bool keep_thread_off_cpu(int32_t cpu) noexcept;
+
+    enum Perf_Counter
+    {
+        PERF_COUNTER_CYCLES,
+        PERF_COUNTER_INSTRUCTIONS,
+        PERF_COUNTER_CACHE_MISSES,
+        PERF_COUNTER_BRANCH_MISSES,
+        PERF_COUNTER_TASK_CLOCK, //ns the thread was running
+        PERF_COUNTER_PAGE_FAULTS,
+        PERF_COUNTER_CONTEXT_SWITCHES,
+    };
+
+    //Opens a counting perf event (see perf_event_open(2)) for the given thread (0 means calling)
+    // on any cpu. Returns the file descriptor or -1 if perf is not available or not permitted.
+    static int perf_counter_open(Perf_Counter counter, int64_t thread_id = 0) noexcept;
+    //Same as above but takes the raw perf_event_attr type and config
+    static int perf_counter_open_raw(uint32_t type, uint64_t config, int64_t thread_id = 0) noexcept;
+
+    //Returns the current value of the counter or -1 on failure. Can be called from any thread.
+    static int64_t perf_counter_read(int fd) noexcept;
+    static void perf_counter_close(int fd) noexcept;
+
+    //Sleeps while *word == expected or until woken up (or spuriously). Returns false if futexes are not supported.
+    static bool futex_wait(std::atomic<int32_t>* word, int32_t expected) noexcept;
+    //Wakes up to count threads waiting on word. Returns the number of woken threads or -1 if not supported
+    static int64_t futex_wake(std::atomic<int32_t>* word, int32_t count = 1) noexcept;
+
+    static constexpr int64_t MAX_CPUS = 1024;
+
+    struct Cpu_Info
+    {
+        int32_t cpu = -1;
+        int32_t core = -1;    //physical core. Cpus with the same core and package are SMT siblings
+        int32_t package = -1; //socket
+        int32_t llc = -1;     //id of the last level cache (the lowest cpu sharing it)
+        int32_t numa_node = -1;
+        bool isolated = false; //in isolcpus
+        bool primary = false;  //lowest cpu of its physical core
+    };
+
+    struct Cpu_Topology
+    {
+        Cpu_Info cpus[MAX_CPUS];
+        int64_t count = 0; //online cpus in order
+        int64_t numa_nodes = 0;
+    };
+
+    //Fills topology from /sys/devices/system/cpu. On failure (or other platforms) fills in 
+    // std::thread::hardware_concurrency() cpus without any structure and returns false.
+    static bool query_cpu_topology(Cpu_Topology* topology) noexcept;
+
+    //Calls fn(cpu) for every cpu in linux cpu list format such as "0-3,8,10-11"
+    template <typename Fn>
+    static void for_each_in_cpu_list(const char* list, Fn fn) noexcept;
+
+    //Reads the model specific register of the given cpu through /dev/cpu/*/msr (needs the msr module
+    // and usually root). Returns false on failure.
+    static bool read_msr(int32_t cpu, uint32_t msr, uint64_t* value) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    static int64_t read_small_file(const char* path, char* buffer, int64_t buffer_size) noexcept
+    {
+        assert(buffer_size > 0);
+        FILE* file = fopen(path, "rb");
+        if(file == nullptr)
+        {
+            buffer[0] = '\0';
+            return -1;
+        }
+
+        size_t read = fread(buffer, 1, (size_t) buffer_size - 1, file);
+        fclose(file);
+        buffer[read] = '\0';
+        return (int64_t) read;
+    }
+
+    static int64_t read_file_int(const char* path, int64_t if_fails) noexcept
+    {
+        char buffer[64];
+        if(read_small_file(path, buffer, sizeof buffer) <= 0)
+            return if_fails;
+
+        long long value = 0;
+        if(sscanf(buffer, "%lld", &value) != 1)
+            return if_fails;
+
+        return (int64_t) value;
+    }
+
+    template <typename Fn>
+    static void for_each_in_cpu_list(const char* list, Fn fn) noexcept
+    {
+        const char* at = list;
+        while(*at != '\0')
+        {
+            char* end = nullptr;
+            long from = strtol(at, &end, 10);
+            if(end == at)
+                break;
+
+            long to = from;
+            at = end;
+            if(*at == '-')
+            {
+                to = strtol(at + 1, &end, 10);
+                at = end;
+            }
+
+            for(long cpu = from; cpu <= to; cpu++)
+                fn((int32_t) cpu);
+
+            if(*at != ',')
+                break;
+            at++;
+        }
+    }
+
+    static bool query_cpu_topology(Cpu_Topology* topology) noexcept
+    {
+        *topology = Cpu_Topology();
+
+        char list[4096];
+        char path[256];
+        bool ok = read_small_file("/sys/devices/system/cpu/online", list, sizeof list) > 0;
+        if(ok)
+        {
+            for_each_in_cpu_list(list, [&](int32_t cpu){
+                if(topology->count >= MAX_CPUS)
+                    return;
+
+                Cpu_Info info;
+                info.cpu = cpu;
+                snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/core_id", (int) cpu);
+                info.core = (int32_t) read_file_int(path, cpu);
+                snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", (int) cpu);
+                info.package = (int32_t) read_file_int(path, 0);
+
+                //the llc is the highest level cache. We identify it by the lowest cpu sharing it
+                int64_t highest_level = -1;
+                info.llc = cpu;
+                for(int index = 0; index < 16; index++)
+                {
+                    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", (int) cpu, index);
+                    int64_t level = read_file_int(path, -1);
+                    if(level < 0)
+                        break;
+
+                    char shared[4096];
+                    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", (int) cpu, index);
+                    if(level > highest_level && read_small_file(path, shared, sizeof shared) > 0)
+                    {
+                        highest_level = level;
+                        info.llc = (int32_t) strtol(shared, nullptr, 10);
+                    }
+                }
+
+                topology->cpus[topology->count++] = info;
+            });
+        }
+
+        if(ok == false || topology->count == 0)
+        {
+            int64_t count = (int64_t) std::thread::hardware_concurrency();
+            if(count <= 0)
+                count = 1;
+            if(count > MAX_CPUS)
+                count = MAX_CPUS;
+
+            for(int64_t i = 0; i < count; i++)
+            {
+                Cpu_Info info;
+                info.cpu = (int32_t) i;
+                info.core = (int32_t) i;
+                info.package = 0;
+                info.llc = 0;
+                info.numa_node = 0;
+                info.primary = true;
+                topology->cpus[i] = info;
+            }
+
+            topology->count = count;
+            topology->numa_nodes = 1;
+            return false;
+        }
+
+        auto find = [&](int32_t cpu) -> Cpu_Info* {
+            for(int64_t i = 0; i < topology->count; i++)
+                if(topology->cpus[i].cpu == cpu)
+                    return &topology->cpus[i];
+            return nullptr;
+        };
+
+        if(read_small_file("/sys/devices/system/cpu/isolated", list, sizeof list) > 0)
+            for_each_in_cpu_list(list, [&](int32_t cpu){
+                if(Cpu_Info* info = find(cpu))
+                    info->isolated = true;
+            });
+
+        if(read_small_file("/sys/devices/system/node/online", list, sizeof list) > 0)
+            for_each_in_cpu_list(list, [&](int32_t node){
+                char cpus[4096];
+                snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", (int) node);
+                if(read_small_file(path, cpus, sizeof cpus) < 0)
+                    return;
+
+                if(topology->numa_nodes < node + 1)
+                    topology->numa_nodes = node + 1;
+
+                for_each_in_cpu_list(cpus, [&](int32_t cpu){
+                    if(Cpu_Info* info = find(cpu))
+                        info->numa_node = node;
+                });
+            });
+
+        if(topology->numa_nodes == 0)
+            topology->numa_nodes = 1;
+
+        //primary is the lowest numbered cpu of the given core
+        for(int64_t i = 0; i < topology->count; i++)
+        {
+            Cpu_Info* info = &topology->cpus[i];
+            if(info->numa_node < 0)
+                info->numa_node = 0;
+
+            info->primary = true;
+            for(int64_t j = 0; j < topology->count; j++)
+            {
+                Cpu_Info const& other = topology->cpus[j];
+                if(other.core == info->core && other.package == info->package && other.cpu < info->cpu)
+                    info->primary = false;
+            }
+        }
+
+        return true;
+    }
+
+    #ifdef MICROBENCH_LINUX
+        static int64_t current_rss_kb() noexcept
+        {
+            //the second field is the resident size in pages
+            char statm[256];
+            long long size = 0, resident = 0;
+            if(read_small_file("/proc/self/statm", statm, sizeof statm) <= 0 || sscanf(statm, "%lld %lld", &size, &resident) != 2)
+                return -1;
+
+            return (int64_t) resident * (int64_t) sysconf(_SC_PAGESIZE) / 1024;
+        }
+
+        static int32_t current_cpu() noexcept
+        {
+            return (int32_t) sched_getcpu();
+        }
+
+        static int64_t current_thread_id() noexcept
+        {
+            return (int64_t) syscall(SYS_gettid);
+        }
+
+        static void sleep_ms(int64_t ms) noexcept
+        {
+            struct timespec time = {};
+            time.tv_sec = (time_t) (ms / 1000);
+            time.tv_nsec = (long) (ms % 1000) * 1000000;
+            while(nanosleep(&time, &time) != 0) {} //restart when interrupted by a signal
+        }
+
+        static bool pin_thread_to_cpu(int32_t cpu) noexcept
+        {
+            if(cpu < 0 || cpu >= CPU_SETSIZE)
+                return false;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return sched_setaffinity(0, sizeof set, &set) == 0;
+        }
+
+        static bool pin_thread_to_numa_node(int32_t node) noexcept
+        {
+            char path[128];
+            char list[4096];
+            snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", (int) node);
+            if(node < 0 || read_small_file(path, list, sizeof list) <= 0)
+                return false;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for_each_in_cpu_list(list, [&](int32_t cpu){
+                if(cpu >= 0 && cpu < CPU_SETSIZE)
+                    CPU_SET(cpu, &set);
+            });
+
+            if(CPU_COUNT(&set) == 0)
+                return false;
+
+            return sched_setaffinity(0, sizeof set, &set) == 0;
+        }
+
+        static bool keep_thread_off_cpu(int32_t cpu) noexcept
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if(cpu < 0 || cpu >= CPU_SETSIZE || sched_getaffinity(0, sizeof set, &set) != 0)
+                return false;
+
+            CPU_CLR(cpu, &set);
+            if(CPU_COUNT(&set) == 0)
+                return false;
+
+            return sched_setaffinity(0, sizeof set, &set) == 0;
+        }
+
+        static int perf_counter_open_raw(uint32_t type, uint64_t config, int64_t thread_id) noexcept
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof attr);
+            attr.size = sizeof attr;
+            attr.type = type;
+            attr.config = config;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            long fd = syscall(SYS_perf_event_open, &attr, (pid_t) thread_id, -1, -1, 0);
+            if(fd < 0)
+            {
+                //most commonly we are not allowed to see kernel - try again with user space only
+                attr.exclude_kernel = 1;
+                fd = syscall(SYS_perf_event_open, &attr, (pid_t) thread_id, -1, -1, 0);
+            }
+
+            return (int) fd;
+        }
+
+        static int perf_counter_open(Perf_Counter counter, int64_t thread_id) noexcept
+        {
+            switch(counter)
+            {
+                case PERF_COUNTER_CYCLES:           return perf_counter_open_raw(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, thread_id);
+                case PERF_COUNTER_INSTRUCTIONS:     return perf_counter_open_raw(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, thread_id);
+                case PERF_COUNTER_CACHE_MISSES:     return perf_counter_open_raw(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, thread_id);
+                case PERF_COUNTER_BRANCH_MISSES:    return perf_counter_open_raw(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, thread_id);
+                case PERF_COUNTER_TASK_CLOCK:       return perf_counter_open_raw(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, thread_id);
+                case PERF_COUNTER_PAGE_FAULTS:      return perf_counter_open_raw(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, thread_id);
+                case PERF_COUNTER_CONTEXT_SWITCHES: return perf_counter_open_raw(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, thread_id);
+                default:                            return -1;
+            }
+        }
+
+        static int64_t perf_counter_read(int fd) noexcept
+        {
+            if(fd < 0)
+                return -1;
+
+            //value, time enabled, time running
+            uint64_t values[3] = {0};
+            if(read(fd, values, sizeof values) != (ssize_t) sizeof values)
+                return -1;
+
+            //the counter was multiplexed with others - scale to the full time
+            if(values[2] != 0 && values[2] < values[1])
+                return (int64_t) ((double) values[0] * (double) values[1] / (double) values[2]);
+
+            return (int64_t) values[0];
+        }
+
+        static void perf_counter_close(int fd) noexcept
+        {
+            if(fd >= 0)
+                close(fd);
+        }
+
+        static bool futex_wait(std::atomic<int32_t>* word, int32_t expected) noexcept
+        {
+            //std::atomic<int32_t> is just the int32_t on every platform that has futexes
+            long state = syscall(SYS_futex, (int32_t*) (void*) word, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+            return state == 0 || errno == EAGAIN || errno == EINTR;
+        }
+
+        static int64_t futex_wake(std::atomic<int32_t>* word, int32_t count) noexcept
+        {
+            return (int64_t) syscall(SYS_futex, (int32_t*) (void*) word, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+        }
+
+        static bool read_msr(int32_t cpu, uint32_t msr, uint64_t* value) noexcept
+        {
+            char path[64];
+            snprintf(path, sizeof path, "/dev/cpu/%d/msr", (int) cpu);
+            int fd = open(path, O_RDONLY);
+            if(fd < 0)
+                return false;
+
+            bool ok = pread(fd, value, sizeof *value, (off_t) msr) == (ssize_t) sizeof *value;
+            close(fd);
+            return ok;
+        }
+    #else
+        static int64_t current_rss_kb() noexcept { return -1; }
+        static int32_t current_cpu() noexcept { return -1; }
+        static int64_t current_thread_id() noexcept { return -1; }
+        static void sleep_ms(int64_t ms) noexcept { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+        static bool pin_thread_to_cpu(int32_t) noexcept { return false; }
+        static bool pin_thread_to_numa_node(int32_t) noexcept { return false; }
+        static bool keep_thread_off_cpu(int32_t) noexcept { return false; }
+        static int perf_counter_open(Perf_Counter, int64_t) noexcept { return -1; }
+        static int perf_counter_open_raw(uint32_t, uint64_t, int64_t) noexcept { return -1; }
+        static int64_t perf_counter_read(int) noexcept { return -1; }
+        static void perf_counter_close(int) noexcept {}
+        static bool futex_wait(std::atomic<int32_t>*, int32_t) noexcept { return false; }
+        static int64_t futex_wake(std::atomic<int32_t>*, int32_t) noexcept { return -1; }
+        static bool read_msr(int32_t, uint32_t, uint64_t*) noexcept { return false; }
+    #endif
+}
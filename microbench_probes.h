@@ -0,0 +1,719 @@
+#pragma once
+#include "microbench_os.h"
+#include <atomic>
+#include <thread>
+
+#ifdef MICROBENCH_LINUX
+    #include <sys/resource.h>
+#endif
+
+//Probes for the benchmark(probe, ...) overload. Each of them watches some part of the system
+// during the measured window and writes what it found into the Bench_Result.
+//Multiple probes can be combined using probes(a, b).
+namespace microbench
+{
+    //Samples the effective frequency of the cpu running the benchmark during the measured window
+    // and fills Bench_Result::freq. In order of preference uses:
+    //  1) perf cycles and task clock counters of the benchmark thread (effective frequency while running)
+    //  2) APERF/MPERF msrs of the cpu the benchmark started on
+    //  3) cpufreq scaling_cur_freq of that cpu (only what the governor asked for, not what we got)
+    //The sampling happens on a separate mostly sleeping thread. For the msr and cpufreq sources
+    // the benchmark thread should be pinned else we might be looking at the wrong cpu.
+    struct Freq_Probe
+    {
+        int64_t interval_ms = 10;
+        bool warn_governor = true; //prints a warning to stderr if the governor isnt "performance"
+
+        Freq_Probe() noexcept = default;
+        Freq_Probe(Freq_Probe const&) = delete;
+        Freq_Probe& operator=(Freq_Probe const&) = delete;
+        ~Freq_Probe() noexcept;
+
+        void begin() noexcept;
+        void batch(int64_t, bool) noexcept {}
+        void end() noexcept;
+        void report(Bench_Result* result) noexcept;
+
+        //Internals
+        struct Sample
+        {
+            int64_t cycles = 0; //cycles or APERF
+            int64_t ref = 0;    //task clock in ns or MPERF
+            int64_t wall_ns = 0;
+            double mhz = 0.0;   //only for cpufreq
+        };
+
+        bool take_sample(Sample* sample) noexcept;
+        double mhz_between(Sample const& from, Sample const& to) const noexcept;
+        void stop_sampler() noexcept;
+
+        Freq_Stats stats;
+        Sample first;
+        Sample last;
+        double mhz_sum = 0.0;
+        int64_t throttle_count_begin = 0;
+
+        int cycles_fd = -1;
+        int task_clock_fd = -1;
+        bool perf_tried = false;
+        int32_t cpu = -1;
+
+        std::atomic<bool> running = {false};
+        std::thread sampler;
+    };
+
+    //Watches the benchmark cpu and thread for things that are not the benchmark: device interrupts, 
+    // network/block softirqs, preemptions of the benchmark thread and system load. A sampling interval
+    // in which any of these exceeds its threshold is a noise event and all accepted batches 
+    // finished within it are counted as noisy. Fills Bench_Result::noise.
+    //Timer ticks and timer/rcu/scheduler softirqs happen all the time and are not counted.
+    struct Noise_Probe
+    {
+        int64_t interval_ms = 5;
+        //an interval is noisy when it has more than this many of:
+        int64_t interrupt_threshold = 0;
+        int64_t softirq_threshold = 0;
+        int64_t involuntary_switch_threshold = 0;
+
+        Noise_Probe() noexcept = default;
+        Noise_Probe(Noise_Probe const&) = delete;
+        Noise_Probe& operator=(Noise_Probe const&) = delete;
+        ~Noise_Probe() noexcept;
+
+        void begin() noexcept;
+        FORCE_INLINE void batch(int64_t, bool accepted) noexcept
+        {
+            //only we write this so there is no need for an atomic add
+            if(accepted)
+                batches.store(batches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        void end() noexcept;
+        void report(Bench_Result* result) noexcept;
+
+        //Internals
+        struct Sample
+        {
+            int64_t interrupts = 0;
+            int64_t softirqs = 0;
+            int64_t voluntary_switches = 0;
+            int64_t involuntary_switches = 0;
+            double load = 0.0;
+            int64_t batches = 0;
+        };
+
+        void take_sample(Sample* sample) noexcept;
+        void process_sample() noexcept;
+        void stop_sampler() noexcept;
+
+        Noise_Stats stats;
+        Sample first;
+        Sample last;
+        int32_t cpu = -1;
+        int64_t thread_id = -1;
+        bool shares_cpu = false;
+
+        std::atomic<int64_t> batches = {0};
+        std::atomic<bool> running = {false};
+        std::thread sampler;
+    };
+
+    //Counts perf events (instructions, cache misses...) of the benchmark thread during the measured window
+    // and appends them as counters to Bench_Result::counters (see find_counter). Only totals are read so
+    // the reported deviation is 0. Events which could not be opened are not reported.
+    struct Perf_Probe
+    {
+        static constexpr int64_t MAX_EVENTS = 8;
+
+        Perf_Probe() noexcept = default;
+        Perf_Probe(Perf_Probe const&) = delete;
+        Perf_Probe& operator=(Perf_Probe const&) = delete;
+        ~Perf_Probe() noexcept;
+
+        //Adds event to be counted. The name defaults to the perf tool one ("instructions", "cache-misses"...).
+        // Returns its index or -1 if full.
+        int64_t add(Perf_Counter counter, const char* name = nullptr) noexcept;
+        //Adds raw event (perf_event_attr type and config) such as a model specific HITM event
+        int64_t add_raw(const char* name, uint32_t type, uint64_t config) noexcept;
+        //Returns if the event could be opened. Only valid after the benchmark ran
+        bool available(int64_t index) const noexcept { return events[index].fd >= 0; }
+
+        void begin() noexcept;
+        void batch(int64_t, bool) noexcept {}
+        void end() noexcept;
+        void report(Bench_Result* result) noexcept;
+
+        //Internals
+        struct Event
+        {
+            char name[32] = {0};
+            uint32_t type = 0;
+            uint64_t config = 0;
+            int32_t counter = -1; //Perf_Counter or -1 if raw
+            int fd = -1;
+            bool opened = false;
+            int64_t start = 0;
+            int64_t total = 0;
+        };
+
+        Event events[MAX_EVENTS];
+        int64_t count = 0;
+    };
+
+    //Takes getrusage and resident memory snapshots at the start and end of the measured window and fills
+    // Bench_Result::rusage. Faults and context switches are of the benchmark thread where supported 
+    // (RUSAGE_THREAD) and of the whole process otherwise. Memory is always of the whole process.
+    struct Rusage_Probe
+    {
+        void begin() noexcept { take_sample(&first); }
+        void batch(int64_t, bool) noexcept {}
+        void end() noexcept { take_sample(&last); }
+        void report(Bench_Result* result) noexcept;
+
+        //Internals
+        struct Sample
+        {
+            int64_t minor_faults = 0;
+            int64_t major_faults = 0;
+            int64_t voluntary_switches = 0;
+            int64_t involuntary_switches = 0;
+            int64_t rss_kb = 0;
+            int64_t peak_rss_kb = 0;
+            bool thread_only = false;
+        };
+
+        static void take_sample(Sample* sample) noexcept;
+
+        Sample first;
+        Sample last;
+    };
+}
+
+//Implementation
+namespace microbench
+{
+    namespace probes_internal
+    {
+        static int64_t cpu_throttle_count(int32_t cpu) noexcept
+        {
+            char path[128];
+            snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/thermal_throttle/core_throttle_count", (int) cpu);
+            int64_t core = read_file_int(path, 0);
+            snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/thermal_throttle/package_throttle_count", (int) cpu);
+            int64_t package = read_file_int(path, 0);
+            return core + package;
+        }
+
+        //Sums the column of the given cpu in a /proc/interrupts or /proc/softirqs like table
+        // over all rows for which is_counted(label) returns true. Returns false if the cpu is not in the table.
+        template <typename Is_Counted>
+        static bool sum_proc_cpu_table(const char* path, int32_t cpu, int64_t* sum, Is_Counted is_counted) noexcept
+        {
+            *sum = 0;
+            FILE* file = fopen(path, "rb");
+            if(file == nullptr)
+                return false;
+
+            //the header lists only online cpus so we have to find our column
+            char cpu_name[32];
+            snprintf(cpu_name, sizeof cpu_name, "CPU%d", (int) cpu);
+
+            char line[16384];
+            int64_t column = -1;
+            if(fgets(line, sizeof line, file) != nullptr)
+            {
+                int64_t index = 0;
+                for(char* token = strtok(line, " \t\n"); token != nullptr; token = strtok(nullptr, " \t\n"), index++)
+                    if(strcmp(token, cpu_name) == 0)
+                        column = index;
+            }
+
+            while(column >= 0 && fgets(line, sizeof line, file) != nullptr)
+            {
+                char* label = line;
+                while(*label == ' ')
+                    label++;
+
+                char* colon = strchr(label, ':');
+                if(colon == nullptr)
+                    continue;
+
+                *colon = '\0';
+                if(is_counted(label) == false)
+                    continue;
+
+                char* at = colon + 1;
+                for(int64_t i = 0; i <= column; i++)
+                {
+                    char* end = nullptr;
+                    long long value = strtoll(at, &end, 10);
+                    if(end == at) //row doesnt have per cpu values (ERR, MIS...)
+                        break;
+
+                    if(i == column)
+                        *sum += (int64_t) value;
+                    at = end;
+                }
+            }
+
+            fclose(file);
+            return column >= 0;
+        }
+
+        //Reads "name: value" line from /proc/*/status like file
+        static int64_t read_status_field(const char* path, const char* name) noexcept
+        {
+            char buffer[4096];
+            if(read_small_file(path, buffer, sizeof buffer) <= 0)
+                return 0;
+
+            char const* found = strstr(buffer, name);
+            if(found == nullptr)
+                return 0;
+
+            return (int64_t) strtoll(found + strlen(name) + 1, nullptr, 10);
+        }
+
+        //the msrs holding the actual and maximum (= nominal) performance counters
+        static constexpr uint32_t MSR_MPERF = 0xE7;
+        static constexpr uint32_t MSR_APERF = 0xE8;
+    }
+
+    inline Freq_Probe::~Freq_Probe() noexcept
+    {
+        stop_sampler();
+        perf_counter_close(cycles_fd);
+        perf_counter_close(task_clock_fd);
+    }
+
+    inline void Freq_Probe::stop_sampler() noexcept
+    {
+        running.store(false);
+        if(sampler.joinable())
+            sampler.join();
+    }
+
+    inline bool Freq_Probe::take_sample(Sample* sample) noexcept
+    {
+        sample->wall_ns = clock_ns();
+        switch(stats.source)
+        {
+            case FREQ_SOURCE_PERF: {
+                sample->cycles = perf_counter_read(cycles_fd);
+                sample->ref = perf_counter_read(task_clock_fd);
+                return sample->cycles >= 0 && sample->ref >= 0;
+            }
+            case FREQ_SOURCE_MSR: {
+                uint64_t aperf = 0;
+                uint64_t mperf = 0;
+                bool ok = read_msr(cpu, probes_internal::MSR_APERF, &aperf)
+                    && read_msr(cpu, probes_internal::MSR_MPERF, &mperf);
+                sample->cycles = (int64_t) aperf;
+                sample->ref = (int64_t) mperf;
+                return ok;
+            }
+            case FREQ_SOURCE_CPUFREQ: {
+                char path[128];
+                snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", (int) cpu);
+                int64_t khz = read_file_int(path, -1);
+                sample->mhz = (double) khz / 1000.0;
+                return khz > 0;
+            }
+            default: return false;
+        }
+    }
+
+    inline double Freq_Probe::mhz_between(Sample const& from, Sample const& to) const noexcept
+    {
+        double cycles = (double) (to.cycles - from.cycles);
+        double ref = (double) (to.ref - from.ref);
+        double wall_ns = (double) (to.wall_ns - from.wall_ns);
+        switch(stats.source)
+        {
+            //cycles per ns = GHz
+            case FREQ_SOURCE_PERF:
+                return ref > 0 ? cycles / ref * 1000.0 : 0.0;
+
+            //APERF/MPERF is the ratio to the nominal frequency. When we dont know it
+            // we assume the cpu was busy the whole time (it was running us after all)
+            case FREQ_SOURCE_MSR:
+                if(stats.nominal_mhz > 0 && ref > 0)
+                    return stats.nominal_mhz * cycles / ref;
+                return wall_ns > 0 ? cycles / wall_ns * 1000.0 : 0.0;
+
+            case FREQ_SOURCE_CPUFREQ:
+                return to.mhz;
+            default:
+                return 0.0;
+        }
+    }
+
+    inline void Freq_Probe::begin() noexcept
+    {
+        //begin is called again after warm up - throw away what we have so far
+        stop_sampler();
+
+        Freq_Stats old = stats;
+        stats = Freq_Stats();
+        stats.source = FREQ_SOURCE_NONE;
+        mhz_sum = 0.0;
+        cpu = current_cpu();
+
+        //the perf counters need to be opened from the benchmark thread.
+        //Their value does not matter since we only use deltas so we open them only once
+        if(perf_tried == false)
+        {
+            perf_tried = true;
+            cycles_fd = perf_counter_open(PERF_COUNTER_CYCLES);
+            task_clock_fd = perf_counter_open(PERF_COUNTER_TASK_CLOCK);
+        }
+
+        char path[128];
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cpufreq/base_frequency", (int) cpu);
+        stats.nominal_mhz = (double) read_file_int(path, 0) / 1000.0;
+
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", (int) cpu);
+        int64_t governor_len = read_small_file(path, stats.governor, sizeof stats.governor);
+        for(int64_t i = 0; i < governor_len; i++)
+            if(stats.governor[i] == '\n')
+                stats.governor[i] = '\0';
+        stats.governor_performance = strcmp(stats.governor, "performance") == 0;
+
+        //only warn the first time not after warmup again
+        if(warn_governor && governor_len > 0 && stats.governor_performance == false && old.governor[0] == '\0')
+            fprintf(stderr, "microbench: cpu%d is using the '%s' governor. Results will depend on the frequency scaling. Use 'performance' for stable results.\n", (int) cpu, stats.governor);
+
+        uint64_t msr = 0;
+        if(cycles_fd >= 0 && task_clock_fd >= 0)
+            stats.source = FREQ_SOURCE_PERF;
+        else if(cpu >= 0 && read_msr(cpu, probes_internal::MSR_APERF, &msr))
+            stats.source = FREQ_SOURCE_MSR;
+        else if(cpu >= 0 && governor_len > 0)
+            stats.source = FREQ_SOURCE_CPUFREQ;
+
+        throttle_count_begin = probes_internal::cpu_throttle_count(cpu);
+        if(stats.source == FREQ_SOURCE_NONE || take_sample(&first) == false)
+        {
+            stats.source = FREQ_SOURCE_NONE;
+            return;
+        }
+
+        last = first;
+        running.store(true);
+        sampler = std::thread([this]{
+            keep_thread_off_cpu(cpu);
+            while(running.load())
+            {
+                sleep_ms(interval_ms);
+                Sample sample;
+                if(take_sample(&sample) == false)
+                    continue;
+
+                double mhz = mhz_between(last, sample);
+                last = sample;
+                //the benchmark thread was not running in this interval
+                if(mhz <= 0)
+                    continue;
+
+                if(stats.samples == 0 || stats.min_mhz > mhz)
+                    stats.min_mhz = mhz;
+                if(stats.samples == 0 || stats.max_mhz < mhz)
+                    stats.max_mhz = mhz;
+
+                mhz_sum += mhz;
+                stats.samples += 1;
+            }
+        });
+    }
+
+    inline void Freq_Probe::end() noexcept
+    {
+        if(stats.source == FREQ_SOURCE_NONE)
+            return;
+
+        stop_sampler();
+        Sample sample;
+        if(take_sample(&sample))
+            last = sample;
+
+        //for counter based sources the mean over the whole window is exact
+        if(stats.source == FREQ_SOURCE_CPUFREQ)
+            stats.mean_mhz = stats.samples > 0 ? mhz_sum / (double) stats.samples : last.mhz;
+        else
+            stats.mean_mhz = mhz_between(first, last);
+
+        //window shorter than a single sampling interval
+        if(stats.samples == 0)
+        {
+            stats.min_mhz = stats.mean_mhz;
+            stats.max_mhz = stats.mean_mhz;
+        }
+
+        stats.throttle_events = probes_internal::cpu_throttle_count(cpu) - throttle_count_begin;
+        //running below the nominal frequency under full load means we are being throttled
+        stats.throttled = stats.throttle_events > 0
+            || (stats.nominal_mhz > 0 && stats.min_mhz > 0 && stats.min_mhz < stats.nominal_mhz * 0.95);
+    }
+
+    inline void Freq_Probe::report(Bench_Result* result) noexcept
+    {
+        if(stats.source != FREQ_SOURCE_NONE && result->iters > 0)
+        {
+            if(stats.source == FREQ_SOURCE_CPUFREQ)
+                //ms * MHz = 1000 cycles
+                stats.cycles_per_iter = result->mean_ms * stats.mean_mhz * 1000.0;
+            else
+                stats.cycles_per_iter = (double) (last.cycles - first.cycles) / (double) result->iters;
+        }
+
+        result->freq = stats;
+    }
+}
+
+namespace microbench
+{
+    inline Noise_Probe::~Noise_Probe() noexcept
+    {
+        stop_sampler();
+    }
+
+    inline void Noise_Probe::stop_sampler() noexcept
+    {
+        running.store(false);
+        if(sampler.joinable())
+            sampler.join();
+    }
+
+    inline void Noise_Probe::take_sample(Sample* sample) noexcept
+    {
+        using namespace probes_internal;
+        sample->batches = batches.load(std::memory_order_relaxed);
+
+        //the local timer fires at a fixed rate and is not interesting. Same for the rest of the 
+        // apic housekeeping (they also usually have no per cpu values)
+        sum_proc_cpu_table("/proc/interrupts", cpu, &sample->interrupts, [](const char* label){
+            return strcmp(label, "LOC") != 0 && strcmp(label, "ERR") != 0 && strcmp(label, "MIS") != 0;
+        });
+
+        sum_proc_cpu_table("/proc/softirqs", cpu, &sample->softirqs, [](const char* label){
+            return strcmp(label, "NET_TX") == 0 || strcmp(label, "NET_RX") == 0 || strcmp(label, "BLOCK") == 0
+                || strcmp(label, "IRQ_POLL") == 0 || strcmp(label, "TASKLET") == 0 || strcmp(label, "HI") == 0;
+        });
+
+        char path[128];
+        snprintf(path, sizeof path, "/proc/self/task/%lld/status", (long long) thread_id);
+        sample->voluntary_switches = read_status_field(path, "voluntary_ctxt_switches:");
+        sample->involuntary_switches = read_status_field(path, "nonvoluntary_ctxt_switches:");
+
+        char loadavg[128];
+        sample->load = 0.0;
+        if(read_small_file("/proc/loadavg", loadavg, sizeof loadavg) > 0)
+            sample->load = atof(loadavg);
+    }
+
+    inline void Noise_Probe::process_sample() noexcept
+    {
+        Sample sample;
+        take_sample(&sample);
+
+        bool noisy = sample.interrupts - last.interrupts > interrupt_threshold
+            || sample.softirqs - last.softirqs > softirq_threshold
+            || sample.involuntary_switches - last.involuntary_switches > involuntary_switch_threshold + (int64_t) shares_cpu;
+
+        if(noisy)
+        {
+            stats.events += 1;
+            stats.noisy_batches += sample.batches - last.batches;
+        }
+
+        if(stats.max_load < sample.load)
+            stats.max_load = sample.load;
+
+        stats.samples += 1;
+        last = sample;
+    }
+
+    inline void Noise_Probe::begin() noexcept
+    {
+        //begin is called again after warm up - throw away what we have so far
+        stop_sampler();
+        stats = Noise_Stats();
+        batches.store(0);
+        cpu = current_cpu();
+        thread_id = current_thread_id();
+
+        //all of the sources are in /proc
+        #ifdef MICROBENCH_LINUX
+            take_sample(&first);
+            last = first;
+            running.store(true);
+            sampler = std::thread([this]{
+                //when we have to share the cpu with the benchmark our own wake ups preempt it
+                shares_cpu = keep_thread_off_cpu(cpu) == false;
+                while(running.load())
+                {
+                    sleep_ms(interval_ms);
+                    process_sample();
+                }
+            });
+        #endif
+    }
+
+    inline void Noise_Probe::end() noexcept
+    {
+        if(running.load() == false)
+            return;
+
+        stop_sampler();
+        //the last partial interval
+        process_sample();
+
+        stats.batches = last.batches - first.batches;
+        stats.interrupts = last.interrupts - first.interrupts;
+        stats.softirqs = last.softirqs - first.softirqs;
+        stats.voluntary_switches = last.voluntary_switches - first.voluntary_switches;
+        stats.involuntary_switches = last.involuntary_switches - first.involuntary_switches;
+        if(stats.batches > 0)
+            stats.score = (double) stats.noisy_batches / (double) stats.batches;
+    }
+
+    inline void Noise_Probe::report(Bench_Result* result) noexcept
+    {
+        result->noise = stats;
+    }
+}
+
+namespace microbench
+{
+    inline Perf_Probe::~Perf_Probe() noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+            perf_counter_close(events[i].fd);
+    }
+
+    inline int64_t Perf_Probe::add(Perf_Counter counter, const char* name) noexcept
+    {
+        static const char* const default_names[] = {
+            "cycles", "instructions", "cache-misses", "branch-misses", "task-clock", "page-faults", "context-switches"
+        };
+
+        if(count >= MAX_EVENTS)
+            return -1;
+
+        Event* event = &events[count];
+        *event = Event();
+        event->counter = (int32_t) counter;
+        if(name == nullptr)
+            name = default_names[(int64_t) counter];
+        snprintf(event->name, sizeof event->name, "%s", name);
+        return count++;
+    }
+
+    inline int64_t Perf_Probe::add_raw(const char* name, uint32_t type, uint64_t config) noexcept
+    {
+        if(count >= MAX_EVENTS)
+            return -1;
+
+        Event* event = &events[count];
+        *event = Event();
+        event->type = type;
+        event->config = config;
+        snprintf(event->name, sizeof event->name, "%s", name);
+        return count++;
+    }
+
+    inline void Perf_Probe::begin() noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Event* event = &events[i];
+            //has to be opened from the benchmark thread. We open only once and use deltas
+            if(event->opened == false)
+            {
+                event->opened = true;
+                event->fd = event->counter >= 0
+                    ? perf_counter_open((Perf_Counter) event->counter)
+                    : perf_counter_open_raw(event->type, event->config);
+            }
+
+            event->start = perf_counter_read(event->fd);
+            event->total = 0;
+        }
+    }
+
+    inline void Perf_Probe::end() noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+            if(events[i].fd >= 0)
+                events[i].total = perf_counter_read(events[i].fd) - events[i].start;
+    }
+
+    inline void Perf_Probe::report(Bench_Result* result) noexcept
+    {
+        using namespace microbench::time_consts;
+        for(int64_t i = 0; i < count && result->counter_count < MAX_BENCH_COUNTERS; i++)
+        {
+            Event const& event = events[i];
+            if(event.fd < 0)
+                continue;
+
+            Counter_Stats stats;
+            memcpy(stats.name, event.name, sizeof stats.name);
+            stats.total = (double) event.total;
+            if(result->iters > 0)
+                stats.mean = stats.total / (double) result->iters;
+            if(result->mean_ms > 0)
+                stats.per_second = stats.mean * (double) SECOND_MILISECONDS / result->mean_ms;
+
+            result->counters[result->counter_count++] = stats;
+        }
+    }
+}
+
+namespace microbench
+{
+    inline void Rusage_Probe::take_sample(Sample* sample) noexcept
+    {
+        *sample = Sample();
+        #ifdef MICROBENCH_LINUX
+            struct rusage usage = {};
+            #ifdef RUSAGE_THREAD
+                sample->thread_only = getrusage(RUSAGE_THREAD, &usage) == 0;
+                if(sample->thread_only == false)
+            #endif
+                    getrusage(RUSAGE_SELF, &usage);
+
+            sample->minor_faults = (int64_t) usage.ru_minflt;
+            sample->major_faults = (int64_t) usage.ru_majflt;
+            sample->voluntary_switches = (int64_t) usage.ru_nvcsw;
+            sample->involuntary_switches = (int64_t) usage.ru_nivcsw;
+            sample->peak_rss_kb = (int64_t) usage.ru_maxrss; //in kB on linux. Always of the whole process
+            sample->rss_kb = current_rss_kb();
+        #else
+            (void) sample;
+        #endif
+    }
+
+    inline void Rusage_Probe::report(Bench_Result* result) noexcept
+    {
+        Rusage_Stats stats;
+        stats.minor_faults = last.minor_faults - first.minor_faults;
+        stats.major_faults = last.major_faults - first.major_faults;
+        stats.voluntary_switches = last.voluntary_switches - first.voluntary_switches;
+        stats.involuntary_switches = last.involuntary_switches - first.involuntary_switches;
+        stats.rss_begin_kb = first.rss_kb;
+        stats.rss_end_kb = last.rss_kb;
+        stats.peak_rss_delta_kb = last.peak_rss_kb - first.peak_rss_kb;
+        stats.thread_only = first.thread_only && last.thread_only;
+
+        if(result->iters > 0)
+        {
+            double iters = (double) result->iters;
+            stats.minor_faults_per_iter = (double) stats.minor_faults / iters;
+            stats.major_faults_per_iter = (double) stats.major_faults / iters;
+            stats.voluntary_switches_per_iter = (double) stats.voluntary_switches / iters;
+            stats.involuntary_switches_per_iter = (double) stats.involuntary_switches / iters;
+        }
+
+        result->rusage = stats;
+    }
+}
@@ -0,0 +1,597 @@
+#pragma once
+#include "microbench_os.h"
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#ifdef MICROBENCH_LINUX
+    #include <signal.h>
+    #include <ucontext.h>
+    #include <sys/mman.h>
+    #include <sys/time.h>
+#endif
+
+//Sampling profiler for the measured window. Use as any other probe:
+//  Profile_Probe profile;
+//  Bench_Result result = benchmark(profile, 1000, 100, fn);
+//  Hot_Spot spots[20];
+//  print_hot_spots(stdout, spots, profile_hot_spots(profile, false, spots, 20));
+//Samples the instruction pointer of the benchmark thread through perf_event (cycles or cpu-clock when there are no
+// hardware counters) or with a SIGPROF timer when perf is not allowed. The addresses are resolved against the
+// loaded binaries with nm (binutils) so static functions are found as well - compile with symbols (dont strip).
+namespace microbench
+{
+    enum Profile_Source
+    {
+        PROFILE_NONE = 0,
+        PROFILE_PERF_CYCLES = 1,
+        PROFILE_PERF_CPU_CLOCK = 2,
+        PROFILE_SIGPROF = 3,
+    };
+
+    struct Profile_Probe
+    {
+        static constexpr int64_t MAX_SAMPLES = 1 << 18;
+
+        int64_t frequency = 4000; //samples per second of cpu time
+        bool force_sigprof = false;
+
+        Profile_Probe() noexcept = default;
+        Profile_Probe(Profile_Probe const&) = delete;
+        Profile_Probe& operator=(Profile_Probe const&) = delete;
+        ~Profile_Probe() noexcept;
+
+        void begin() noexcept;
+        void batch(int64_t, bool) noexcept;
+        void end() noexcept;
+        //adds the "profile-samples" counter
+        void report(Bench_Result* result) noexcept;
+
+        //Sampled instruction pointers of the last measured window
+        std::unique_ptr<uint64_t[]> samples;
+        int64_t sample_count = 0;
+        int64_t lost = 0; //samples which did not fit or were dropped by the kernel
+        int32_t source = PROFILE_NONE; //Profile_Source that was used
+
+        //Internals
+        void push(uint64_t ip) noexcept;
+        void drain() noexcept;
+
+        int fd = -1;
+        void* ring = nullptr;
+        size_t ring_size = 0;
+        bool opened = false;
+    };
+
+    struct Hot_Spot
+    {
+        char symbol[160] = {0}; //"[module]" when the address could not be resolved
+        char module[64] = {0};  //file name of the binary
+        uint64_t address = 0;   //of the instruction or of the start of the symbol
+        int64_t offset = -1;    //of the instruction from the start of the symbol. -1 for the whole symbol
+        int64_t samples = 0;
+        double percent = 0.0;
+    };
+
+    //Resolves the samples of the probe and writes at most capacity of the hottest symbols
+    // (or single instructions when per_instruction) sorted by samples. Returns the count written.
+    static int64_t profile_hot_spots(Profile_Probe const& probe, bool per_instruction, Hot_Spot* spots, int64_t capacity) noexcept;
+
+    static void print_hot_spots(FILE* file, Hot_Spot const* spots, int64_t count) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    namespace profile_internal
+    {
+        #ifdef MICROBENCH_LINUX
+        //the signal handler can only reach the probe through globals. Only one SIGPROF probe runs at a time
+        struct Sigprof_State
+        {
+            std::atomic<Profile_Probe*> probe = {nullptr};
+            std::atomic<int64_t> thread = {-1};
+            struct sigaction previous = {};
+        };
+
+        //shared by all translation units (the timer and the handler are process wide).
+        // Always touched by begin() before the handler is installed so its already constructed in the handler
+        inline Sigprof_State& sigprof_state() noexcept
+        {
+            static Sigprof_State state;
+            return state;
+        }
+
+        static uint64_t context_ip(void* context) noexcept
+        {
+            ucontext_t* ucontext = (ucontext_t*) context;
+            #if defined(__x86_64__)
+                return (uint64_t) ucontext->uc_mcontext.gregs[REG_RIP];
+            #elif defined(__i386__)
+                return (uint64_t) ucontext->uc_mcontext.gregs[REG_EIP];
+            #elif defined(__aarch64__)
+                return (uint64_t) ucontext->uc_mcontext.pc;
+            #else
+                (void) ucontext;
+                return 0;
+            #endif
+        }
+
+        static void sigprof_handler(int, siginfo_t*, void* context) noexcept
+        {
+            //the timer is process wide so the signal can land on any busy thread
+            Sigprof_State& state = sigprof_state();
+            Profile_Probe* probe = state.probe.load(std::memory_order_acquire);
+            if(probe != nullptr && current_thread_id() == state.thread.load(std::memory_order_relaxed))
+                probe->push(context_ip(context));
+        }
+
+        static int open_sampling(uint64_t type, uint64_t config, int64_t frequency) noexcept
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof attr);
+            attr.size = sizeof attr;
+            attr.type = (uint32_t) type;
+            attr.config = config;
+            attr.sample_freq = (uint64_t) frequency;
+            attr.freq = 1;
+            attr.sample_type = PERF_SAMPLE_IP;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+
+        static void ring_copy(void* to, char const* data, uint64_t data_size, uint64_t position, size_t size) noexcept
+        {
+            //records can wrap around the end of the ring
+            for(size_t i = 0; i < size; i++)
+                ((char*) to)[i] = data[(position + i) % data_size];
+        }
+
+        struct Symbol
+        {
+            uint64_t address = 0;
+            std::string name;
+        };
+
+        struct Module
+        {
+            std::string path;
+            uint64_t base = 0;  //where the file is mapped from offset 0
+            bool absolute = false; //non PIE executable - symbol addresses are already the runtime ones
+            bool loaded = false;
+            std::vector<Symbol> symbols; //sorted by address
+        };
+
+        struct Mapping
+        {
+            uint64_t from = 0;
+            uint64_t to = 0;
+            int64_t module = -1;
+        };
+
+        static void load_symbols(Module* module, bool dynamic) noexcept
+        {
+            //we only pass the path to the shell in single quotes
+            if(module->path[0] != '/' || module->path.find('\'') != std::string::npos)
+                return;
+
+            std::string command = std::string("nm -n -C --defined-only ") + (dynamic ? "-D '" : "'") + module->path + "' 2>/dev/null";
+            FILE* pipe = popen(command.c_str(), "r");
+            if(pipe == nullptr)
+                return;
+
+            char line[1024];
+            while(fgets(line, sizeof line, pipe))
+            {
+                unsigned long long address = 0;
+                char type = 0;
+                int name_start = 0;
+                if(sscanf(line, "%llx %c %n", &address, &type, &name_start) < 2 || name_start <= 0)
+                    continue;
+
+                //functions only
+                if(type != 't' && type != 'T' && type != 'W' && type != 'w' && type != 'i')
+                    continue;
+
+                Symbol symbol;
+                symbol.address = address;
+                symbol.name = line + name_start;
+                while(symbol.name.empty() == false && (symbol.name.back() == '\n' || symbol.name.back() == '\r'))
+                    symbol.name.pop_back();
+                module->symbols.push_back(symbol);
+            }
+            pclose(pipe);
+
+            std::sort(module->symbols.begin(), module->symbols.end(), [](Symbol const& a, Symbol const& b){ return a.address < b.address; });
+        }
+
+        static bool is_absolute_elf(const char* path) noexcept
+        {
+            unsigned char header[18] = {0};
+            FILE* file = fopen(path, "rb");
+            if(file == nullptr)
+                return false;
+            size_t read = fread(header, 1, sizeof header, file);
+            fclose(file);
+            //ELF e_type ET_EXEC (little endian)
+            return read == sizeof header && memcmp(header, "\x7f" "ELF", 4) == 0 && header[16] == 2 && header[17] == 0;
+        }
+
+        static void read_mappings(std::vector<Module>* modules, std::vector<Mapping>* mappings) noexcept
+        {
+            FILE* maps = fopen("/proc/self/maps", "r");
+            if(maps == nullptr)
+                return;
+
+            char line[1024];
+            while(fgets(line, sizeof line, maps))
+            {
+                unsigned long long from = 0, to = 0, offset = 0;
+                char perms[8] = {0};
+                int path_start = 0;
+                if(sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &from, &to, perms, &offset, &path_start) < 4 || path_start <= 0)
+                    continue;
+
+                std::string path = line + path_start;
+                while(path.empty() == false && (path.back() == '\n' || path.back() == ' '))
+                    path.pop_back();
+                //files and special mappings like [vdso]
+                if(path.empty() || (path[0] != '/' && path[0] != '['))
+                    continue;
+
+                int64_t index = -1;
+                for(size_t i = 0; i < modules->size(); i++)
+                    if((*modules)[i].path == path)
+                        index = (int64_t) i;
+
+                if(index == -1)
+                {
+                    Module module;
+                    module.path = path;
+                    module.base = from - offset;
+                    modules->push_back(module);
+                    index = (int64_t) modules->size() - 1;
+                }
+                if(offset == 0)
+                    (*modules)[(size_t) index].base = from;
+
+                if(perms[2] == 'x')
+                {
+                    Mapping mapping;
+                    mapping.from = from;
+                    mapping.to = to;
+                    mapping.module = index;
+                    mappings->push_back(mapping);
+                }
+            }
+            fclose(maps);
+        }
+
+        struct Resolved
+        {
+            uint64_t ip = 0;
+            int64_t samples = 0;
+            int64_t module = -1;
+            Symbol const* symbol = nullptr;
+            uint64_t symbol_address = 0; //runtime
+        };
+
+        static const char* file_name(std::string const& path) noexcept
+        {
+            size_t slash = path.rfind('/');
+            return slash == std::string::npos ? path.c_str() : path.c_str() + slash + 1;
+        }
+        #endif
+    }
+
+    inline Profile_Probe::~Profile_Probe() noexcept
+    {
+        #ifdef MICROBENCH_LINUX
+            if(ring != nullptr)
+                munmap(ring, ring_size);
+            if(fd >= 0)
+                close(fd);
+        #endif
+    }
+
+    inline void Profile_Probe::push(uint64_t ip) noexcept
+    {
+        if(sample_count < MAX_SAMPLES)
+            samples[sample_count++] = ip;
+        else
+            lost += 1;
+    }
+
+    inline void Profile_Probe::drain() noexcept
+    {
+        #ifdef MICROBENCH_LINUX
+            if(ring == nullptr)
+                return;
+
+            using namespace profile_internal;
+            perf_event_mmap_page* meta = (perf_event_mmap_page*) ring;
+            size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            char const* data = (char const*) ring + page;
+            uint64_t data_size = (uint64_t) (ring_size - page);
+
+            uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+            uint64_t tail = meta->data_tail;
+            while(tail < head)
+            {
+                perf_event_header header;
+                ring_copy(&header, data, data_size, tail, sizeof header);
+                if(header.size == 0)
+                    break;
+
+                if(header.type == PERF_RECORD_SAMPLE)
+                {
+                    uint64_t ip = 0;
+                    ring_copy(&ip, data, data_size, tail + sizeof header, sizeof ip);
+                    push(ip);
+                }
+                else if(header.type == PERF_RECORD_LOST)
+                {
+                    uint64_t id_and_lost[2] = {0};
+                    ring_copy(id_and_lost, data, data_size, tail + sizeof header, sizeof id_and_lost);
+                    lost += (int64_t) id_and_lost[1];
+                }
+                tail += header.size;
+            }
+            __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+        #endif
+    }
+
+    inline void Profile_Probe::begin() noexcept
+    {
+        if(samples == nullptr)
+            samples.reset(new uint64_t[MAX_SAMPLES]);
+        sample_count = 0;
+        lost = 0;
+
+        #ifdef MICROBENCH_LINUX
+            using namespace profile_internal;
+            //has to be opened from the benchmark thread. We open only once
+            if(opened == false)
+            {
+                opened = true;
+                if(force_sigprof == false)
+                {
+                    source = PROFILE_PERF_CYCLES;
+                    fd = open_sampling(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, frequency);
+                    if(fd < 0)
+                    {
+                        source = PROFILE_PERF_CPU_CLOCK;
+                        fd = open_sampling(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK, frequency);
+                    }
+                }
+
+                if(fd >= 0)
+                {
+                    //1 metadata page + 2^n data pages
+                    ring_size = (size_t) sysconf(_SC_PAGESIZE) * (1 + 128);
+                    void* mapped = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                    if(mapped == MAP_FAILED)
+                    {
+                        close(fd);
+                        fd = -1;
+                    }
+                    else
+                        ring = mapped;
+                }
+
+                if(fd < 0)
+                    source = PROFILE_SIGPROF;
+            }
+
+            if(fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                drain();
+                sample_count = 0;
+                lost = 0;
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+            else if(source == PROFILE_SIGPROF)
+            {
+                Sigprof_State& state = sigprof_state();
+                Profile_Probe* expected = nullptr;
+                Profile_Probe* current = state.probe.load();
+                if(current != this && state.probe.compare_exchange_strong(expected, this) == false)
+                {
+                    //someone else is profiling
+                    source = PROFILE_NONE;
+                    return;
+                }
+
+                if(current != this)
+                {
+                    struct sigaction action;
+                    memset(&action, 0, sizeof action);
+                    action.sa_sigaction = sigprof_handler;
+                    action.sa_flags = SA_SIGINFO | SA_RESTART;
+                    sigemptyset(&action.sa_mask);
+                    sigaction(SIGPROF, &action, &state.previous);
+                }
+                state.thread.store(current_thread_id());
+
+                int64_t interval_us = frequency > 0 ? 1000000 / frequency : 1000;
+                struct itimerval timer = {};
+                timer.it_interval.tv_usec = (suseconds_t) (interval_us > 0 ? interval_us : 1);
+                timer.it_value = timer.it_interval;
+                setitimer(ITIMER_PROF, &timer, nullptr);
+            }
+        #endif
+    }
+
+    inline void Profile_Probe::batch(int64_t, bool) noexcept
+    {
+        #ifdef MICROBENCH_LINUX
+            //keep the ring from overflowing on long windows. Cheap when there is nothing to do
+            if(ring != nullptr)
+            {
+                perf_event_mmap_page* meta = (perf_event_mmap_page*) ring;
+                uint64_t pending = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE) - meta->data_tail;
+                if(pending > ring_size / 4)
+                    drain();
+            }
+        #endif
+    }
+
+    inline void Profile_Probe::end() noexcept
+    {
+        #ifdef MICROBENCH_LINUX
+            using namespace profile_internal;
+            if(fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                drain();
+            }
+            else if(source == PROFILE_SIGPROF && sigprof_state().probe.load() == this)
+            {
+                Sigprof_State& state = sigprof_state();
+                struct itimerval timer = {};
+                setitimer(ITIMER_PROF, &timer, nullptr);
+                sigaction(SIGPROF, &state.previous, nullptr);
+                state.probe.store(nullptr);
+            }
+        #endif
+    }
+
+    inline void Profile_Probe::report(Bench_Result* result) noexcept
+    {
+        if(source == PROFILE_NONE || result->counter_count >= MAX_BENCH_COUNTERS)
+            return;
+
+        Counter_Stats stats;
+        snprintf(stats.name, sizeof stats.name, "%s", "profile-samples");
+        stats.total = (double) sample_count;
+        if(result->iters > 0)
+            stats.mean = stats.total / (double) result->iters;
+        result->counters[result->counter_count++] = stats;
+    }
+
+    static int64_t profile_hot_spots(Profile_Probe const& probe, bool per_instruction, Hot_Spot* spots, int64_t capacity) noexcept
+    {
+        #ifdef MICROBENCH_LINUX
+            using namespace profile_internal;
+            if(probe.sample_count <= 0 || capacity <= 0)
+                return 0;
+
+            std::vector<uint64_t> ips(probe.samples.get(), probe.samples.get() + probe.sample_count);
+            std::sort(ips.begin(), ips.end());
+
+            std::vector<Module> modules;
+            std::vector<Mapping> mappings;
+            read_mappings(&modules, &mappings);
+
+            //resolve every distinct address once
+            std::vector<Resolved> resolved;
+            for(size_t i = 0; i < ips.size(); )
+            {
+                Resolved entry;
+                entry.ip = ips[i];
+                for(; i < ips.size() && ips[i] == entry.ip; i++)
+                    entry.samples += 1;
+
+                for(Mapping const& mapping : mappings)
+                    if(mapping.from <= entry.ip && entry.ip < mapping.to)
+                        entry.module = mapping.module;
+
+                if(entry.module >= 0)
+                {
+                    Module* module = &modules[(size_t) entry.module];
+                    if(module->loaded == false)
+                    {
+                        module->loaded = true;
+                        module->absolute = is_absolute_elf(module->path.c_str());
+                        load_symbols(module, false);
+                        //stripped libraries still have the dynamic symbols
+                        if(module->symbols.empty())
+                            load_symbols(module, true);
+                    }
+
+                    uint64_t base = module->absolute ? 0 : module->base;
+                    uint64_t address = entry.ip - base;
+                    auto after = std::upper_bound(module->symbols.begin(), module->symbols.end(), address,
+                        [](uint64_t value, Symbol const& symbol){ return value < symbol.address; });
+                    if(after != module->symbols.begin())
+                    {
+                        entry.symbol = &*(after - 1);
+                        entry.symbol_address = entry.symbol->address + base;
+                    }
+                }
+                resolved.push_back(entry);
+            }
+
+            //merge to symbols - unresolved addresses are grouped by module
+            if(per_instruction == false)
+            {
+                for(Resolved& entry : resolved)
+                    if(entry.symbol == nullptr)
+                        entry.symbol_address = 0;
+
+                std::sort(resolved.begin(), resolved.end(), [](Resolved const& a, Resolved const& b){
+                    return a.module != b.module ? a.module < b.module : a.symbol_address < b.symbol_address;
+                });
+
+                std::vector<Resolved> merged;
+                for(Resolved const& entry : resolved)
+                {
+                    if(merged.empty() == false && merged.back().module == entry.module && merged.back().symbol_address == entry.symbol_address)
+                        merged.back().samples += entry.samples;
+                    else
+                        merged.push_back(entry);
+                }
+                resolved.swap(merged);
+            }
+
+            std::sort(resolved.begin(), resolved.end(), [](Resolved const& a, Resolved const& b){ return a.samples > b.samples; });
+
+            int64_t count = 0;
+            for(; count < capacity && count < (int64_t) resolved.size(); count++)
+            {
+                Resolved const& entry = resolved[(size_t) count];
+                Hot_Spot* spot = &spots[count];
+                *spot = Hot_Spot();
+                spot->samples = entry.samples;
+                spot->percent = 100.0 * (double) entry.samples / (double) probe.sample_count;
+
+                const char* module_name = entry.module >= 0 ? file_name(modules[(size_t) entry.module].path) : "unknown";
+                snprintf(spot->module, sizeof spot->module, "%s", module_name);
+                if(entry.symbol != nullptr)
+                    snprintf(spot->symbol, sizeof spot->symbol, "%s", entry.symbol->name.c_str());
+                else
+                    snprintf(spot->symbol, sizeof spot->symbol, module_name[0] == '[' ? "%s" : "[%s]", module_name);
+
+                if(per_instruction)
+                {
+                    spot->address = entry.ip;
+                    spot->offset = entry.symbol != nullptr ? (int64_t) (entry.ip - entry.symbol_address) : -1;
+                }
+                else
+                    spot->address = entry.symbol != nullptr ? entry.symbol_address : 0;
+            }
+
+            return count;
+        #else
+            (void) probe; (void) per_instruction; (void) spots; (void) capacity;
+            return 0;
+        #endif
+    }
+
+    static void print_hot_spots(FILE* file, Hot_Spot const* spots, int64_t count) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Hot_Spot const& spot = spots[i];
+            if(spot.offset >= 0)
+                fprintf(file, "%6.2f%% %8lld  %s+0x%llx (%s)\n", spot.percent, (long long) spot.samples, spot.symbol, (unsigned long long) spot.offset, spot.module);
+            else
+                fprintf(file, "%6.2f%% %8lld  %s (%s)\n", spot.percent, (long long) spot.samples, spot.symbol, spot.module);
+        }
+    }
+}
@@ -0,0 +1,279 @@
+#pragma once
+#include "microbench_sync.h"
+#include "microbench_latency.h"
+
+//Producer/consumer harness for concurrent queues (SPSC, MPSC, MPMC...). Producers push messages carrying
+// their timestamps, consumers pop them and record the time each message spent in the queue into histograms.
+// Either saturated (producers push as fast as they can - throughput) or at a fixed rate (latency without
+// coordinated omission - messages are stamped with the time they were supposed to be sent).
+namespace microbench
+{
+    struct Queue_Message
+    {
+        int64_t intended_ns = 0; //when the message should have been sent according to the schedule
+        int64_t sent_ns = 0;     //when the push that succeeded was started
+        int64_t producer = 0;
+        int64_t sequence = 0;    //per producer
+    };
+
+    //The queue has to have:
+    //  bool try_push(Queue_Message const& message) - returns false when full
+    //  bool try_pop(Queue_Message& message)        - returns false when empty
+    //Wrap your queue in a small struct when its interface differs.
+    struct Queue_Options
+    {
+        int64_t producers = 1;
+        int64_t consumers = 1;
+        int32_t const* producer_cpus = nullptr; //pin producer i to producer_cpus[i] when not null
+        int32_t const* consumer_cpus = nullptr; //pin consumer i to consumer_cpus[i] when not null
+
+        //Total rate of all producers together. 0 means saturated - every producer pushes as fast as it can.
+        // Use a rate for latency. Saturated latency mostly measures how full the queue gets.
+        double messages_per_second = 0.0;
+
+        int64_t max_time_ms = 500;
+        int64_t warm_up_ms = 50;
+    };
+
+    struct Queue_Result
+    {
+        //Of messages sent after warm up. Latency is from intended_ns so it includes the time the producer
+        // was stuck behind a full queue (no coordinated omission), service is from sent_ns (only the time in the queue).
+        Latency_Result latency;
+        Latency_Result service;
+        double messages_per_second = 0.0; //popped by all consumers together after warm up
+        int64_t pushed = 0;      //all messages including warm up
+        int64_t popped = 0;
+        int64_t full_retries = 0; //try_push calls which failed
+        //Timestamps are taken on different cores. clock_ns() is backed by the kernel clock which is synchronized
+        // between cores so these should stay 0. If not the latencies below a few hundred ns are not to be trusted.
+        int64_t negative_latencies = 0;
+        bool saturated = false; //couldnt keep up with messages_per_second
+        bool ok = false;        //every pushed message was popped exactly once
+    };
+
+    //Runs the producers and consumers on their own threads against queue. The queue has to be empty and
+    // has to be able to take options.producers producers and options.consumers consumers at once.
+    template <typename Queue>
+    static Queue_Result benchmark_queue(Queue& queue, Queue_Options const& options) noexcept;
+
+    //Runs benchmark_queue for each pair of producer and consumer counts
+    template <typename Queue>
+    static void benchmark_queue_scaling(Queue& queue, Queue_Options const& options, int64_t const* producers, int64_t const* consumers, int64_t count, Queue_Result* results) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    namespace queue_internal
+    {
+        struct Consumer_State
+        {
+            Latency_Histogram latency;
+            Latency_Histogram service;
+            int64_t popped = 0;
+            int64_t popped_in_window = 0;
+            int64_t negative = 0;
+            int64_t sequence_sum = 0;
+        };
+
+        struct Producer_State
+        {
+            int64_t pushed = 0;
+            int64_t full_retries = 0;
+            int64_t sequence_sum = 0;
+            int64_t max_lag = 0;
+        };
+    }
+
+    template <typename Queue>
+    static Queue_Result benchmark_queue(Queue& queue, Queue_Options const& options) noexcept
+    {
+        using namespace microbench::time_consts;
+        using namespace queue_internal;
+
+        Queue_Result result;
+        int64_t producer_count = options.producers > 0 ? options.producers : 1;
+        int64_t consumer_count = options.consumers > 0 ? options.consumers : 1;
+        assert(producer_count + consumer_count <= MAX_BENCH_THREADS);
+
+        const int64_t max_time_ns = options.max_time_ms * MILISECOND_NANOSECONDS;
+        int64_t warm_up_ns = options.warm_up_ms * MILISECOND_NANOSECONDS;
+        if(warm_up_ns > max_time_ns || warm_up_ns < 0)
+            warm_up_ns = 0;
+
+        double interval_ns = 0;
+        if(options.messages_per_second > 0)
+            interval_ns = (double) SECOND_NANOSECONDS * (double) producer_count / options.messages_per_second;
+
+        std::unique_ptr<Producer_State[]> producers(new Producer_State[(size_t) producer_count]);
+        std::unique_ptr<Consumer_State[]> consumers(new Consumer_State[(size_t) consumer_count]);
+        std::atomic<int64_t> producers_done = {0};
+        //we take part in the barrier too and set the start once everyone is up
+        Spin_Barrier barrier(producer_count + consumer_count + 1);
+        std::atomic<int64_t> start = {0};
+        auto wait_for_start = [&]{
+            barrier.wait();
+            int64_t spins = 0;
+            while(start.load(std::memory_order_acquire) == 0)
+                sync_internal::cpu_relax(&spins);
+            return start.load(std::memory_order_relaxed);
+        };
+
+        auto producer = [&](int64_t p){
+            if(options.producer_cpus)
+                pin_thread_to_cpu(options.producer_cpus[p]);
+
+            Producer_State* state = &producers[(size_t) p];
+            int64_t from = wait_for_start();
+            int64_t deadline = from + max_time_ns;
+            //stagger the producers so that they dont all send at once
+            double intended_offset = interval_ns * (double) p / (double) producer_count;
+
+            Queue_Message message;
+            message.producer = p;
+            for(int64_t sequence = 0; ; sequence++)
+            {
+                int64_t now = clock_ns();
+                if(interval_ns > 0)
+                {
+                    int64_t intended = from + (int64_t) intended_offset;
+                    if(intended >= deadline)
+                        break;
+
+                    while(now < intended)
+                        now = clock_ns();
+
+                    if(state->max_lag < now - intended)
+                        state->max_lag = now - intended;
+                    message.intended_ns = intended;
+                    intended_offset += interval_ns;
+                }
+                else
+                {
+                    if(now >= deadline)
+                        break;
+                    message.intended_ns = now;
+                }
+
+                message.sequence = sequence;
+                message.sent_ns = now;
+                int64_t spins = 0;
+                while(queue.try_push(message) == false)
+                {
+                    state->full_retries += 1;
+                    sync_internal::cpu_relax(&spins);
+                    message.sent_ns = clock_ns();
+                }
+
+                state->pushed += 1;
+                state->sequence_sum += sequence;
+            }
+
+            producers_done.fetch_add(1, std::memory_order_release);
+        };
+
+        auto consumer = [&](int64_t c){
+            if(options.consumer_cpus)
+                pin_thread_to_cpu(options.consumer_cpus[c]);
+
+            Consumer_State* state = &consumers[(size_t) c];
+            int64_t from = wait_for_start();
+            int64_t measured_from = from + warm_up_ns;
+            int64_t deadline = from + max_time_ns;
+
+            Queue_Message message;
+            int64_t spins = 0;
+            while(true)
+            {
+                //read before the pop so that a failed pop after all producers finished means empty for good
+                bool finished = producers_done.load(std::memory_order_acquire) == producer_count;
+                if(queue.try_pop(message) == false)
+                {
+                    if(finished)
+                        break;
+                    sync_internal::cpu_relax(&spins);
+                    continue;
+                }
+
+                int64_t now = clock_ns();
+                state->popped += 1;
+                state->sequence_sum += message.sequence;
+                if(measured_from <= now && now < deadline)
+                    state->popped_in_window += 1;
+
+                if(message.intended_ns >= measured_from)
+                {
+                    int64_t latency = now - message.intended_ns;
+                    int64_t service = now - message.sent_ns;
+                    if(latency < 0 || service < 0)
+                        state->negative += 1;
+                    state->latency.record(latency > 0 ? latency : 0);
+                    state->service.record(service > 0 ? service : 0);
+                }
+            }
+        };
+
+        std::thread threads[MAX_BENCH_THREADS];
+        for(int64_t p = 0; p < producer_count; p++)
+            threads[p] = std::thread(producer, p);
+        for(int64_t c = 0; c < consumer_count; c++)
+            threads[producer_count + c] = std::thread(consumer, c);
+
+        //the extra ms gives everyone time to get from the barrier to the start spin
+        barrier.wait();
+        start.store(clock_ns() + MILISECOND_NANOSECONDS, std::memory_order_release);
+
+        for(int64_t t = 0; t < producer_count + consumer_count; t++)
+            threads[t].join();
+
+        int64_t pushed_sum = 0;
+        int64_t popped_sum = 0;
+        int64_t max_lag = 0;
+        for(int64_t p = 0; p < producer_count; p++)
+        {
+            result.pushed += producers[(size_t) p].pushed;
+            result.full_retries += producers[(size_t) p].full_retries;
+            pushed_sum += producers[(size_t) p].sequence_sum;
+            if(max_lag < producers[(size_t) p].max_lag)
+                max_lag = producers[(size_t) p].max_lag;
+        }
+
+        int64_t popped_in_window = 0;
+        for(int64_t c = 1; c < consumer_count; c++)
+        {
+            consumers[0].latency.merge(consumers[(size_t) c].latency);
+            consumers[0].service.merge(consumers[(size_t) c].service);
+        }
+        for(int64_t c = 0; c < consumer_count; c++)
+        {
+            result.popped += consumers[(size_t) c].popped;
+            result.negative_latencies += consumers[(size_t) c].negative;
+            popped_in_window += consumers[(size_t) c].popped_in_window;
+            popped_sum += consumers[(size_t) c].sequence_sum;
+        }
+
+        result.latency = latency_result(consumers[0].latency);
+        result.service = latency_result(consumers[0].service);
+        int64_t window = max_time_ns - warm_up_ns;
+        if(window > 0)
+            result.messages_per_second = (double) popped_in_window * (double) SECOND_NANOSECONDS / (double) window;
+
+        //lagging behind by more than ten intervals means the schedule was not kept
+        result.saturated = interval_ns > 0 && (double) max_lag > interval_ns * 10;
+        result.ok = result.pushed == result.popped && pushed_sum == popped_sum;
+        return result;
+    }
+
+    template <typename Queue>
+    static void benchmark_queue_scaling(Queue& queue, Queue_Options const& options, int64_t const* producers, int64_t const* consumers, int64_t count, Queue_Result* results) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+        {
+            Queue_Options scaled = options;
+            scaled.producers = producers[i];
+            scaled.consumers = consumers[i];
+            results[i] = benchmark_queue(queue, scaled);
+        }
+    }
+}
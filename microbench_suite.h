@@ -0,0 +1,646 @@
+#pragma once
+#include "microbench_os.h"
+#include <memory>
+
+#ifdef MICROBENCH_LINUX
+    #include <poll.h>
+    #include <signal.h>
+    #include <errno.h>
+    #include <sys/wait.h>
+#endif
+
+//Registry of benchmarks and runners executing them.
+//
+//Benchmarks ran in the same process influence each other through heap fragmentation, warmed up
+// caches, page table state, leftover threads... Running each of them in a freshly forked child
+// (ISOLATION_FORK) makes the results independent of the order and of each other.
+namespace microbench
+{
+    //Records the raw time of every accepted batch during the measured window into
+    // a caller provided buffer. Pass to benchmark as a probe.
+    struct Bench_Samples
+    {
+        int64_t* times_ns = nullptr;
+        int64_t capacity = 0;
+        int64_t count = 0;   //number of samples in times_ns
+        int64_t dropped = 0; //samples that didnt fit
+        int64_t batch_size = 0; //runs per sample (including runs_mult) - filled in report
+
+        void begin() noexcept { count = 0; dropped = 0; }
+        FORCE_INLINE void batch(int64_t batch_time_ns, bool accepted) noexcept
+        {
+            if(accepted == false)
+                return;
+
+            if(count < capacity)
+                times_ns[count++] = batch_time_ns;
+            else
+                dropped++;
+        }
+        void end() noexcept {}
+        void report(Bench_Result* result) noexcept { batch_size = result->batch_size; }
+    };
+
+    //A registered benchmark. The function should run the benchmark and return its result.
+    // If it wants to provide raw samples it should pass samples as a probe to benchmark().
+    typedef Bench_Result (*Bench_Fn)(Bench_Samples* samples);
+
+    enum Bench_Flags
+    {
+        //the benchmark is sensitive to or itself pollutes the shared last level cache and memory bandwidth.
+        // The parallel runner never runs anything else on the same llc at the same time.
+        BENCH_FLAG_MEMORY_HEAVY = 1,
+    };
+
+    struct Bench_Entry
+    {
+        const char* name = nullptr;
+        Bench_Fn fn = nullptr;
+        uint32_t flags = 0; //Bench_Flags
+    };
+
+    static constexpr int64_t MAX_REGISTERED_BENCHMARKS = 4096;
+
+    struct Bench_Registry
+    {
+        Bench_Entry entries[MAX_REGISTERED_BENCHMARKS];
+        int64_t count = 0;
+    };
+
+    //The global registry shared by all translation units
+    inline Bench_Registry& bench_registry() noexcept
+    {
+        static Bench_Registry registry;
+        return registry;
+    }
+
+    //Adds the benchmark to the global registry. Returns false if its full.
+    static bool register_benchmark(const char* name, Bench_Fn fn, uint32_t flags = 0) noexcept;
+
+    //Defines and registers a benchmark function:
+    //  MICROBENCH_REGISTER(vector_push_back) { return benchmark(1000, 50, ...); }
+    //The function receives Bench_Samples* samples
+    #if defined(__GNUC__) || defined(__clang__)
+        #define MICROBENCH_MAYBE_UNUSED __attribute__((unused))
+    #else
+        #define MICROBENCH_MAYBE_UNUSED
+    #endif
+
+    #define MICROBENCH_REGISTER_FLAGS(name, flags) \
+        static microbench::Bench_Result microbench_fn_##name(microbench::Bench_Samples* samples); \
+        MICROBENCH_MAYBE_UNUSED static const bool microbench_registered_##name = microbench::register_benchmark(#name, microbench_fn_##name, flags); \
+        static microbench::Bench_Result microbench_fn_##name(MICROBENCH_MAYBE_UNUSED microbench::Bench_Samples* samples)
+
+    #define MICROBENCH_REGISTER(name) MICROBENCH_REGISTER_FLAGS(name, 0)
+
+    enum Isolation
+    {
+        ISOLATION_NONE, //run in this process
+        ISOLATION_FORK, //run each benchmark in a freshly forked child and pipe the result back
+    };
+
+    enum Run_Status
+    {
+        RUN_OK = 0,
+        RUN_TIMEOUT,  //child didnt finish in time and was killed
+        RUN_CRASHED,  //child died by a signal or exited without sending the result
+        RUN_FAILED,   //couldnt start the child (fork or pipe failed)
+    };
+
+    struct Run_Result
+    {
+        const char* name = nullptr;
+        Bench_Result result; //aggregated over all repetitions
+        int32_t status = RUN_OK;
+        int32_t signal = 0; //the signal which killed the child if RUN_CRASHED
+        int64_t repetitions = 0; //successful repetitions aggregated into result
+        int64_t sample_count = 0; //raw samples written into Run_Options::samples_ns (only from the last repetition)
+
+        int32_t cpu = -1; //the cpu the benchmark was pinned to when running in parallel
+        bool pin_failed = false; //pinning to cpu failed in some repetition so it ran wherever the scheduler put it
+        //the most other benchmarks that were running on the same last level cache at the same time
+        // as any repetition of this one. 0 means the results are as good as when running alone.
+        int32_t co_runners = 0;
+    };
+
+    struct Run_Options
+    {
+        Isolation isolation = ISOLATION_FORK;
+        int64_t timeout_ms = 60'000; //per single repetition. Only enforced with ISOLATION_FORK
+        int64_t repetitions = 1; //how many times to run each benchmark (each in a new child)
+
+        //optional buffer for raw batch times. Unused when null. Not supported when parallel
+        int64_t* samples_ns = nullptr;
+        int64_t samples_capacity = 0;
+
+        //How many benchmarks to run at once with ISOLATION_FORK. Each runs in its own child pinned to its own 
+        // physical core (never on SMT siblings). If the system has isolated cpus (isolcpus) only those are used.
+        // 0 means one per available physical core.
+        int64_t parallel = 1;
+    };
+
+    //Picks the cpus to run benchmarks on in parallel - one per physical core, isolated ones if there are any.
+    // Returns the number of cpus written.
+    static int64_t select_benchmark_cpus(Cpu_Topology const& topology, int32_t* cpus, int64_t capacity) noexcept;
+
+    //Runs a single benchmark according to options
+    static Run_Result run_benchmark(Bench_Entry const& entry, Run_Options const& options) noexcept;
+
+    //Runs all registered benchmarks whose name contains filter (or all when null) but at most capacity 
+    // of them and writes their results into results. Returns the number of benchmarks run.
+    static int64_t run_registered(Run_Result* results, int64_t capacity, Run_Options const& options, const char* filter = nullptr) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    static bool register_benchmark(const char* name, Bench_Fn fn, uint32_t flags) noexcept
+    {
+        Bench_Registry& registry = bench_registry();
+        if(registry.count >= MAX_REGISTERED_BENCHMARKS)
+            return false;
+
+        Bench_Entry entry;
+        entry.name = name;
+        entry.fn = fn;
+        entry.flags = flags;
+        registry.entries[registry.count++] = entry;
+        return true;
+    }
+
+    static int64_t select_benchmark_cpus(Cpu_Topology const& topology, int32_t* cpus, int64_t capacity) noexcept
+    {
+        bool any_isolated = false;
+        for(int64_t i = 0; i < topology.count; i++)
+            any_isolated |= topology.cpus[i].isolated;
+
+        int64_t count = 0;
+        for(int64_t i = 0; i < topology.count && count < capacity; i++)
+        {
+            Cpu_Info const& info = topology.cpus[i];
+            if(any_isolated && info.isolated == false)
+                continue;
+
+            //one per physical core. If the primary thread of the core isnt isolated
+            // we take the first one that is
+            bool taken = false;
+            for(int64_t j = 0; j < i; j++)
+            {
+                Cpu_Info const& other = topology.cpus[j];
+                if(other.core == info.core && other.package == info.package && (any_isolated == false || other.isolated))
+                    taken = true;
+            }
+
+            if(taken == false)
+                cpus[count++] = info.cpu;
+        }
+
+        return count;
+    }
+
+    namespace suite_internal
+    {
+        struct Child_Header
+        {
+            Bench_Result result;
+            int64_t sample_count;
+            bool pin_failed;
+        };
+
+        static Run_Result run_in_process(Bench_Entry const& entry, Bench_Samples* samples) noexcept
+        {
+            Run_Result run;
+            run.name = entry.name;
+            run.result = entry.fn(samples);
+            run.sample_count = samples->count;
+            run.repetitions = 1;
+            return run;
+        }
+
+        #ifdef MICROBENCH_LINUX
+            static bool write_all(int fd, void const* data, int64_t size) noexcept
+            {
+                char const* at = (char const*) data;
+                while(size > 0)
+                {
+                    ssize_t written = write(fd, at, (size_t) size);
+                    if(written < 0 && errno == EINTR)
+                        continue;
+                    if(written <= 0)
+                        return false;
+
+                    at += written;
+                    size -= written;
+                }
+                return true;
+            }
+
+            //Reads exactly size bytes unless the deadline passes or the other side closes.
+            // Returns the number of bytes read or -1 on timeout
+            static int64_t read_all_until(int fd, void* data, int64_t size, int64_t deadline_ns) noexcept
+            {
+                char* at = (char*) data;
+                int64_t total = 0;
+                while(total < size)
+                {
+                    int64_t remaining_ms = (deadline_ns - clock_ns()) / time_consts::MILISECOND_NANOSECONDS;
+                    if(remaining_ms <= 0)
+                        return -1;
+
+                    struct pollfd poll_fd = {};
+                    poll_fd.fd = fd;
+                    poll_fd.events = POLLIN;
+                    int ready = poll(&poll_fd, 1, remaining_ms > 1'000'000 ? 1'000'000 : (int) remaining_ms);
+                    if(ready < 0 && errno == EINTR)
+                        continue;
+                    if(ready == 0)
+                        continue;
+                    if(ready < 0)
+                        return total;
+
+                    ssize_t got = read(fd, at + total, (size_t) (size - total));
+                    if(got < 0 && errno == EINTR)
+                        continue;
+                    if(got <= 0)
+                        return total;
+
+                    total += got;
+                }
+                return total;
+            }
+
+            struct Child
+            {
+                pid_t pid = -1;
+                int fd = -1;
+                int64_t deadline = 0;
+            };
+
+            //Forks a child running the benchmark optionally pinned to the given cpu
+            static bool start_child(Bench_Entry const& entry, Bench_Samples* samples, int32_t cpu, int64_t timeout_ms, Child* child) noexcept
+            {
+                int fds[2];
+                if(pipe(fds) != 0)
+                    return false;
+
+                //so that buffered output isnt printed twice
+                fflush(stdout);
+                fflush(stderr);
+
+                pid_t pid = fork();
+                if(pid < 0)
+                {
+                    close(fds[0]);
+                    close(fds[1]);
+                    return false;
+                }
+
+                if(pid == 0)
+                {
+                    close(fds[0]);
+                    Child_Header header = {};
+                    if(cpu >= 0)
+                        header.pin_failed = pin_thread_to_cpu(cpu) == false;
+
+                    header.result = entry.fn(samples);
+                    header.sample_count = samples->count;
+
+                    bool ok = write_all(fds[1], &header, sizeof header)
+                        && write_all(fds[1], samples->times_ns, header.sample_count * (int64_t) sizeof(int64_t));
+                    close(fds[1]);
+                    //skip atexit handlers and static destructors of the parent
+                    _exit(ok ? 0 : 1);
+                }
+
+                close(fds[1]);
+                child->pid = pid;
+                child->fd = fds[0];
+                child->deadline = clock_ns() + timeout_ms * time_consts::MILISECOND_NANOSECONDS;
+                return true;
+            }
+
+            //Kills and reaps the child without reading its result
+            static void abandon_child(Child* child) noexcept
+            {
+                close(child->fd);
+                kill(child->pid, SIGKILL);
+                int status = 0;
+                while(waitpid(child->pid, &status, 0) < 0 && errno == EINTR) {}
+                *child = Child();
+            }
+
+            //Reads the result of the child (waiting until its deadline) and reaps it
+            static Run_Result finish_child(Bench_Entry const& entry, Bench_Samples* samples, Child* child) noexcept
+            {
+                Run_Result run;
+                run.name = entry.name;
+
+                Child_Header header = {};
+                int64_t got = read_all_until(child->fd, &header, sizeof header, child->deadline);
+                if(got == (int64_t) sizeof header)
+                {
+                    if(header.sample_count > samples->capacity)
+                        header.sample_count = samples->capacity;
+                    int64_t sample_bytes = header.sample_count * (int64_t) sizeof(int64_t);
+                    int64_t got_samples = read_all_until(child->fd, samples->times_ns, sample_bytes, child->deadline);
+                    if(got_samples < 0)
+                        got = -1;
+                    else
+                        header.sample_count = got_samples / (int64_t) sizeof(int64_t);
+                }
+                close(child->fd);
+
+                if(got < 0)
+                    kill(child->pid, SIGKILL);
+
+                int status = 0;
+                while(waitpid(child->pid, &status, 0) < 0 && errno == EINTR) {}
+                *child = Child();
+
+                if(got < 0)
+                    run.status = RUN_TIMEOUT;
+                else if(WIFSIGNALED(status))
+                {
+                    run.status = RUN_CRASHED;
+                    run.signal = WTERMSIG(status);
+                }
+                else if(got != (int64_t) sizeof header)
+                    run.status = RUN_CRASHED;
+                else
+                {
+                    run.status = RUN_OK;
+                    run.result = header.result;
+                    run.sample_count = header.sample_count;
+                    run.repetitions = 1;
+                    run.pin_failed = header.pin_failed;
+                }
+
+                return run;
+            }
+
+            static Run_Result run_forked(Bench_Entry const& entry, Bench_Samples* samples, int64_t timeout_ms) noexcept
+            {
+                Child child;
+                if(start_child(entry, samples, -1, timeout_ms, &child) == false)
+                {
+                    Run_Result run;
+                    run.name = entry.name;
+                    run.status = RUN_FAILED;
+                    return run;
+                }
+
+                return finish_child(entry, samples, &child);
+            }
+
+            struct Slot
+            {
+                Child child;
+                int32_t cpu = -1;
+                int32_t llc = -1;
+                int64_t job = -1; //index into the entry list or -1 when free
+                bool memory_heavy = false;
+            };
+
+            //Runs the given registry entries concurrently each in its own pinned child.
+            // Each entry is repeated options.repetitions times. Results are accumulated into results[i] for entries[i].
+            static void run_parallel(Bench_Entry const* const* entries, Run_Result* results, int64_t count, Run_Options const& options, int32_t const* cpus, int64_t cpu_count, Cpu_Topology const& topology) noexcept
+            {
+                const int64_t MAX_SLOTS = 256;
+                Slot slots[MAX_SLOTS];
+                int64_t slot_count = cpu_count < MAX_SLOTS ? cpu_count : MAX_SLOTS;
+                for(int64_t i = 0; i < slot_count; i++)
+                {
+                    slots[i].cpu = cpus[i];
+                    for(int64_t j = 0; j < topology.count; j++)
+                        if(topology.cpus[j].cpu == cpus[i])
+                            slots[i].llc = topology.cpus[j].llc;
+                }
+
+                //No samples in parallel mode - there is no sensible place to put them
+                Bench_Samples no_samples;
+                int64_t repetitions = options.repetitions > 0 ? options.repetitions : 1;
+                int64_t total_jobs = count * repetitions;
+                int64_t jobs_done = 0;
+
+                //jobs are entry index = job % count so that repetitions of the same
+                // benchmark are spread over time and cpus
+                int64_t next_job = 0;
+                std::unique_ptr<Result_Accumulator[]> accumulators(new Result_Accumulator[(size_t) count]);
+                for(int64_t i = 0; i < count; i++)
+                {
+                    accumulators[i] = Result_Accumulator();
+                    results[i] = Run_Result();
+                    results[i].name = entries[i]->name;
+                }
+
+                auto llc_state = [&](int32_t llc, int64_t* running, bool* heavy_running){
+                    *running = 0;
+                    *heavy_running = false;
+                    for(int64_t i = 0; i < slot_count; i++)
+                        if(slots[i].job >= 0 && slots[i].llc == llc)
+                        {
+                            *running += 1;
+                            *heavy_running |= slots[i].memory_heavy;
+                        }
+                };
+
+                bool any_running = true;
+                while(jobs_done < total_jobs && (next_job < total_jobs || any_running))
+                {
+                    //start jobs on free slots. Jobs are taken in order but a memory heavy job
+                    // waits (blocking the rest) until its llc is free
+                    for(int64_t i = 0; i < slot_count && next_job < total_jobs; i++)
+                    {
+                        Slot* slot = &slots[i];
+                        if(slot->job >= 0)
+                            continue;
+
+                        int64_t entry_index = next_job % count;
+                        Bench_Entry const& entry = *entries[entry_index];
+                        bool heavy = (entry.flags & BENCH_FLAG_MEMORY_HEAVY) != 0;
+
+                        int64_t running = 0;
+                        bool heavy_running = false;
+                        llc_state(slot->llc, &running, &heavy_running);
+                        if(heavy_running || (heavy && running > 0))
+                            continue;
+
+                        next_job += 1;
+                        if(results[entry_index].status != RUN_OK || start_child(entry, &no_samples, slot->cpu, options.timeout_ms, &slot->child) == false)
+                        {
+                            if(results[entry_index].status == RUN_OK)
+                                results[entry_index].status = RUN_FAILED;
+                            jobs_done += 1;
+                            continue;
+                        }
+
+                        slot->job = entry_index;
+                        slot->memory_heavy = heavy;
+                        results[entry_index].cpu = slot->cpu;
+
+                        //tag everyone sharing the llc with the new co runner count
+                        llc_state(slot->llc, &running, &heavy_running);
+                        for(int64_t j = 0; j < slot_count; j++)
+                            if(slots[j].job >= 0 && slots[j].llc == slot->llc && results[slots[j].job].co_runners < running - 1)
+                                results[slots[j].job].co_runners = (int32_t) (running - 1);
+                    }
+
+                    //wait for any child to finish or the nearest deadline
+                    struct pollfd poll_fds[MAX_SLOTS];
+                    int64_t poll_slots[MAX_SLOTS];
+                    int64_t poll_count = 0;
+                    int64_t nearest_deadline = clock_ns() + 100 * time_consts::MILISECOND_NANOSECONDS;
+                    for(int64_t i = 0; i < slot_count; i++)
+                    {
+                        if(slots[i].job < 0)
+                            continue;
+
+                        poll_fds[poll_count] = pollfd();
+                        poll_fds[poll_count].fd = slots[i].child.fd;
+                        poll_fds[poll_count].events = POLLIN;
+                        poll_slots[poll_count] = i;
+                        poll_count += 1;
+                        if(nearest_deadline > slots[i].child.deadline)
+                            nearest_deadline = slots[i].child.deadline;
+                    }
+
+                    any_running = poll_count > 0;
+                    if(any_running == false)
+                        continue;
+
+                    int64_t wait_ms = (nearest_deadline - clock_ns()) / time_consts::MILISECOND_NANOSECONDS;
+                    if(wait_ms < 0)
+                        wait_ms = 0;
+                    int ready = poll(poll_fds, (nfds_t) poll_count, (int) wait_ms);
+                    if(ready < 0 && errno != EINTR)
+                    {
+                        //cant wait on the children anymore - dont leave them running
+                        for(int64_t i = 0; i < slot_count; i++)
+                        {
+                            Slot* slot = &slots[i];
+                            if(slot->job < 0)
+                                continue;
+
+                            abandon_child(&slot->child);
+                            if(results[slot->job].status == RUN_OK)
+                                results[slot->job].status = RUN_FAILED;
+
+                            slot->job = -1;
+                            slot->memory_heavy = false;
+                            jobs_done += 1;
+                        }
+                        break;
+                    }
+
+                    int64_t now = clock_ns();
+                    for(int64_t i = 0; i < poll_count; i++)
+                    {
+                        Slot* slot = &slots[poll_slots[i]];
+                        bool finished = ready > 0 && (poll_fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+                        if(finished == false && now < slot->child.deadline)
+                            continue;
+
+                        int64_t entry_index = slot->job;
+                        Run_Result run = finish_child(*entries[entry_index], &no_samples, &slot->child);
+                        Run_Result* result = &results[entry_index];
+                        if(run.status != RUN_OK && result->status == RUN_OK)
+                        {
+                            result->status = run.status;
+                            result->signal = run.signal;
+                        }
+                        else if(run.status == RUN_OK)
+                        {
+                            accumulators[entry_index].add(run.result);
+                            result->repetitions += 1;
+                            result->pin_failed |= run.pin_failed;
+                        }
+
+                        slot->job = -1;
+                        slot->memory_heavy = false;
+                        jobs_done += 1;
+                    }
+                }
+
+                for(int64_t i = 0; i < count; i++)
+                    results[i].result = accumulators[i].result();
+            }
+        #else
+            static Run_Result run_forked(Bench_Entry const& entry, Bench_Samples* samples, int64_t) noexcept
+            {
+                return run_in_process(entry, samples);
+            }
+        #endif
+    }
+
+    static Run_Result run_benchmark(Bench_Entry const& entry, Run_Options const& options) noexcept
+    {
+        using namespace suite_internal;
+        Bench_Samples samples;
+        samples.times_ns = options.samples_ns;
+        samples.capacity = options.samples_ns != nullptr ? options.samples_capacity : 0;
+
+        Run_Result out;
+        out.name = entry.name;
+
+        Result_Accumulator accumulator;
+        int64_t repetitions = options.repetitions > 0 ? options.repetitions : 1;
+        for(int64_t i = 0; i < repetitions; i++)
+        {
+            Run_Result run = options.isolation == ISOLATION_FORK
+                ? run_forked(entry, &samples, options.timeout_ms)
+                : run_in_process(entry, &samples);
+
+            if(run.status != RUN_OK)
+            {
+                out.status = run.status;
+                out.signal = run.signal;
+                break;
+            }
+
+            accumulator.add(run.result);
+            out.repetitions += 1;
+            out.sample_count = run.sample_count;
+        }
+
+        out.result = accumulator.result();
+        return out;
+    }
+
+    static int64_t run_registered(Run_Result* results, int64_t capacity, Run_Options const& options, const char* filter) noexcept
+    {
+        Bench_Registry const& registry = bench_registry();
+
+        std::unique_ptr<Bench_Entry const*[]> selected(new Bench_Entry const*[(size_t) registry.count]);
+        int64_t selected_count = 0;
+        for(int64_t i = 0; i < registry.count; i++)
+            if(filter == nullptr || strstr(registry.entries[i].name, filter) != nullptr)
+                selected[selected_count++] = &registry.entries[i];
+
+        if(selected_count > capacity)
+            selected_count = capacity;
+
+        #ifdef MICROBENCH_LINUX
+            if(options.isolation == ISOLATION_FORK && options.parallel != 1)
+            {
+                //both are large so they live on the heap
+                std::unique_ptr<Cpu_Topology> topology(new Cpu_Topology());
+                std::unique_ptr<int32_t[]> cpus(new int32_t[MAX_CPUS]);
+                query_cpu_topology(topology.get());
+                int64_t cpu_count = select_benchmark_cpus(*topology, cpus.get(), MAX_CPUS);
+                if(options.parallel > 1 && cpu_count > options.parallel)
+                    cpu_count = options.parallel;
+
+                if(cpu_count > 0)
+                {
+                    suite_internal::run_parallel(selected.get(), results, selected_count, options, cpus.get(), cpu_count, *topology);
+                    return selected_count;
+                }
+            }
+        #endif
+
+        for(int64_t i = 0; i < selected_count; i++)
+            results[i] = run_benchmark(*selected[i], options);
+
+        return selected_count;
+    }
+}
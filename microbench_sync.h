@@ -0,0 +1,394 @@
+#pragma once
+#include "microbench_threads.h"
+#include <condition_variable>
+
+//Costs of atomic operations and synchronization primitives, uncontended and contended over any number of threads.
+namespace microbench
+{
+    enum Sync_Op
+    {
+        SYNC_LOAD = 0,
+        SYNC_STORE,
+        SYNC_EXCHANGE,
+        SYNC_FETCH_ADD,
+        SYNC_CAS,         //single compare_exchange_strong attempt (which fails under contention)
+        SYNC_MUTEX,       //std::mutex lock + unlock with an empty critical section
+        SYNC_SPIN_TAS,    //test and set spinlock lock + unlock
+        SYNC_SPIN_TTAS,   //test and test and set spinlock lock + unlock
+        SYNC_SPIN_TICKET, //ticket spinlock lock + unlock
+        SYNC_OP_COUNT,
+    };
+
+    enum Sync_Order
+    {
+        SYNC_RELAXED = 0,
+        SYNC_ACQUIRE_RELEASE = 1, //acquire for loads, release for stores, acq_rel for read-modify-write
+        SYNC_SEQ_CST = 2,
+        SYNC_ORDER_COUNT,
+    };
+
+    struct Sync_Options
+    {
+        int64_t thread_count = 1;
+        int32_t const* cpus = nullptr; //pin thread i to cpus[i] when not null
+        //All threads use the same variable/lock. Else each thread has its own on a separate cache line
+        bool contended = true;
+        int64_t ops_per_call = 100;
+        int64_t max_time_ms = 200;
+        int64_t warm_up_ms = 20;
+    };
+
+    struct Sync_Result
+    {
+        Threads_Result threads; //per single op (per thread)
+        double ns_per_op = 0.0;
+        double ops_per_second = 0.0; //of all threads together
+    };
+
+    //Measures the op on options.thread_count threads at once. Locks ignore order.
+    static Sync_Result benchmark_sync_op(int32_t op, int32_t order, Sync_Options const& options) noexcept;
+
+    struct Sync_Point
+    {
+        int32_t op = 0;
+        int32_t order = 0;
+        int64_t thread_count = 0;
+        bool contended = false;
+        Sync_Result result;
+    };
+
+    //Runs benchmark_sync_op for every op, memory order (only one for locks), contended and uncontended
+    // and for 1, 2, 4... up to max_threads threads. Writes at most capacity points and returns their count.
+    static int64_t benchmark_sync_suite(Sync_Options const& options, int64_t max_threads, Sync_Point* points, int64_t capacity) noexcept;
+
+    enum Handoff
+    {
+        HANDOFF_FUTEX = 0,   //waiter sleeps in futex wait, the other thread wakes it
+        HANDOFF_CONDVAR = 1, //std::condition_variable + std::mutex
+    };
+
+    //Measures how long it takes to wake another (sleeping) thread. Two threads pinned to cpu_a and cpu_b
+    // keep waking each other. The result is the one way latency (half of the round trip).
+    // Returns zero result when the handoff is not supported on this platform.
+    static Bench_Result benchmark_handoff(int32_t handoff, int32_t cpu_a, int32_t cpu_b, int64_t time_ms = 200) noexcept;
+
+    static const char* sync_op_name(int32_t op) noexcept;
+    static const char* sync_order_name(int32_t order) noexcept;
+
+    //Spinlocks measured by the suite. When spinning for too long they yield so that they dont livelock
+    // when there are more threads than cpus.
+    struct Tas_Lock
+    {
+        std::atomic<int32_t> locked = {0};
+        void lock() noexcept;
+        void unlock() noexcept { locked.store(0, std::memory_order_release); }
+    };
+
+    struct Ttas_Lock
+    {
+        std::atomic<int32_t> locked = {0};
+        void lock() noexcept;
+        void unlock() noexcept { locked.store(0, std::memory_order_release); }
+    };
+
+    struct Ticket_Lock
+    {
+        std::atomic<int32_t> next = {0};
+        std::atomic<int32_t> serving = {0};
+        void lock() noexcept;
+        void unlock() noexcept { serving.store(serving.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    };
+}
+
+//Implementation
+namespace microbench
+{
+    namespace sync_internal
+    {
+        static constexpr int64_t SPINS_BEFORE_YIELD = 1024;
+
+        FORCE_INLINE static void cpu_relax(int64_t* spins) noexcept
+        {
+            if(++*spins >= SPINS_BEFORE_YIELD)
+            {
+                *spins = 0;
+                std::this_thread::yield();
+                return;
+            }
+
+            #if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+            #elif defined(__aarch64__)
+                asm volatile("yield");
+            #endif
+        }
+
+        //memory orders have to be compile time constants else the compiler just uses seq_cst
+        template <int32_t Order> struct Orders {};
+        template <> struct Orders<SYNC_RELAXED>         { static constexpr std::memory_order load = std::memory_order_relaxed, store = std::memory_order_relaxed, rmw = std::memory_order_relaxed; };
+        template <> struct Orders<SYNC_ACQUIRE_RELEASE> { static constexpr std::memory_order load = std::memory_order_acquire, store = std::memory_order_release, rmw = std::memory_order_acq_rel; };
+        template <> struct Orders<SYNC_SEQ_CST>         { static constexpr std::memory_order load = std::memory_order_seq_cst, store = std::memory_order_seq_cst, rmw = std::memory_order_seq_cst; };
+
+        template <int32_t Op, int32_t Order>
+        static Threads_Result run_atomic(Sync_Options const& options, int64_t thread_count, int64_t ops) noexcept
+        {
+            typedef Orders<Order> O;
+            threads_internal::Strided_Array<std::atomic<int64_t>> values(options.contended ? 1 : thread_count, threads_internal::PADDING);
+            return benchmark_threads(thread_count, options.cpus, options.max_time_ms, options.warm_up_ms, [&](int64_t t){
+                std::atomic<int64_t>* value = values.at(options.contended ? 0 : t);
+                int64_t local = 0;
+                for(int64_t i = 0; i < ops; i++)
+                {
+                    switch(Op)
+                    {
+                        case SYNC_LOAD:      local += value->load(O::load); break;
+                        case SYNC_STORE:     value->store(i, O::store); break;
+                        case SYNC_EXCHANGE:  local += value->exchange(i, O::rmw); break;
+                        case SYNC_FETCH_ADD: local += value->fetch_add(1, O::rmw); break;
+                        //on failure local gets the current value so the next attempt has a chance
+                        case SYNC_CAS:       value->compare_exchange_strong(local, local + 1, O::rmw, std::memory_order_relaxed); break;
+                    }
+                }
+                do_no_optimize(local);
+                return true;
+            }, nullptr, ops);
+        }
+
+        template <typename Lock>
+        static Threads_Result run_lock(Sync_Options const& options, int64_t thread_count, int64_t ops) noexcept
+        {
+            threads_internal::Strided_Array<Lock> locks(options.contended ? 1 : thread_count, (sizeof(Lock) + threads_internal::PADDING - 1) / threads_internal::PADDING * threads_internal::PADDING);
+            return benchmark_threads(thread_count, options.cpus, options.max_time_ms, options.warm_up_ms, [&](int64_t t){
+                Lock* lock = locks.at(options.contended ? 0 : t);
+                for(int64_t i = 0; i < ops; i++)
+                {
+                    lock->lock();
+                    read_write_barrier();
+                    lock->unlock();
+                }
+                return true;
+            }, nullptr, ops);
+        }
+
+        template <int32_t Order>
+        static Threads_Result run_atomic_op(int32_t op, Sync_Options const& options, int64_t thread_count, int64_t ops) noexcept
+        {
+            switch(op)
+            {
+                case SYNC_LOAD:      return run_atomic<SYNC_LOAD, Order>(options, thread_count, ops);
+                case SYNC_STORE:     return run_atomic<SYNC_STORE, Order>(options, thread_count, ops);
+                case SYNC_EXCHANGE:  return run_atomic<SYNC_EXCHANGE, Order>(options, thread_count, ops);
+                case SYNC_FETCH_ADD: return run_atomic<SYNC_FETCH_ADD, Order>(options, thread_count, ops);
+                case SYNC_CAS:       return run_atomic<SYNC_CAS, Order>(options, thread_count, ops);
+                default:             return Threads_Result();
+            }
+        }
+    }
+
+    inline void Tas_Lock::lock() noexcept
+    {
+        int64_t spins = 0;
+        while(locked.exchange(1, std::memory_order_acquire) != 0)
+            sync_internal::cpu_relax(&spins);
+    }
+
+    inline void Ttas_Lock::lock() noexcept
+    {
+        int64_t spins = 0;
+        while(true)
+        {
+            if(locked.load(std::memory_order_relaxed) == 0 && locked.exchange(1, std::memory_order_acquire) == 0)
+                return;
+            sync_internal::cpu_relax(&spins);
+        }
+    }
+
+    inline void Ticket_Lock::lock() noexcept
+    {
+        int64_t spins = 0;
+        int32_t ticket = next.fetch_add(1, std::memory_order_relaxed);
+        while(serving.load(std::memory_order_acquire) != ticket)
+            sync_internal::cpu_relax(&spins);
+    }
+
+    static Sync_Result benchmark_sync_op(int32_t op, int32_t order, Sync_Options const& options) noexcept
+    {
+        using namespace sync_internal;
+        Sync_Result out;
+        int64_t thread_count = options.thread_count > 0 ? options.thread_count : 1;
+        if(thread_count > MAX_BENCH_THREADS)
+            thread_count = MAX_BENCH_THREADS;
+        int64_t ops = options.ops_per_call > 0 ? options.ops_per_call : 1;
+
+        switch(op)
+        {
+            case SYNC_MUTEX:       out.threads = run_lock<std::mutex>(options, thread_count, ops); break;
+            case SYNC_SPIN_TAS:    out.threads = run_lock<Tas_Lock>(options, thread_count, ops); break;
+            case SYNC_SPIN_TTAS:   out.threads = run_lock<Ttas_Lock>(options, thread_count, ops); break;
+            case SYNC_SPIN_TICKET: out.threads = run_lock<Ticket_Lock>(options, thread_count, ops); break;
+            default: {
+                if(order == SYNC_RELAXED)
+                    out.threads = run_atomic_op<SYNC_RELAXED>(op, options, thread_count, ops);
+                else if(order == SYNC_ACQUIRE_RELEASE)
+                    out.threads = run_atomic_op<SYNC_ACQUIRE_RELEASE>(op, options, thread_count, ops);
+                else
+                    out.threads = run_atomic_op<SYNC_SEQ_CST>(op, options, thread_count, ops);
+            }
+        }
+
+        out.ns_per_op = out.threads.combined.mean_ms * 1e6;
+        out.ops_per_second = out.threads.calls_per_second;
+        return out;
+    }
+
+    static int64_t benchmark_sync_suite(Sync_Options const& options, int64_t max_threads, Sync_Point* points, int64_t capacity) noexcept
+    {
+        //1, 2, 4... and max_threads itself
+        int64_t thread_counts[64] = {0};
+        int64_t thread_count_count = 0;
+        for(int64_t threads = 1; threads < max_threads && thread_count_count < 63; threads *= 2)
+            thread_counts[thread_count_count++] = threads;
+        thread_counts[thread_count_count++] = max_threads > 0 ? max_threads : 1;
+
+        int64_t count = 0;
+        for(int64_t i = 0; i < thread_count_count; i++)
+            for(int32_t op = 0; op < SYNC_OP_COUNT; op++)
+            {
+                int64_t threads = thread_counts[i];
+                int32_t order_count = op >= SYNC_MUTEX ? 1 : SYNC_ORDER_COUNT;
+                for(int32_t order = 0; order < order_count; order++)
+                    //with a single thread contended and uncontended are the same thing
+                    for(int contended = 0; contended < (threads > 1 ? 2 : 1); contended++)
+                    {
+                        if(count >= capacity)
+                            return count;
+
+                        Sync_Options at = options;
+                        at.thread_count = threads;
+                        at.contended = contended != 0;
+
+                        Sync_Point* point = &points[count++];
+                        point->op = op;
+                        point->order = order;
+                        point->thread_count = threads;
+                        point->contended = at.contended;
+                        point->result = benchmark_sync_op(op, order, at);
+                    }
+            }
+
+        return count;
+    }
+
+    static Bench_Result benchmark_handoff(int32_t handoff, int32_t cpu_a, int32_t cpu_b, int64_t time_ms) noexcept
+    {
+        //Same protocol as ping_pong: the value is incremented to odd by ping and to even by pong.
+        // Whoever waits for the other sleeps until woken up.
+        static constexpr int32_t STOP = -1;
+        Bench_Result result;
+
+        if(handoff == HANDOFF_FUTEX)
+        {
+            std::atomic<int32_t> word = {0};
+            if(futex_wake(&word, 1) < 0)
+                return result;
+
+            std::thread pong([&]{
+                pin_thread_to_cpu(cpu_b);
+                while(true)
+                {
+                    int32_t value = word.load(std::memory_order_acquire);
+                    if(value == STOP)
+                        break;
+
+                    if(value & 1)
+                    {
+                        word.store(value + 1, std::memory_order_release);
+                        futex_wake(&word, 1);
+                    }
+                    else
+                        futex_wait(&word, value);
+                }
+            });
+
+            std::thread ping([&]{
+                pin_thread_to_cpu(cpu_a);
+                result = benchmark(time_ms, time_ms / 10 + 1, [&]{
+                    int32_t value = word.load(std::memory_order_relaxed);
+                    word.store(value + 1, std::memory_order_release);
+                    futex_wake(&word, 1);
+
+                    for(int32_t current = value + 1; current != value + 2; current = word.load(std::memory_order_acquire))
+                        futex_wait(&word, current);
+                    return true;
+                });
+            });
+
+            ping.join();
+            word.store(STOP, std::memory_order_release);
+            futex_wake(&word, 1);
+            pong.join();
+        }
+        else if(handoff == HANDOFF_CONDVAR)
+        {
+            std::mutex mutex;
+            std::condition_variable changed;
+            int32_t shared = 0;
+
+            std::thread pong([&]{
+                pin_thread_to_cpu(cpu_b);
+                std::unique_lock<std::mutex> lock(mutex);
+                while(shared != STOP)
+                {
+                    if(shared & 1)
+                    {
+                        shared += 1;
+                        changed.notify_one();
+                    }
+                    else
+                        changed.wait(lock);
+                }
+            });
+
+            std::thread ping([&]{
+                pin_thread_to_cpu(cpu_a);
+                result = benchmark(time_ms, time_ms / 10 + 1, [&]{
+                    std::unique_lock<std::mutex> lock(mutex);
+                    int32_t value = shared;
+                    shared += 1;
+                    changed.notify_one();
+                    while(shared != value + 2)
+                        changed.wait(lock);
+                    return true;
+                });
+            });
+
+            ping.join();
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                shared = STOP;
+            }
+            changed.notify_all();
+            pong.join();
+        }
+
+        //one way
+        result.mean_ms /= 2;
+        result.deviation_ms /= 2;
+        result.min_ms /= 2;
+        result.max_ms /= 2;
+        result.mean_ci_ms /= 2;
+        return result;
+    }
+
+    static const char* sync_op_name(int32_t op) noexcept
+    {
+        static const char* const names[] = {"load", "store", "exchange", "fetch_add", "cas", "mutex", "spin_tas", "spin_ttas", "spin_ticket"};
+        return op >= 0 && op < SYNC_OP_COUNT ? names[op] : "unknown";
+    }
+
+    static const char* sync_order_name(int32_t order) noexcept
+    {
+        static const char* const names[] = {"relaxed", "acquire_release", "seq_cst"};
+        return order >= 0 && order < SYNC_ORDER_COUNT ? names[order] : "unknown";
+    }
+}
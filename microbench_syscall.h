@@ -0,0 +1,224 @@
+#pragma once
+#include "microbench_os.h"
+#include <thread>
+
+#ifdef MICROBENCH_LINUX
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+    #include <sys/eventfd.h>
+#endif
+
+//Costs of crossing the kernel boundary: trivial syscalls, vDSO vs real syscalls, pipes, eventfd,
+// futex, mmap and thread/process creation. Useful to know where the per request kernel time goes
+// and to see what the kernel mitigations of the day cost.
+namespace microbench
+{
+    struct Syscall_Options
+    {
+        int64_t max_time_ms = 200; //for each of the points
+        int64_t warm_up_ms = 20;
+        bool threads = true;   //thread create + join
+        bool processes = true; //fork + exit + wait
+    };
+
+    struct Syscall_Point
+    {
+        const char* name = "";
+        Bench_Result result; //per single call
+    };
+
+    //Measures (in order):
+    //  harness_clock       - calculate_clock_stats() of the harness itself (min, max and average between two clock_ns() calls)
+    //  clock_ns            - clock_ns() of the harness through benchmark()
+    //  getpid              - glibc getpid()
+    //  syscall_getpid      - the raw syscall (always enters the kernel)
+    //  clock_gettime_vdso  - clock_gettime(CLOCK_MONOTONIC) served by the vDSO
+    //  clock_gettime_syscall - the same through the raw syscall
+    //  pipe_write, pipe_read - 1 byte. Filling/draining the pipe is excluded through reject
+    //  eventfd_write_read  - write + read of the counter
+    //  futex_wake          - wake with nobody waiting
+    //  mmap_munmap         - anonymous 4K mapping, not touched
+    //  mmap_touch_munmap   - the same but with the page touched (includes the page fault)
+    //  thread_create_join  - std::thread
+    //  fork_exit_wait      - fork, _exit in the child and waitpid
+    //Writes at most capacity points and returns their count. On other platforms only the first two are measured.
+    static int64_t benchmark_syscalls(Syscall_Options const& options, Syscall_Point* points, int64_t capacity) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    static int64_t benchmark_syscalls(Syscall_Options const& options, Syscall_Point* points, int64_t capacity) noexcept
+    {
+        using namespace benchmark_internal;
+        int64_t count = 0;
+        auto add = [&](const char* name, Bench_Result const& result){
+            if(count < capacity)
+            {
+                points[count].name = name;
+                points[count].result = result;
+                count += 1;
+            }
+        };
+
+        auto measure = [&](const char* name, auto fn){
+            if(count < capacity)
+                add(name, benchmark(options.max_time_ms, options.warm_up_ms, fn));
+        };
+
+        //the numbers the harness uses to decide on batching
+        {
+            using namespace microbench::time_consts;
+            const int64_t runs = 10000;
+            Clock_Stats clock_stats = calculate_clock_stats(runs);
+            Bench_Result clock;
+            clock.mean_ms = (double) clock_stats.average / MILISECOND_NANOSECONDS;
+            clock.min_ms = (double) clock_stats.min / MILISECOND_NANOSECONDS;
+            clock.max_ms = (double) clock_stats.max / MILISECOND_NANOSECONDS;
+            clock.batch_size = 1;
+            clock.iters = runs;
+            add("harness_clock", clock);
+        }
+
+        measure("clock_ns", []{
+            do_no_optimize(clock_ns());
+            return true;
+        });
+
+        #ifdef MICROBENCH_LINUX
+            measure("getpid", []{
+                do_no_optimize(getpid());
+                return true;
+            });
+
+            measure("syscall_getpid", []{
+                do_no_optimize(syscall(SYS_getpid));
+                return true;
+            });
+
+            measure("clock_gettime_vdso", []{
+                struct timespec time = {};
+                clock_gettime(CLOCK_MONOTONIC, &time);
+                do_no_optimize(time);
+                return true;
+            });
+
+            measure("clock_gettime_syscall", []{
+                struct timespec time = {};
+                syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &time);
+                do_no_optimize(time);
+                return true;
+            });
+
+            int fds[2] = {-1, -1};
+            if(pipe(fds) == 0)
+            {
+                //the pipe buffer is 64K by default. We stay well below it and refill/drain
+                // in a rejected batch when needed
+                const int64_t max_pending = 4096;
+                char buffer[4096] = {0};
+                int64_t pending = 0;
+                //once a read or write fails pending is no longer to be trusted so we reject
+                // everything that is left of the pipe points (their results end up with 0 iters)
+                bool failed = false;
+                auto transfer = [&](ssize_t done, int64_t sign){
+                    if(done <= 0)
+                        failed = true;
+                    else
+                        pending += sign * (int64_t) done;
+                    return failed == false;
+                };
+
+                measure("pipe_write", [&]{
+                    if(failed)
+                        return false;
+
+                    if(pending >= max_pending)
+                    {
+                        while(pending > 0 && transfer(read(fds[0], buffer, sizeof buffer), -1));
+                        return false;
+                    }
+
+                    return transfer(write(fds[1], buffer, 1), 1);
+                });
+
+                measure("pipe_read", [&]{
+                    if(failed)
+                        return false;
+
+                    if(pending <= 0)
+                    {
+                        while(pending < max_pending && transfer(write(fds[1], buffer, sizeof buffer), 1));
+                        return false;
+                    }
+
+                    return transfer(read(fds[0], buffer, 1), -1);
+                });
+
+                close(fds[0]);
+                close(fds[1]);
+            }
+
+            int event = eventfd(0, 0);
+            if(event >= 0)
+            {
+                measure("eventfd_write_read", [&]{
+                    uint64_t value = 1;
+                    ssize_t written = write(event, &value, sizeof value);
+                    ssize_t was_read = read(event, &value, sizeof value);
+                    do_no_optimize(written);
+                    do_no_optimize(was_read);
+                    return true;
+                });
+                close(event);
+            }
+
+            std::atomic<int32_t> word = {0};
+            measure("futex_wake", [&]{
+                do_no_optimize(futex_wake(&word, 1));
+                return true;
+            });
+
+            const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            measure("mmap_munmap", [&]{
+                void* mapping = mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                do_no_optimize(mapping);
+                munmap(mapping, page);
+                return true;
+            });
+
+            measure("mmap_touch_munmap", [&]{
+                void* mapping = mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(mapping == MAP_FAILED)
+                    return false;
+                *(char volatile*) mapping = 1;
+                munmap(mapping, page);
+                return true;
+            });
+
+            if(options.threads)
+                measure("thread_create_join", []{
+                    std::thread thread([]{});
+                    thread.join();
+                    return true;
+                });
+
+            if(options.processes)
+                measure("fork_exit_wait", []{
+                    pid_t child = fork();
+                    if(child == 0)
+                        _exit(0);
+                    if(child < 0)
+                        return false;
+
+                    int status = 0;
+                    waitpid(child, &status, 0);
+                    return true;
+                });
+        #else
+            (void) options;
+        #endif
+
+        return count;
+    }
+}
@@ -0,0 +1,452 @@
+#pragma once
+#include "microbench_probes.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <new>
+
+//Benchmarks involving multiple threads pinned to specific cpus.
+namespace microbench
+{
+    static constexpr int64_t MAX_BENCH_THREADS = 256;
+
+    //Barrier on which all threads spin. Reusable.
+    struct Spin_Barrier
+    {
+        std::atomic<int64_t> waiting = {0};
+        std::atomic<int64_t> generation = {0};
+        int64_t count = 0;
+
+        explicit Spin_Barrier(int64_t count) noexcept : count(count) {}
+        void wait() noexcept;
+    };
+
+    struct Threads_Result
+    {
+        Bench_Result combined; //statistics of a single run over all threads (see Result_Accumulator)
+        double calls_per_second = 0.0; //total throughput of all threads together (in runs so including runs_mult)
+        int64_t thread_count = 0;
+    };
+
+    //Multithreaded version of benchmark(). Starts thread_count threads (pinned to cpus[i] when cpus is not null)
+    // which all wait on a barrier and then simultaneously run the same measuring loop as benchmark() calling 
+    // measured_fn(thread_index). Threads which finish early keep calling the function unmeasured until all 
+    // are done so that the load stays the same for the whole measurement. 
+    //probes[i] is the probe of i-th thread. per_thread (if not null) receives the result of each thread.
+    template <typename Probe, typename Fn> 
+    static Threads_Result benchmark_threads(Probe* probes, int64_t thread_count, int32_t const* cpus, int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, Bench_Result* per_thread = nullptr, int64_t runs_mult = 1) noexcept;
+    template <typename Fn> 
+    static Threads_Result benchmark_threads(int64_t thread_count, int32_t const* cpus, int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, Bench_Result* per_thread = nullptr, int64_t runs_mult = 1) noexcept;
+
+    struct False_Sharing_Options
+    {
+        int64_t thread_count = 2;
+        int32_t const* cpus = nullptr; //pin thread i to cpus[i] when not null
+        int64_t max_time_ms = 500;     //for each of the layouts
+        int64_t warm_up_ms = 50;
+
+        //perf event counted on every thread. The default is generic cache misses. For direct evidence use the
+        // model specific HITM event ie. for intel since skylake MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM:
+        // perf_type = PERF_TYPE_RAW (4), perf_config = 0x04d2
+        int32_t perf_counter = PERF_COUNTER_CACHE_MISSES; //Perf_Counter or -1 for raw
+        uint32_t perf_type = 0;
+        uint64_t perf_config = 0;
+    };
+
+    struct False_Sharing_Result
+    {
+        Threads_Result packed; //elements right next to each other
+        Threads_Result padded; //each element on its own cache line(s)
+        double slowdown = 0.0; //packed mean / padded mean. Clearly above 1 means false sharing
+
+        //average count of the perf event per run per thread or -1 if it could not be counted
+        double packed_events_per_iter = -1;
+        double padded_events_per_iter = -1;
+    };
+
+    //Runs measured_fn(T& element, int64_t thread_index) on options.thread_count threads each working on its own
+    // element of an array of T. First with the elements packed next to each other and then with each one padded 
+    // to its own cache line and reports the difference. Elements are value initialized so atomics work.
+    template <typename T, typename Fn>
+    static False_Sharing_Result benchmark_false_sharing(False_Sharing_Options const& options, Fn measured_fn) noexcept;
+
+    //Measures the one way latency of moving a cache line between every pair of the given cpus.
+    // Two threads pinned to the pair bounce an atomic counter on a single cache line and the round trip
+    // is measured with benchmark(). latency_ns must hold count * count values and receives the one way
+    // latency (half of the round trip) with latency_ns[i*count + j] being between cpus[i] and cpus[j].
+    // The diagonal is 0. When cpus is null all primary cpus (one per physical core) are used and count
+    // must be at least as big as their number. If given measured_cpus (of count capacity) receives the cpus 
+    // the rows and columns belong to. Returns the number of cpus measured or 0 on failure.
+    static int64_t measure_core_to_core(int32_t const* cpus, int64_t count, double* latency_ns, int64_t time_per_pair_ms = 10, int32_t* measured_cpus = nullptr) noexcept;
+
+    //Groups cpus into clusters (CCX, die, socket...) based on the measured latencies. Cpus with latency
+    // below a threshold are put into the same cluster. The threshold is placed into the largest relative
+    // gap between the sorted latencies. When there is no clear gap (below 30%) all cpus form a single cluster.
+    // clusters receives the cluster index of each cpu. Returns the number of clusters.
+    static int64_t cluster_core_to_core(double const* latency_ns, int64_t count, int32_t* clusters) noexcept;
+
+    //Writes the matrix as csv with a header row of cpu ids. The first two columns are the cpu and
+    // its cluster (-1 when clusters is null). Returns false if the file cannot be written.
+    static bool write_core_to_core_csv(const char* path, int32_t const* cpus, double const* latency_ns, int32_t const* clusters, int64_t count) noexcept;
+
+    //Writes the lowest cpu of each physical core into cpus. Returns their count.
+    static int64_t primary_cpus(Cpu_Topology const& topology, int32_t* cpus, int64_t capacity) noexcept;
+}
+
+//Implementation
+namespace microbench
+{
+    namespace threads_internal
+    {
+        //the destructive interference size on everything we care about (and the adjacent line
+        // prefetcher on intel makes pairs of lines behave as one so we pad to 128)
+        static constexpr int64_t CACHE_LINE = 64;
+        static constexpr int64_t PADDING = 128;
+
+        struct alignas(PADDING) Padded_Counter
+        {
+            std::atomic<int64_t> value = {0};
+        };
+
+        struct Ping_Pong
+        {
+            Padded_Counter line;
+            Padded_Counter stop;
+        };
+
+        //Array of T with each element starting at stride bytes from the previous one (stride is either sizeof(T)
+        // or a multiple of padding). Owns the memory.
+        template <typename T>
+        struct Strided_Array
+        {
+            void* memory = nullptr;
+            char* data = nullptr;
+            int64_t stride = 0;
+            int64_t count = 0;
+
+            Strided_Array(int64_t count, int64_t stride) noexcept : stride(stride), count(count)
+            {
+                memory = malloc((size_t) (count * stride + PADDING));
+                assert(memory != nullptr);
+                data = (char*) (((uintptr_t) memory + PADDING - 1) / PADDING * PADDING);
+                for(int64_t i = 0; i < count; i++)
+                    new (data + i*stride) T();
+            }
+
+            ~Strided_Array() noexcept
+            {
+                for(int64_t i = 0; i < count; i++)
+                    at(i)->~T();
+                free(memory);
+            }
+
+            T* at(int64_t i) noexcept { return (T*) (void*) (data + i*stride); }
+        };
+
+        //Returns the round trip of a cache line between the two cpus
+        static Bench_Result ping_pong(int32_t cpu_a, int32_t cpu_b, int64_t time_ms) noexcept
+        {
+            Ping_Pong shared;
+            Bench_Result result;
+            std::atomic<bool> ready = {false};
+
+            //echoes every odd value as the next even one
+            std::thread pong([&]{
+                pin_thread_to_cpu(cpu_b);
+                ready.store(true);
+                while(shared.stop.value.load(std::memory_order_relaxed) == 0)
+                {
+                    int64_t value = shared.line.value.load(std::memory_order_acquire);
+                    if(value & 1)
+                        shared.line.value.store(value + 1, std::memory_order_release);
+                }
+            });
+
+            std::thread ping([&]{
+                pin_thread_to_cpu(cpu_a);
+                while(ready.load() == false) {}
+
+                const auto round_trip = [&]{
+                    int64_t value = shared.line.value.load(std::memory_order_relaxed);
+                    shared.line.value.store(value + 1, std::memory_order_release);
+                    while(shared.line.value.load(std::memory_order_acquire) != value + 2) {}
+                    return true;
+                };
+
+                result = benchmark(time_ms, time_ms / 10 + 1, round_trip);
+            });
+
+            ping.join();
+            shared.stop.value.store(1);
+            pong.join();
+            return result;
+        }
+    }
+
+    inline void Spin_Barrier::wait() noexcept
+    {
+        int64_t my_generation = generation.load(std::memory_order_acquire);
+        if(waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == count)
+        {
+            waiting.store(0, std::memory_order_relaxed);
+            generation.fetch_add(1, std::memory_order_acq_rel);
+            return;
+        }
+
+        while(generation.load(std::memory_order_acquire) == my_generation) 
+            std::this_thread::yield();
+    }
+
+    template <typename Probe, typename Fn> 
+    static Threads_Result benchmark_threads(Probe* probes, int64_t thread_count, int32_t const* cpus, int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, Bench_Result* per_thread, int64_t runs_mult) noexcept
+    {
+        using namespace benchmark_internal;
+        assert(0 < thread_count && thread_count <= MAX_BENCH_THREADS);
+
+        (void) calculate_clock_stats(100); //warm up
+        Clock_Stats clock_stats = calculate_clock_stats(1000);
+        const int64_t batch_time_ns = 5 * clock_stats.average;
+
+        Spin_Barrier barrier(thread_count);
+        std::atomic<int64_t> finished = {0};
+        std::mutex result_mutex;
+        Result_Accumulator accumulator;
+        double calls_per_second = 0;
+
+        std::thread threads[MAX_BENCH_THREADS];
+        for(int64_t t = 0; t < thread_count; t++)
+        {
+            threads[t] = std::thread([&, t]{
+                if(cpus != nullptr)
+                    pin_thread_to_cpu(cpus[t]);
+
+                const auto thread_fn = [&]{ return measured_fn(t); };
+                barrier.wait();
+                Bench_Stats stats = gather_bench_stats(thread_fn, probes[t],
+                    max_time_ms * time_consts::MILISECOND_NANOSECONDS, 
+                    warm_up_ms * time_consts::MILISECOND_NANOSECONDS,
+                    batch_time_ns);
+
+                //keep the pressure on the others until everyone is done
+                finished.fetch_add(1);
+                while(finished.load(std::memory_order_relaxed) < thread_count)
+                    (void) thread_fn();
+
+                Bench_Result result = process_stats(stats, runs_mult);
+                probes[t].report(&result);
+
+                std::lock_guard<std::mutex> lock(result_mutex);
+                accumulator.add(result);
+                if(result.mean_ms > 0)
+                    calls_per_second += (double) time_consts::SECOND_MILISECONDS / result.mean_ms;
+                if(per_thread != nullptr)
+                    per_thread[t] = result;
+            });
+        }
+
+        for(int64_t t = 0; t < thread_count; t++)
+            threads[t].join();
+
+        Threads_Result out;
+        out.combined = accumulator.result();
+        out.calls_per_second = calls_per_second;
+        out.thread_count = thread_count;
+        return out;
+    }
+
+    template <typename Fn> 
+    static Threads_Result benchmark_threads(int64_t thread_count, int32_t const* cpus, int64_t max_time_ms, int64_t warm_up_ms, Fn measured_fn, Bench_Result* per_thread, int64_t runs_mult) noexcept
+    {
+        No_Probe probes[MAX_BENCH_THREADS];
+        return benchmark_threads(probes, thread_count, cpus, max_time_ms, warm_up_ms, measured_fn, per_thread, runs_mult);
+    }
+
+    template <typename T, typename Fn>
+    static False_Sharing_Result benchmark_false_sharing(False_Sharing_Options const& options, Fn measured_fn) noexcept
+    {
+        using namespace threads_internal;
+        False_Sharing_Result out;
+        int64_t thread_count = options.thread_count;
+
+        //padded stride is the size rounded up to whole padding blocks
+        int64_t packed_stride = (int64_t) sizeof(T);
+        int64_t padded_stride = (packed_stride + PADDING - 1) / PADDING * PADDING;
+
+        auto run = [&](int64_t stride, double* events_per_iter) -> Threads_Result {
+            Strided_Array<T> array(thread_count, stride);
+            std::unique_ptr<Perf_Probe[]> probes(new Perf_Probe[(size_t) thread_count]);
+            std::unique_ptr<Bench_Result[]> per_thread(new Bench_Result[(size_t) thread_count]);
+            for(int64_t t = 0; t < thread_count; t++)
+            {
+                if(options.perf_counter >= 0)
+                    probes[t].add((Perf_Counter) options.perf_counter, "false-sharing-event");
+                else
+                    probes[t].add_raw("false-sharing-event", options.perf_type, options.perf_config);
+            }
+
+            Threads_Result result = benchmark_threads(probes.get(), thread_count, options.cpus, options.max_time_ms, options.warm_up_ms, 
+                [&](int64_t t){ return measured_fn(*array.at(t), t); }, per_thread.get());
+
+            double events_sum = 0;
+            int64_t events_count = 0;
+            for(int64_t t = 0; t < thread_count; t++)
+                if(Counter_Stats const* events = find_counter(per_thread[t], "false-sharing-event"))
+                {
+                    events_sum += events->mean;
+                    events_count += 1;
+                }
+
+            if(events_count > 0)
+                *events_per_iter = events_sum / (double) events_count;
+
+            return result;
+        };
+
+        out.packed = run(packed_stride, &out.packed_events_per_iter);
+        out.padded = run(padded_stride, &out.padded_events_per_iter);
+        if(out.padded.combined.mean_ms > 0)
+            out.slowdown = out.packed.combined.mean_ms / out.padded.combined.mean_ms;
+
+        return out;
+    }
+
+    static int64_t primary_cpus(Cpu_Topology const& topology, int32_t* cpus, int64_t capacity) noexcept
+    {
+        int64_t count = 0;
+        for(int64_t i = 0; i < topology.count && count < capacity; i++)
+            if(topology.cpus[i].primary)
+                cpus[count++] = topology.cpus[i].cpu;
+
+        return count;
+    }
+
+    static int64_t measure_core_to_core(int32_t const* cpus, int64_t count, double* latency_ns, int64_t time_per_pair_ms, int32_t* measured_cpus) noexcept
+    {
+        std::unique_ptr<int32_t[]> primary;
+        if(cpus == nullptr)
+        {
+            std::unique_ptr<Cpu_Topology> topology(new Cpu_Topology());
+            primary.reset(new int32_t[MAX_CPUS]);
+            query_cpu_topology(topology.get());
+            int64_t primary_count = primary_cpus(*topology, primary.get(), MAX_CPUS);
+            if(primary_count > count)
+                return 0;
+
+            count = primary_count;
+            cpus = primary.get();
+        }
+
+        if(measured_cpus != nullptr)
+            memcpy(measured_cpus, cpus, (size_t) count * sizeof(int32_t));
+
+        //with a single cpu the two threads would just take turns on it
+        if(count < 2)
+            return 0;
+
+        //round trip time is symmetric so we only measure the upper triangle
+        for(int64_t i = 0; i < count; i++)
+        {
+            latency_ns[i*count + i] = 0.0;
+            for(int64_t j = i + 1; j < count; j++)
+            {
+                Bench_Result result = threads_internal::ping_pong(cpus[i], cpus[j], time_per_pair_ms);
+                double one_way = result.mean_ms * (double) time_consts::MILISECOND_NANOSECONDS / 2.0;
+                latency_ns[i*count + j] = one_way;
+                latency_ns[j*count + i] = one_way;
+            }
+        }
+
+        return count;
+    }
+
+    static int64_t cluster_core_to_core(double const* latency_ns, int64_t count, int32_t* clusters) noexcept
+    {
+        for(int64_t i = 0; i < count; i++)
+            clusters[i] = (int32_t) i;
+
+        if(count < 2)
+            return count;
+
+        //find the threshold: the largest relative gap between sorted off diagonal latencies.
+        // Gaps under 30% mean there is no structure and everything stays in one cluster
+        int64_t pair_count = count*(count - 1)/2;
+        std::unique_ptr<double[]> sorted(new double[(size_t) pair_count]);
+        int64_t pair = 0;
+        for(int64_t i = 0; i < count; i++)
+            for(int64_t j = i + 1; j < count; j++)
+                sorted[pair++] = latency_ns[i*count + j];
+        std::sort(sorted.get(), sorted.get() + pair_count);
+
+        double threshold = -1;
+        double best_ratio = 1.3;
+        for(int64_t i = 0; i + 1 < pair_count; i++)
+        {
+            double low = sorted[i];
+            double next = sorted[i + 1];
+            if(low > 0 && next / low > best_ratio)
+            {
+                best_ratio = next / low;
+                threshold = low;
+            }
+        }
+
+        //single linkage: cpus closer than the threshold end up in the same cluster.
+        // We keep relabeling to the lower label until nothing changes so each cluster
+        // ends up labeled with its lowest index
+        bool changed = true;
+        while(changed)
+        {
+            changed = false;
+            for(int64_t i = 0; i < count; i++)
+                for(int64_t j = 0; j < count; j++)
+                {
+                    bool close = threshold < 0 || latency_ns[i*count + j] <= threshold;
+                    if(i != j && close && clusters[j] > clusters[i])
+                    {
+                        clusters[j] = clusters[i];
+                        changed = true;
+                    }
+                }
+        }
+
+        //renumber to 0..cluster_count-1. The lowest index of each cluster comes first 
+        // so we temporarily store the new labels as negative numbers
+        int64_t cluster_count = 0;
+        for(int64_t i = 0; i < count; i++)
+        {
+            if(clusters[i] == (int32_t) i)
+                clusters[i] = (int32_t) -(++cluster_count);
+            else
+                clusters[i] = clusters[clusters[i]];
+        }
+
+        for(int64_t i = 0; i < count; i++)
+            clusters[i] = -clusters[i] - 1;
+
+        return cluster_count;
+    }
+
+    static bool write_core_to_core_csv(const char* path, int32_t const* cpus, double const* latency_ns, int32_t const* clusters, int64_t count) noexcept
+    {
+        FILE* file = fopen(path, "wb");
+        if(file == nullptr)
+            return false;
+
+        fprintf(file, "cpu,cluster");
+        for(int64_t j = 0; j < count; j++)
+            fprintf(file, ",%d", (int) cpus[j]);
+        fprintf(file, "\n");
+
+        for(int64_t i = 0; i < count; i++)
+        {
+            fprintf(file, "%d,%d", (int) cpus[i], clusters != nullptr ? (int) clusters[i] : -1);
+            for(int64_t j = 0; j < count; j++)
+                fprintf(file, ",%.2f", latency_ns[i*count + j]);
+            fprintf(file, "\n");
+        }
+
+        return fclose(file) == 0;
+    }
+}